@@ -0,0 +1,302 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Benchmarks for the meshing, decoding and encoding hot paths.
+//
+// All inputs are generated, so runs are reproducible. --size scales every input,
+// --repeat sets the number of timed runs of which the fastest is reported.
+// --json and --csv give machine readable output for tracking regressions.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <meshutils/mesh.hpp>
+#include <meshutils/scene.hpp>
+#include <meshutils/decoders/pdb_decoder.hpp>
+#include <meshutils/decoders/fbx_decoder.hpp>
+#include <meshutils/encoders/fbx_encoder.hpp>
+#include <meshutils/encoders/ply_encoder.hpp>
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+namespace {
+  struct result {
+    std::string name;
+    int size;           // the size parameter of the input, eg. the grid dimension
+    double seconds;     // fastest run
+    double items;       // items processed per run
+    const char *unit;   // what the items are
+    double bytes;       // bytes read or written per run, or zero
+  };
+
+  struct options {
+    int size = 1;
+    int repeat = 5;
+    const char *filter = "";
+    enum { text, json, csv } format = text;
+    unsigned num_threads = 0;
+  };
+
+  // Time run() repeat times, calling setup() before each run outside the timer.
+  template <class Setup, class Run>
+  double measure(const options &opts, Setup setup, Run run) {
+    double best = 1e37;
+    for (int r = 0; r != opts.repeat; ++r) {
+      setup();
+      auto start = std::chrono::steady_clock::now();
+      run();
+      auto end = std::chrono::steady_clock::now();
+      best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+  }
+
+  // A writer for ply_encoder that only counts bytes, so that the disk is not measured.
+  struct counting_writer {
+    size_t bytes = 0;
+    void write(const char *, size_t size) { bytes += size; }
+  };
+
+  // A few overlapping blobs in an n^3 grid, negative inside.
+  struct blobs {
+    glm::vec3 centre[5];
+    float recip_r2[5];
+
+    blobs(float n) {
+      for (int i = 0; i != 5; ++i) {
+        centre[i] = glm::vec3(0.3f + 0.1f * i, 0.5f + 0.15f * std::sin(i * 1.3f), 0.5f + 0.15f * std::cos(i * 1.7f)) * n;
+        float r = n * (0.12f + 0.02f * i);
+        recip_r2[i] = 1.0f / (r * r);
+      }
+    }
+
+    float operator()(float x, float y, float z) const {
+      float value = 1;
+      for (int i = 0; i != 5; ++i) {
+        float dx = x - centre[i].x, dy = y - centre[i].y, dz = z - centre[i].z;
+        value = std::min(value, (dx * dx + dy * dy + dz * dz) * recip_r2[i] - 1);
+      }
+      return value;
+    }
+  };
+
+  template <class Mesh>
+  void make_blobs(Mesh &result, int n, unsigned num_threads) {
+    typedef typename Mesh::vertex_t vertex_t;
+    blobs fn((float)n);
+    auto gen = [n](float x, float y, float z) {
+      glm::vec3 pos(x, y, z);
+      return vertex_t(pos, glm::vec3(1, 0, 0), glm::vec2(x, y) * (1.0f / n), glm::vec4(x / n, y / n, z / n, 1));
+    };
+    result = Mesh(n, n, n, fn, gen, num_threads, result.get_allocator());
+  }
+
+  // ATOM records in fixed columns with a simple pseudo random walk for the coordinates.
+  std::string make_pdb(int num_atoms) {
+    static const char *names[] = { " N  ", " CA ", " C  ", " O  ", " CB " };
+    static const char *elements[] = { " N", " C", " C", " O", " C" };
+    std::string result;
+    result.reserve((size_t)num_atoms * 81 + 100);
+    result += "HEADER    SYNTHETIC BENCHMARK STRUCTURE\n";
+    uint32_t seed = 12345;
+    float x = 0, y = 0, z = 0;
+    char line[96];
+    for (int i = 0; i != num_atoms; ++i) {
+      seed = seed * 1664525 + 1013904223;
+      x += ((seed >> 8) & 0xff) * (3.0f / 255) - 1.5f;
+      y += ((seed >> 16) & 0xff) * (3.0f / 255) - 1.5f;
+      z += ((seed >> 24) & 0xff) * (3.0f / 255) - 1.5f;
+      char chain = (char)('A' + (i / 10000) % 26);
+      snprintf(line, sizeof(line), "ATOM  %5d %s ALA %c%4d    %8.3f%8.3f%8.3f  1.00 20.00          %s  \n",
+        i % 100000, names[i % 5], chain, (i / 5) % 10000, x, y, z, elements[i % 5]);
+      result += line;
+    }
+    result += "END\n";
+    return result;
+  }
+
+  void run_benchmarks(const options &opts, std::vector<result> &results) {
+    auto enabled = [&opts](const char *name) { return strstr(name, opts.filter) != nullptr; };
+    auto add = [&results](const char *name, int size, double seconds, double items, const char *unit, double bytes) {
+      results.push_back(result{ name, size, seconds, items, unit, bytes });
+    };
+
+    int grid = 64 * opts.size;
+    // shared inputs for the later benchmarks.
+    meshutils::color_mesh mesh;
+    make_blobs(mesh, grid, opts.num_threads);
+    double num_vertices = (double)mesh.vertices().size();
+
+    if (enabled("marching_cubes")) {
+      meshutils::color_mesh m;
+      double t = measure(opts, []{}, [&]{ make_blobs(m, grid, opts.num_threads); });
+      add("marching_cubes", grid, t, (double)grid * grid * grid, "voxels", 0);
+    }
+
+    if (enabled("small_meshes")) {
+      // many small meshes, eg. ligands, on the heap and in an arena that is reset between jobs.
+      int num_meshes = 256 * opts.size;
+      double t = measure(opts, []{}, [&]{
+        for (int i = 0; i != num_meshes; ++i) {
+          meshutils::color_mesh m;
+          make_blobs(m, 16, 1);
+          m.reindex(true);
+        }
+      });
+      add("small_meshes", 16, t, (double)num_meshes, "meshes", 0);
+
+      meshutils::arena a;
+      t = measure(opts, []{}, [&]{
+        for (int i = 0; i != num_meshes; ++i) {
+          meshutils::arena_color_mesh m{meshutils::arena_allocator<meshutils::arena_color_mesh::vertex_t>(a)};
+          make_blobs(m, 16, 1);
+          m.reindex(true);
+          a.reset();
+        }
+      });
+      add("small_meshes_arena", 16, t, (double)num_meshes, "meshes", 0);
+    }
+
+    if (enabled("reindex")) {
+      // a triangle soup of the blobs, welded back together.
+      std::vector<meshutils::color_mesh::vertex_t> soup;
+      for (auto i : mesh.indices()) soup.push_back(mesh.vertices()[i]);
+      std::vector<uint32_t> soup_indices(soup.size());
+      for (size_t i = 0; i != soup.size(); ++i) soup_indices[i] = (uint32_t)i;
+
+      meshutils::color_mesh m;
+      double t = measure(opts, [&]{
+        m = meshutils::color_mesh(std::vector<meshutils::color_mesh::vertex_t>(soup), std::vector<uint32_t>(soup_indices));
+      }, [&]{
+        m.reindex(false, false, opts.num_threads);
+      });
+      add("reindex", grid, t, (double)soup.size(), "vertices", 0);
+
+      std::vector<glm::vec3> pos, unique_pos;
+      for (auto &v : soup) pos.push_back(v.pos());
+      std::vector<uint32_t> idx;
+      t = measure(opts, []{}, [&]{ meshutils::make_index(unique_pos, idx, pos); });
+      add("make_index", grid, t, (double)pos.size(), "vertices", 0);
+    }
+
+    if (enabled("pdb_decoder")) {
+      int num_atoms = 200000 * opts.size;
+      std::string pdb = make_pdb(num_atoms);
+      const uint8_t *begin = (const uint8_t *)pdb.data(), *end = begin + pdb.size();
+      size_t decoded = 0;
+      double t = measure(opts, []{}, [&]{
+        meshutils::pdb_decoder dec(begin, end, false, opts.num_threads);
+        decoded = dec.atoms().size();
+      });
+      add("pdb_decoder", num_atoms, t, (double)decoded, "atoms", (double)pdb.size());
+      t = measure(opts, []{}, [&]{
+        meshutils::pdb_decoder dec(begin, end, true, opts.num_threads);
+        decoded = dec.atoms().size();
+      });
+      add("pdb_decoder_eager", num_atoms, t, (double)decoded, "atoms", (double)pdb.size());
+    }
+
+    meshutils::scene scene;
+    scene.addMesh(&mesh);
+    scene.addNode(glm::mat4(1.0f), -1, 0);
+    std::vector<uint8_t> fbx;
+
+    if (enabled("fbx_encoder")) {
+      meshutils::fbx_encoder encoder;
+      double t = measure(opts, []{}, [&]{ fbx = encoder.saveScene(scene); });
+      add("fbx_encoder_saveScene", grid, t, num_vertices, "vertices", (double)fbx.size());
+    }
+
+    if (enabled("fbx_decoder")) {
+      if (fbx.empty()) fbx = meshutils::fbx_encoder().saveScene(scene);
+      const char *begin = (const char *)fbx.data(), *end = begin + fbx.size();
+      meshutils::scene loaded;
+      auto release = [&loaded]{
+        for (auto m : loaded.meshes()) delete m;
+        loaded = meshutils::scene();
+      };
+      double t = measure(opts, release, [&]{
+        meshutils::fbx_decoder dec(begin, end);
+        dec.loadScene<meshutils::color_mesh>(loaded, opts.num_threads);
+      });
+      release();
+      add("fbx_decoder_loadScene", grid, t, num_vertices, "vertices", (double)fbx.size());
+    }
+
+    if (enabled("ply_encoder")) {
+      meshutils::ply_encoder encoder;
+      size_t bytes = 0;
+      double t = measure(opts, []{}, [&]{
+        counting_writer writer;
+        encoder.encode(mesh, writer, true);
+        bytes = writer.bytes;
+      });
+      add("ply_encoder_ascii", grid, t, num_vertices, "vertices", (double)bytes);
+      t = measure(opts, []{}, [&]{
+        counting_writer writer;
+        encoder.encode(mesh, writer, false);
+        bytes = writer.bytes;
+      });
+      add("ply_encoder_binary", grid, t, num_vertices, "vertices", (double)bytes);
+    }
+  }
+
+  void print_results(const options &opts, const std::vector<result> &results) {
+    if (opts.format == options::json) {
+      printf("[\n");
+      for (size_t i = 0; i != results.size(); ++i) {
+        const result &r = results[i];
+        printf("  {\"name\": \"%s\", \"size\": %d, \"seconds\": %.6g, \"items\": %.0f, \"unit\": \"%s\", \"items_per_second\": %.6g, \"bytes\": %.0f, \"mb_per_second\": %.6g}%s\n",
+          r.name.c_str(), r.size, r.seconds, r.items, r.unit, r.items / r.seconds, r.bytes, r.bytes / r.seconds * 1e-6, i + 1 == results.size() ? "" : ",");
+      }
+      printf("]\n");
+    } else if (opts.format == options::csv) {
+      printf("name,size,seconds,items,unit,items_per_second,bytes,mb_per_second\n");
+      for (const result &r : results) {
+        printf("%s,%d,%.6g,%.0f,%s,%.6g,%.0f,%.6g\n", r.name.c_str(), r.size, r.seconds, r.items, r.unit, r.items / r.seconds, r.bytes, r.bytes / r.seconds * 1e-6);
+      }
+    } else {
+      printf("%-24s %8s %10s %16s %10s\n", "benchmark", "size", "ms", "throughput", "MB/s");
+      for (const result &r : results) {
+        char throughput[64], mbs[32] = "";
+        snprintf(throughput, sizeof(throughput), "%.3gM %s/s", r.items / r.seconds * 1e-6, r.unit);
+        if (r.bytes > 0) snprintf(mbs, sizeof(mbs), "%.1f", r.bytes / r.seconds * 1e-6);
+        printf("%-24s %8d %10.2f %16s %10s\n", r.name.c_str(), r.size, r.seconds * 1e3, throughput, mbs);
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  options opts;
+  for (int i = 1; i != argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "--size") && i + 1 < argc) {
+      opts.size = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(arg, "--repeat") && i + 1 < argc) {
+      opts.repeat = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(arg, "--threads") && i + 1 < argc) {
+      opts.num_threads = (unsigned)std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(arg, "--filter") && i + 1 < argc) {
+      opts.filter = argv[++i];
+    } else if (!strcmp(arg, "--json")) {
+      opts.format = options::json;
+    } else if (!strcmp(arg, "--csv")) {
+      opts.format = options::csv;
+    } else {
+      fprintf(stderr, "usage: benchmarks [--size n] [--repeat n] [--threads n] [--filter name] [--json|--csv]\n");
+      return 1;
+    }
+  }
+
+  std::vector<result> results;
+  run_benchmarks(opts, results);
+  print_results(opts, results);
+  return 0;
+}
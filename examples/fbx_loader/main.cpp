@@ -11,9 +11,13 @@
 
 int main(int argc, char **argv) {
   const char *filename = nullptr;
+  bool dump = false;
   for (int i = 1; i != argc; ++i) {
     const char *arg = argv[i];
-    if (arg[0] == '-') {
+    if (!strcmp(arg, "-d")) {
+      // write text dumps of the input and re-encoded files to 1.txt and 2.txt
+      dump = true;
+    } else if (arg[0] == '-') {
       printf("invalid argument %s\n", arg);
     } else {
       filename = arg;
@@ -24,22 +28,15 @@ int main(int argc, char **argv) {
     filename = CMAKE_SOURCE "/examples/data/cube.fbx";
   }
 
-  std::ifstream file(filename, std::ios_base::binary);
-  std::vector<char> text;
-  if (!file.eof() && !file.fail()) {
-    file.seekg(0, std::ios_base::end);
-    text.resize((size_t)file.tellg());
-
-    file.seekg(0, std::ios_base::beg);
-    file.read((char*)text.data(), text.size());
-    meshutils::fbx_decoder fbx(text.data(), text.data() + text.size());
-
-    std::ofstream txt1("1.txt", std::ios_base::binary);
-    std::ofstream txt2("2.txt", std::ios_base::binary);
+  meshutils::fbx_decoder fbx;
+  if (fbx.open(filename)) {
 
     const char *out_filename = "test.fbx";
 
-    txt1 << fbx;
+    if (dump) {
+      std::ofstream txt1("1.txt", std::ios_base::binary);
+      txt1 << fbx;
+    }
 
     meshutils::scene scene;
     fbx.loadScene<meshutils::color_mesh>(scene);
@@ -59,8 +56,11 @@ int main(int argc, char **argv) {
     }
     printf("\n");*/
 
-    meshutils::fbx_decoder fbx2(beg, end);
-    txt2 << fbx2;
+    if (dump) {
+      meshutils::fbx_decoder fbx2(beg, end);
+      std::ofstream txt2("2.txt", std::ios_base::binary);
+      txt2 << fbx2;
+    }
 
     std::ofstream outfile("out.fbx", std::ios_base::binary);
     outfile.write(beg, end-beg);
@@ -10,6 +10,8 @@
 #include <meshutils/mesh.hpp>
 #include <meshutils/decoders/pdb_decoder.hpp>
 #include <meshutils/encoders/fbx_encoder.hpp>
+#include <meshutils/spatial_grid.hpp>
+#include <meshutils/stats.hpp>
 
 #include <glm/glm.hpp>
 
@@ -17,8 +19,6 @@
 #include <fstream>
 #include <cmath>
 #include <algorithm>
-#include <thread>
-#include <future>
 #include <numeric>
 
 
@@ -35,29 +35,6 @@ const char *fmt(const char *str, P... params) {
   return buf;
 }
 
-template <class F>
-void par_for(int begin, int end, F fn) {
-  std::atomic<int> idx;
-  idx = begin;
-  int num_cpus = std::thread::hardware_concurrency();
-  std::vector<std::future<void>> futures(num_cpus);
-  for (int cpu = 0; cpu != num_cpus; ++cpu) {
-    futures[cpu] = std::async(std::launch::async, [cpu, &idx, end, &fn]() {
-      for (;;) {
-        int i = idx++;
-        printf("[%d %d]", i, cpu);
-        fflush(stdout);
-        if (i >= end) break;
-        fn(i);
-      }
-    });
-  }
-  for (int cpu = 0; cpu != num_cpus; ++cpu) {
-    futures[cpu].get();
-  }
-  printf("\n");
-}
-
 class molecules {
 public:
   molecules(int argc, char **argv) {
@@ -66,6 +43,7 @@ public:
     const char *grid_spacing_text = "0.25";
     bool error = false;
     bool list_chains = false;
+    bool print_stats = false;
     const char *chains = "A-Z";
 
     for (int i = 1; i != argc; ++i) {
@@ -80,6 +58,8 @@ public:
         error = true;
       } else if (!strcmp(arg, "--list-chains")) {
         list_chains = true;
+      } else if (!strcmp(arg, "--stats")) {
+        print_stats = true;
       } else if (arg[0] == '-') {
         printf("invalid argument %s\n", arg);
         error = true;
@@ -101,25 +81,23 @@ public:
         "--chains <n>\teg. A-E or ABDEG set of chains to use for generating FBX files. defaults to A-Z...\n"
         "--list-chains <n>\tjust list the chains in the PDB file\n"
         "--output-path <dir>\tdirectory to output files to\n"
+        "--stats\tprint the time spent decoding and encoding\n"
         "--help <n>\tshow this text\n"
       ); return; }
 
     const char *filename = "out";
 
-    //std::ifstream file(CMAKE_SOURCE "/examples/data/2PTC.pdb", std::ios_base::binary);
-    std::ifstream file(pdb_filename, std::ios_base::binary);
-    std::vector<uint8_t> text;
-    if (!file.eof() && !file.fail()) {
-      file.seekg(0, std::ios_base::end);
-      text.resize((size_t)file.tellg());
-
-      file.seekg(0, std::ios_base::beg);
-      file.read((char*)text.data(), text.size());
-    } 
-  
-    meshutils::pdb_decoder pdb(text.data(), text.data() + text.size());
+    //meshutils::pdb_decoder pdb(CMAKE_SOURCE "/examples/data/2PTC.pdb");
+    meshutils::stats_recorder stats;
+    meshutils::pdb_decoder pdb;
+    if (print_stats) pdb.setStats(&stats);
+    if (!pdb.open(pdb_filename, true)) {
+      printf("unable to open %s\n", pdb_filename);
+      return;
+    }
 
     meshutils::fbx_encoder encoder;
+    if (print_stats) encoder.setStats(&stats);
     std::string pdb_chains = pdb.chains();
   
     if (list_chains) {
@@ -127,36 +105,29 @@ public:
       return;
     }
 
-    std::vector<glm::vec3> pos;
-    std::vector<float> radii;
-    std::vector<glm::vec4> colors;
-
-    auto addChain = [&](char chainID) {
-      std::vector<glm::vec3> xpos = pdb.pos(chainID);
-      std::vector<float> xradii = pdb.radii(chainID);
-      std::vector<glm::vec4> xcolors = pdb.colorsByFunction(chainID);
-      pos.insert(pos.end(), xpos.begin(), xpos.end());
-      radii.insert(radii.end(), xradii.begin(), xradii.end());
-      colors.insert(colors.end(), xcolors.begin(), xcolors.end());
-    };
-
+    std::string selected;
     for (const char *p = chains; *p; ++p) {
-      if (p[1] == '-' && p[2] && p[2] >= p[1]) {
-        for (char i = p[1]; i <= p[2]; ++i) {
-          addChain(i);
+      if (p[1] == '-' && p[2] && p[2] >= p[0]) {
+        for (char i = p[0]; i <= p[2]; ++i) {
+          selected.push_back(i);
         }
         p += 2;
       } else {
-        addChain(*p);
+        selected.push_back(*p);
       }
     }
 
+    std::vector<glm::vec3> pos = pdb.pos(selected);
+    std::vector<float> radii = pdb.radii(selected);
+    std::vector<glm::vec4> colors = pdb.colorsByFunction(selected);
+
     struct colored_atom {
       glm::vec4 color;
       glm::vec3 pos;
       float radius;
     };
     std::vector<colored_atom> colored_atoms;
+    colored_atoms.reserve(colors.size());
 
     glm::vec4 white(1, 1, 1, 1);
     for (size_t i = 0; i != colors.size(); ++i) {
@@ -166,6 +137,11 @@ public:
       }
     }
 
+    if (pos.empty()) {
+      printf("no atoms in chains %s\n", chains);
+      return;
+    }
+
     glm::vec3 min = pos[0];
     glm::vec3 max = pos[0];
     for (size_t i = 0; i != pos.size(); ++i) {
@@ -195,83 +171,68 @@ public:
     };
 
     printf("building solvent acessible mesh by inflating the atoms\n");
+
+    // Any atom that could be the closest to a grid point next to the surface is within this distance.
+    float atom_search_radius = water_radius + max_radius + grid_spacing;
+    meshutils::spatial_grid atom_grid(pos.data(), pos.size(), atom_search_radius);
+
     std::vector<float> accessible((xdim+1)*(ydim+1)*(zdim+1));
-    par_for(0, zdim+1, [&](int z) {
+    meshutils::parallel_for(0, zdim+1, [&](int z) {
       float zpos = z * grid_spacing + min.z;
       for (int y = 0; y != ydim+1; ++y) {
         float ypos = y * grid_spacing + min.y;
         for (int x = 0; x != xdim+1; ++x) {
           glm::vec3 xyz(x * grid_spacing + min.x, ypos, zpos);
           float value = 1e37f;
-          for (size_t i = 0; i != pos.size(); ++i) {
-            glm::vec3 p = pos[i];
+          atom_grid.forEachWithin(xyz, atom_search_radius, [&](size_t i, float d2) {
             float r = radii[i];
-            float d2 = glm::dot(xyz - p, xyz - p);
             float r2 = (r + water_radius) * (r + water_radius);
             value = std::min(value, d2 - r2);
-          }
+          });
           accessible[idx(x, y, z)] = value;
         }
       }
     });
 
-    auto fn = [&accessible, idx](int x, int y, int z) {
-      return accessible[idx(x, y, z)];
-    };
+    meshutils::dense_field fn(accessible.data(), xdim+1, (size_t)(xdim+1)*(ydim+1));
 
     auto gen = [&accessible, grid_spacing, min, idx](float x, float y, float z) {
       glm::vec3 xyz(x * grid_spacing + min.x, y * grid_spacing + min.y, z * grid_spacing + min.z);
       return meshutils::pos_mesh::vertex_t(xyz);
     };
 
-    meshutils::pos_mesh amesh(xdim, ydim, zdim, fn, gen);
+    meshutils::pos_mesh amesh(xdim, ydim, zdim, fn, gen, 0);
 
-    std::vector<glm::vec3> zsorter;
+    std::vector<glm::vec3> apos;
 
     auto &avertices = amesh.vertices();
+    apos.reserve(avertices.size());
     for (auto &v : avertices) {
-      zsorter.push_back(v.pos());
+      apos.push_back(v.pos());
     }
 
-    auto cmpz = [](const glm::vec3 &a, const glm::vec3 &b) { return a.z < b.z; };
-    auto cmpy = [](const glm::vec3 &a, const glm::vec3 &b) { return a.y < b.y; };
-    std::sort(zsorter.begin(), zsorter.end(), cmpz);
+    // search only vertices within water_radius of each grid point (plus one grid step for the neighbours).
+    float vertex_search_radius = water_radius + grid_spacing;
+    meshutils::spatial_grid vertex_grid(apos.data(), apos.size(), vertex_search_radius);
 
     printf("building solvent excluded mesh by deflating the acessible mesh\n");
     std::vector<float> excluded((xdim+1)*(ydim+1)*(zdim+1));
     float outside_value = -(water_radius * water_radius);
-    par_for(0, zdim+1, [&](int z) {
-      std::vector<glm::vec3> ysorter;
-
-      // search only a band of z values in zpos +/- water_radius
+    meshutils::parallel_for(0, zdim+1, [&](int z) {
       float zpos = z * grid_spacing + min.z;
-      auto p = std::lower_bound( zsorter.begin(), zsorter.end(), glm::vec3(0, 0, zpos - (water_radius + grid_spacing)), cmpz);
-      auto q = std::upper_bound( zsorter.begin(), zsorter.end(), glm::vec3(0, 0, zpos + (water_radius + grid_spacing)), cmpz);
-
       for (int y = 0; y != ydim+1; ++y) {
         float ypos = y * grid_spacing + min.y;
-
-        // filter by y position
-        ysorter.clear();
-        for (auto r = p; r != q; ++r) {
-          if (std::abs(r->y - ypos) <= water_radius + grid_spacing) {
-            ysorter.push_back(*r);
-          }
-        }
-
         for (int x = 0; x != xdim+1; ++x) {
           glm::vec3 xyz(x * grid_spacing + min.x, ypos, zpos);
           float value = 1e37f;
           // only if we are inside the acessible mesh...
           if (accessible[idx(x, y, z)] < 0) {
             // find the closest point on the accessible mesh to xyz.
-            for (auto &r : ysorter) {
-              float d2 = glm::dot(xyz - r, xyz - r);
+            // points with no vertex in range are deep inside and keep a large value.
+            vertex_grid.forEachWithin(xyz, vertex_search_radius, [&value](size_t, float d2) {
               value = std::min(value, d2);
-            }
-            if (value == 1e37f) {
-              value = outside_value;
-            } else {
+            });
+            if (value != 1e37f) {
               value -= (water_radius) * (water_radius);
             }
           } else {
@@ -282,13 +243,14 @@ public:
       }
     });
 
-    auto efn = [&excluded, idx](int x, int y, int z) {
-      return excluded[idx(x, y, z)];
-    };
+    meshutils::dense_field efn(excluded.data(), xdim+1, (size_t)(xdim+1)*(ydim+1));
 
-    auto egen = [&excluded, &colored_atoms, grid_spacing, min, idx](float x, float y, float z) {
+    auto egen = [&efn, &colored_atoms, grid_spacing, min, xdim, ydim, zdim](float x, float y, float z) {
       glm::vec3 xyz(x * grid_spacing + min.x, y * grid_spacing + min.y, z * grid_spacing + min.z);
-      glm::vec3 normal(1, 0, 0);
+      // the excluded field is positive inside, so the normal is down the gradient.
+      glm::vec3 gradient = meshutils::field_gradient(efn, xdim, ydim, zdim, x, y, z);
+      float len2 = glm::dot(gradient, gradient);
+      glm::vec3 normal = len2 > 0 ? gradient * (-1.0f / std::sqrt(len2)) : glm::vec3(1, 0, 0);
       glm::vec2 uv(0, 0);
       glm::vec4 color = glm::vec4(1, 1, 1, 1);
       for (size_t i = 0; i != colored_atoms.size(); ++i) {
@@ -307,7 +269,7 @@ public:
       return meshutils::color_mesh::vertex_t(xyz, normal, uv, color);
     };
 
-    meshutils::color_mesh emesh(xdim, ydim, zdim, efn, egen);
+    meshutils::color_mesh emesh(xdim, ydim, zdim, efn, egen, 0);
 
     const char *last_slash = pdb_filename;
     const char *last_dot = pdb_filename + strlen(pdb_filename);
@@ -323,9 +285,13 @@ public:
 
     const char *out_filename = fmt("%s_%s_%s.fbx", stem.c_str(), chains, grid_spacing_text);
     printf("writing %s\n", out_filename);
-    std::ofstream eof(out_filename, std::ios::binary);
-    std::vector<uint8_t> bytes = encoder.saveMesh(emesh);
-    eof.write((char*)bytes.data(), bytes.size());
+    encoder.setCompression(6);
+    meshutils::file_sink sink(out_filename);
+    if (!sink.is_open() || !encoder.saveMesh(emesh, sink)) {
+      printf("unable to write %s\n", out_filename);
+    }
+
+    if (print_stats) std::cout << stats;
   }
 private:
 };
@@ -0,0 +1,244 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: arena allocation
+//
+// An arena hands out memory from large blocks and frees all of it at once with
+// reset(), which keeps the memory for the next job. This avoids allocator churn
+// and page faults when meshing many small structures, eg. one arena per worker
+// thread that is reset between ligands.
+// arena_allocator<T> lets standard containers and basic_mesh use an arena.
+// The blocks are shared by the arena and every allocator using it, so a mesh
+// may outlive its arena, eg. a mesh built with arena::local() on a thread that
+// then exits. Arenas are thread safe, but reset() and release() free whatever
+// is still using the arena, so finish with those containers first.
+
+#ifndef MESHUTILS_ARENA_INCLUDED
+#define MESHUTILS_ARENA_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+
+namespace meshutils {
+
+namespace detail {
+  // The blocks of an arena. Allocation is always from the last block.
+  class arena_blocks {
+  public:
+    explicit arena_blocks(size_t block_size) : block_size_(block_size) {
+    }
+
+    void *allocate(size_t size, size_t align) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (void *p = fit(size, align)) return p;
+      // the rest of the last block is left unused.
+      add(std::max(block_size_, size + align));
+      return fit(size, align);
+    }
+
+    void deallocate(void *p, size_t size) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!blocks_.empty() && (char *)p + size == blocks_.back().data.get() + top_) {
+        top_ = (size_t)((char *)p - blocks_.back().data.get());
+      }
+    }
+
+    void reset() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (blocks_.size() > 1) {
+        size_t total = capacity_;
+        blocks_.clear();
+        capacity_ = 0;
+        add(total);
+      }
+      top_ = 0;
+      used_ = 0;
+    }
+
+    void release() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      blocks_.clear();
+      capacity_ = 0;
+      top_ = 0;
+      used_ = 0;
+    }
+
+    void reserve(size_t size) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (blocks_.empty() || blocks_.back().size - top_ < size) add(size);
+    }
+
+    size_t bytesUsed() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return used_ + top_;
+    }
+
+    size_t capacity() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return capacity_;
+    }
+
+    size_t numBlocks() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return blocks_.size();
+    }
+
+  private:
+    void *fit(size_t size, size_t align) {
+      if (blocks_.empty()) return nullptr;
+      block &b = blocks_.back();
+      uintptr_t base = (uintptr_t)b.data.get();
+      uintptr_t p = (base + top_ + align - 1) & ~(uintptr_t)(align - 1);
+      if (p + size > base + b.size) return nullptr;
+      top_ = (size_t)(p + size - base);
+      return (void *)p;
+    }
+
+    void add(size_t size) {
+      used_ += top_;
+      top_ = 0;
+      blocks_.push_back(block{ std::unique_ptr<char[]>(new char[size]), size });
+      capacity_ += size;
+    }
+
+    struct block {
+      std::unique_ptr<char[]> data;
+      size_t size;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<block> blocks_;
+    size_t block_size_;
+    size_t capacity_ = 0;
+    size_t top_ = 0;      // bytes used in the last block
+    size_t used_ = 0;     // bytes used in the blocks before it
+  };
+}
+
+class arena {
+public:
+  explicit arena(size_t block_size = 0x100000) : blocks_(std::make_shared<detail::arena_blocks>(block_size)) {
+  }
+
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  // The arena of the calling thread.
+  static arena &local() {
+    static thread_local arena result;
+    return result;
+  }
+
+  void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    return blocks_->allocate(size, align);
+  }
+
+  // Memory is only given back by reset(), except for the most recent allocation
+  // which can be reused straight away.
+  void deallocate(void *p, size_t size) {
+    blocks_->deallocate(p, size);
+  }
+
+  // Free everything that has been allocated. Several blocks are replaced by one
+  // block of the same total size, so the next job of the same size needs only one.
+  void reset() {
+    blocks_->reset();
+  }
+
+  // Free the memory as well.
+  void release() {
+    blocks_->release();
+  }
+
+  // Make room for at least size bytes in one block, eg. from an estimate of the size of the next job.
+  void reserve(size_t size) {
+    blocks_->reserve(size);
+  }
+
+  // Bytes allocated since the last reset, including padding.
+  size_t bytesUsed() const {
+    return blocks_->bytesUsed();
+  }
+
+  // Total size of the blocks.
+  size_t capacity() const {
+    return blocks_->capacity();
+  }
+
+  size_t numBlocks() const {
+    return blocks_->numBlocks();
+  }
+
+  const std::shared_ptr<detail::arena_blocks> &blocks() const { return blocks_; }
+
+private:
+  std::shared_ptr<detail::arena_blocks> blocks_;
+};
+
+// A standard allocator which uses an arena. The default constructor uses
+// the arena of the thread that makes the container. The allocator keeps the
+// blocks of the arena alive.
+template <class T>
+class arena_allocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  arena_allocator() : blocks_(arena::local().blocks()) {
+  }
+
+  arena_allocator(arena &a) : blocks_(a.blocks()) {
+  }
+
+  template <class U>
+  arena_allocator(const arena_allocator<U> &rhs) : blocks_(rhs.blocks()) {
+  }
+
+  T *allocate(size_t n) {
+    return (T *)blocks_->allocate(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T *p, size_t n) {
+    blocks_->deallocate(p, n * sizeof(T));
+  }
+
+  const std::shared_ptr<detail::arena_blocks> &blocks() const { return blocks_; }
+
+  // True if the allocator uses a.
+  bool uses(const arena &a) const { return blocks_ == a.blocks(); }
+
+  template <class U>
+  bool operator==(const arena_allocator<U> &rhs) const { return blocks_ == rhs.blocks(); }
+
+  template <class U>
+  bool operator!=(const arena_allocator<U> &rhs) const { return blocks_ != rhs.blocks(); }
+
+private:
+  std::shared_ptr<detail::arena_blocks> blocks_;
+};
+
+// Replace the contents of dest with those of the scratch vector src.
+// A std::vector takes the buffer of src. Other vectors, eg. in an arena, copy src
+// into their own buffer, which is reused if it is large enough instead of being
+// left in the arena until reset().
+template <class T>
+void replace_contents(std::vector<T> &dest, std::vector<T> &src) {
+  dest.swap(src);
+}
+
+template <class T, class Alloc>
+void replace_contents(std::vector<T, Alloc> &dest, std::vector<T> &src) {
+  dest.assign(src.begin(), src.end());
+}
+
+} // meshutils
+
+#endif
@@ -0,0 +1,315 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: bounding volume hierarchy of triangles
+//
+// The tree is split at the median centroid on the longest axis, so it is balanced
+// and can be built in O(n log n). The top few levels are split on one thread and
+// the subtrees below them are built in parallel.
+// Triangle corners are copied into leaf order so that queries do not touch the mesh.
+
+#ifndef MESHUTILS_BVH_INCLUDED
+#define MESHUTILS_BVH_INCLUDED
+
+#include <meshutils/parallel.hpp>
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+namespace meshutils {
+
+class triangle_bvh {
+public:
+  enum { leaf_size = 4 };
+
+  // An interior node has count == 0 and children first and first + 1.
+  // A leaf has triangles first .. first + count - 1 in leaf order.
+  struct node {
+    glm::vec3 min;
+    uint32_t first;
+    glm::vec3 max;
+    uint32_t count;
+  };
+
+  triangle_bvh() {
+  }
+
+  // Build a tree over the num_indices / 3 triangles of an indexed mesh.
+  // pos(i) gives the position of vertex i.
+  template <class Index, class Position>
+  triangle_bvh(const Index *indices, size_t num_indices, Position pos, unsigned num_threads = 0) {
+    size_t num_triangles = num_indices / 3;
+    if (num_triangles == 0) return;
+    if (num_threads == 0) num_threads = thread_pool::globalThreads();
+
+    builder b;
+    b.tri_min.resize(num_triangles);
+    b.tri_max.resize(num_triangles);
+    b.centroid.resize(num_triangles);
+    corners_.resize(num_triangles * 3);
+    ids_.resize(num_triangles);
+    parallel_for_range(0, (int)num_triangles, 0x4000, [&](int lo, int hi) {
+      for (int t = lo; t != hi; ++t) {
+        glm::vec3 p0 = pos(indices[t*3+0]), p1 = pos(indices[t*3+1]), p2 = pos(indices[t*3+2]);
+        corners_[t*3+0] = p0;
+        corners_[t*3+1] = p1;
+        corners_[t*3+2] = p2;
+        b.tri_min[t] = glm::min(p0, glm::min(p1, p2));
+        b.tri_max[t] = glm::max(p0, glm::max(p1, p2));
+        b.centroid[t] = (b.tri_min[t] + b.tri_max[t]) * 0.5f;
+        ids_[t] = (uint32_t)t;
+      }
+    }, num_threads);
+
+    // split the top levels until there are a few subtrees for each thread.
+    struct range { uint32_t node, begin, end; };
+    std::vector<range> level, subtrees;
+    nodes_.emplace_back();
+    level.push_back(range{ 0, 0, (uint32_t)num_triangles });
+    size_t target = num_threads > 1 ? num_threads * 4 : 1;
+    while (!level.empty()) {
+      if (level.size() >= target) {
+        subtrees.insert(subtrees.end(), level.begin(), level.end());
+        break;
+      }
+      std::vector<range> next;
+      for (const range &r : level) {
+        uint32_t mid = b.split(nodes_[r.node], ids_.data(), r.begin, r.end);
+        if (mid == r.begin) continue;
+        uint32_t child = (uint32_t)nodes_.size();
+        nodes_[r.node].first = child;
+        nodes_.emplace_back();
+        nodes_.emplace_back();
+        next.push_back(range{ child, r.begin, mid });
+        next.push_back(range{ child + 1, mid, r.end });
+      }
+      level.swap(next);
+    }
+
+    // build the subtrees as separate node arrays, then append them to the tree.
+    std::vector<std::vector<node>> built(subtrees.size());
+    parallel_for(0, (int)subtrees.size(), [&](int s) {
+      built[s].emplace_back();
+      b.build(built[s], ids_.data(), 0, subtrees[s].begin, subtrees[s].end);
+    }, num_threads);
+
+    for (size_t s = 0; s != subtrees.size(); ++s) {
+      uint32_t base = (uint32_t)nodes_.size() - 1;
+      for (node &n : built[s]) {
+        if (n.count == 0) n.first += base;
+      }
+      nodes_[subtrees[s].node] = built[s][0];
+      nodes_.insert(nodes_.end(), built[s].begin() + 1, built[s].end());
+    }
+
+    // put the corners in leaf order.
+    std::vector<glm::vec3> corners(num_triangles * 3);
+    for (size_t k = 0; k != num_triangles; ++k) {
+      for (int c = 0; c != 3; ++c) corners[k*3+c] = corners_[ids_[k]*3+c];
+    }
+    corners_.swap(corners);
+  }
+
+  size_t numTriangles() const { return ids_.size(); }
+
+  const std::vector<node> &nodes() const { return nodes_; }
+
+  // Original index of the triangle at a position in leaf order.
+  uint32_t id(size_t leaf_triangle) const { return ids_[leaf_triangle]; }
+
+  // The three corners of a triangle in leaf order.
+  const glm::vec3 *corners(size_t leaf_triangle) const { return corners_.data() + leaf_triangle * 3; }
+
+  // Returns false for an empty tree.
+  bool bounds(glm::vec3 &min, glm::vec3 &max) const {
+    if (nodes_.empty()) return false;
+    min = nodes_[0].min;
+    max = nodes_[0].max;
+    return true;
+  }
+
+  // Call fn(id) for every triangle whose bounding box overlaps the box min .. max.
+  template <class Fn>
+  void query(const glm::vec3 &min, const glm::vec3 &max, Fn fn) const {
+    if (nodes_.empty()) return;
+    uint32_t stack[64];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+      const node &n = nodes_[stack[--sp]];
+      if (!overlaps(n.min, n.max, min, max)) continue;
+      if (n.count == 0) {
+        stack[sp++] = n.first;
+        stack[sp++] = n.first + 1;
+        continue;
+      }
+      for (uint32_t k = n.first; k != n.first + n.count; ++k) {
+        const glm::vec3 *c = corners(k);
+        if (overlaps(glm::min(c[0], glm::min(c[1], c[2])), glm::max(c[0], glm::max(c[1], c[2])), min, max)) fn(ids_[k]);
+      }
+    }
+  }
+
+  // Call fn(id, other_id) for every pair of triangles with overlapping bounding
+  // boxes, one from this tree and one from other. Only the nodes where the trees
+  // overlap are visited.
+  template <class Fn>
+  void query(const triangle_bvh &other, Fn fn) const {
+    if (nodes_.empty() || other.nodes_.empty()) return;
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+      uint32_t i = stack.back().first, j = stack.back().second;
+      stack.pop_back();
+      const node &a = nodes_[i], &b = other.nodes_[j];
+      if (!overlaps(a.min, a.max, b.min, b.max)) continue;
+      if (a.count == 0 && (b.count != 0 || volume(a) >= volume(b))) {
+        stack.emplace_back(a.first, j);
+        stack.emplace_back(a.first + 1, j);
+      } else if (b.count == 0) {
+        stack.emplace_back(i, b.first);
+        stack.emplace_back(i, b.first + 1);
+      } else {
+        for (uint32_t ka = a.first; ka != a.first + a.count; ++ka) {
+          const glm::vec3 *ca = corners(ka);
+          glm::vec3 amin = glm::min(ca[0], glm::min(ca[1], ca[2])), amax = glm::max(ca[0], glm::max(ca[1], ca[2]));
+          for (uint32_t kb = b.first; kb != b.first + b.count; ++kb) {
+            const glm::vec3 *cb = other.corners(kb);
+            if (overlaps(amin, amax, glm::min(cb[0], glm::min(cb[1], cb[2])), glm::max(cb[0], glm::max(cb[1], cb[2])))) {
+              fn(ids_[ka], other.ids_[kb]);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Number of triangles hit by the ray origin + t * dir, t > 0.
+  int crossings(const glm::vec3 &origin, const glm::vec3 &dir) const {
+    if (nodes_.empty()) return 0;
+    glm::vec3 inv_dir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    int result = 0;
+    uint32_t stack[64];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+      const node &n = nodes_[stack[--sp]];
+      if (!rayHitsBox(origin, inv_dir, n.min, n.max)) continue;
+      if (n.count == 0) {
+        stack[sp++] = n.first;
+        stack[sp++] = n.first + 1;
+        continue;
+      }
+      for (uint32_t k = n.first; k != n.first + n.count; ++k) {
+        result += rayHitsTriangle(origin, dir, corners(k));
+      }
+    }
+    return result;
+  }
+
+  // True if p is inside a closed mesh.
+  // Rays in three skewed directions vote so that a ray through an edge does not give the wrong answer.
+  bool inside(const glm::vec3 &p) const {
+    glm::vec3 min, max;
+    if (!bounds(min, max) || !overlaps(p, p, min, max)) return false;
+    static const glm::vec3 dirs[3] = {
+      glm::vec3(0.8017837f, 0.5345225f, 0.2672612f),
+      glm::vec3(-0.2672612f, 0.8017837f, -0.5345225f),
+      glm::vec3(0.5345225f, -0.2672612f, -0.8017837f),
+    };
+    int votes = 0;
+    for (int d = 0; d != 3; ++d) votes += crossings(p, dirs[d]) & 1;
+    return votes >= 2;
+  }
+
+private:
+  struct builder {
+    std::vector<glm::vec3> tri_min;
+    std::vector<glm::vec3> tri_max;
+    std::vector<glm::vec3> centroid;
+
+    // Set the bounds of n and partition ids[begin..end) at the median centroid.
+    // Returns the split point or begin if n should be a leaf.
+    uint32_t split(node &n, uint32_t *ids, uint32_t begin, uint32_t end) const {
+      glm::vec3 cmin = centroid[ids[begin]], cmax = cmin;
+      n.min = tri_min[ids[begin]];
+      n.max = tri_max[ids[begin]];
+      for (uint32_t k = begin; k != end; ++k) {
+        uint32_t t = ids[k];
+        n.min = glm::min(n.min, tri_min[t]);
+        n.max = glm::max(n.max, tri_max[t]);
+        cmin = glm::min(cmin, centroid[t]);
+        cmax = glm::max(cmax, centroid[t]);
+      }
+      n.first = begin;
+      n.count = end - begin;
+      if (end - begin <= leaf_size) return begin;
+
+      glm::vec3 extent = cmax - cmin;
+      int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+      uint32_t mid = begin + (end - begin) / 2;
+      std::nth_element(ids + begin, ids + mid, ids + end, [this, axis](uint32_t a, uint32_t b) {
+        return centroid[a][axis] < centroid[b][axis];
+      });
+      n.count = 0;
+      return mid;
+    }
+
+    void build(std::vector<node> &nodes, uint32_t *ids, uint32_t index, uint32_t begin, uint32_t end) const {
+      uint32_t mid = split(nodes[index], ids, begin, end);
+      if (mid == begin) return;
+      uint32_t child = (uint32_t)nodes.size();
+      nodes[index].first = child;
+      nodes.emplace_back();
+      nodes.emplace_back();
+      build(nodes, ids, child, begin, mid);
+      build(nodes, ids, child + 1, mid, end);
+    }
+  };
+
+  static bool overlaps(const glm::vec3 &amin, const glm::vec3 &amax, const glm::vec3 &bmin, const glm::vec3 &bmax) {
+    return amin.x <= bmax.x && bmin.x <= amax.x && amin.y <= bmax.y && bmin.y <= amax.y && amin.z <= bmax.z && bmin.z <= amax.z;
+  }
+
+  static float volume(const node &n) {
+    glm::vec3 e = n.max - n.min;
+    return e.x * e.y * e.z;
+  }
+
+  static bool rayHitsBox(const glm::vec3 &origin, const glm::vec3 &inv_dir, const glm::vec3 &min, const glm::vec3 &max) {
+    float tmin = 0, tmax = 1e37f;
+    for (int c = 0; c != 3; ++c) {
+      float t0 = (min[c] - origin[c]) * inv_dir[c], t1 = (max[c] - origin[c]) * inv_dir[c];
+      tmin = std::max(tmin, std::min(t0, t1));
+      tmax = std::min(tmax, std::max(t0, t1));
+    }
+    return tmin <= tmax;
+  }
+
+  // Moller and Trumbore.
+  static int rayHitsTriangle(const glm::vec3 &origin, const glm::vec3 &dir, const glm::vec3 *c) {
+    glm::vec3 e1 = c[1] - c[0], e2 = c[2] - c[0];
+    glm::vec3 p = glm::cross(dir, e2);
+    float det = glm::dot(e1, p);
+    if (det == 0) return 0;
+    float inv_det = 1.0f / det;
+    glm::vec3 s = origin - c[0];
+    float u = glm::dot(s, p) * inv_det;
+    if (u < 0 || u > 1) return 0;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(dir, q) * inv_det;
+    if (v < 0 || u + v > 1) return 0;
+    return glm::dot(e2, q) * inv_det > 0;
+  }
+
+  std::vector<node> nodes_;
+  std::vector<uint32_t> ids_;
+  std::vector<glm::vec3> corners_;
+};
+
+} // meshutils
+
+#endif
@@ -0,0 +1,158 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: seekable output for encoders
+//
+// Encoders append bytes to a sink and may later overwrite bytes they have
+// already written (eg. FBX node end offsets), so a file can be written
+// without keeping all of it in memory.
+
+#ifndef MESHUTILS_BYTE_SINK_INCLUDED
+#define MESHUTILS_BYTE_SINK_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <ostream>
+#include <fstream>
+#include <algorithm>
+
+namespace meshutils {
+
+class byte_sink {
+public:
+  virtual ~byte_sink() {
+  }
+
+  // Append size bytes.
+  virtual void write(const uint8_t *data, size_t size) = 0;
+
+  // Overwrite size bytes at offset. The bytes must already have been written.
+  virtual void patch(size_t offset, const uint8_t *data, size_t size) = 0;
+
+  // Number of bytes written.
+  virtual size_t size() const = 0;
+
+  // False if a write has failed.
+  virtual bool good() const { return true; }
+};
+
+// Sink that appends to a vector.
+class vector_sink : public byte_sink {
+public:
+  vector_sink(std::vector<uint8_t> &bytes) : bytes_(bytes) {
+  }
+
+  void write(const uint8_t *data, size_t size) override {
+    bytes_.insert(bytes_.end(), data, data + size);
+  }
+
+  void patch(size_t offset, const uint8_t *data, size_t size) override {
+    memcpy(bytes_.data() + offset, data, size);
+  }
+
+  size_t size() const override { return bytes_.size(); }
+
+private:
+  std::vector<uint8_t> &bytes_;
+};
+
+// Sink that keeps the bytes in fixed size chunks so that large outputs do not need
+// one contiguous allocation or the copies made when a vector grows.
+class chunked_sink : public byte_sink {
+public:
+  chunked_sink(size_t chunk_size = 0x100000) : chunk_size_(chunk_size) {
+  }
+
+  void write(const uint8_t *data, size_t size) override {
+    while (size) {
+      if (chunks_.empty() || chunks_.back().size() == chunk_size_) {
+        chunks_.emplace_back();
+        chunks_.back().reserve(chunk_size_);
+      }
+      std::vector<uint8_t> &chunk = chunks_.back();
+      size_t n = std::min(size, chunk_size_ - chunk.size());
+      chunk.insert(chunk.end(), data, data + n);
+      data += n;
+      size -= n;
+      size_ += n;
+    }
+  }
+
+  void patch(size_t offset, const uint8_t *data, size_t size) override {
+    while (size) {
+      std::vector<uint8_t> &chunk = chunks_[offset / chunk_size_];
+      size_t pos = offset % chunk_size_;
+      size_t n = std::min(size, chunk_size_ - pos);
+      memcpy(chunk.data() + pos, data, n);
+      data += n;
+      offset += n;
+      size -= n;
+    }
+  }
+
+  size_t size() const override { return size_; }
+
+  const std::vector<std::vector<uint8_t>> &chunks() const { return chunks_; }
+
+  // Write all the chunks to a stream.
+  void copyTo(std::ostream &os) const {
+    for (auto &chunk : chunks_) {
+      os.write((const char *)chunk.data(), chunk.size());
+    }
+  }
+
+private:
+  size_t chunk_size_;
+  size_t size_ = 0;
+  std::vector<std::vector<uint8_t>> chunks_;
+};
+
+// Sink that writes to a seekable stream, eg. a std::ofstream opened in binary mode.
+// Patches seek back to the patched bytes and then return to the end.
+class stream_sink : public byte_sink {
+public:
+  stream_sink(std::ostream &os) : os_(&os), start_(os.tellp()) {
+  }
+
+  void write(const uint8_t *data, size_t size) override {
+    os_->write((const char *)data, size);
+    size_ += size;
+  }
+
+  void patch(size_t offset, const uint8_t *data, size_t size) override {
+    os_->seekp(start_ + (std::streamoff)offset);
+    os_->write((const char *)data, size);
+    os_->seekp(start_ + (std::streamoff)size_);
+  }
+
+  size_t size() const override { return size_; }
+
+  bool good() const override { return os_->good(); }
+
+protected:
+  stream_sink() {
+  }
+
+  std::ostream *os_ = nullptr;
+  std::streampos start_ = 0;
+  size_t size_ = 0;
+};
+
+// Sink that writes to a new binary file.
+class file_sink : public stream_sink {
+public:
+  file_sink(const char *filename) : file_(filename, std::ios_base::binary) {
+    os_ = &file_;
+  }
+
+  bool is_open() const { return file_.is_open(); }
+
+private:
+  std::ofstream file_;
+};
+
+} // meshutils
+
+#endif
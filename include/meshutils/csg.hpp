@@ -0,0 +1,402 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: constructive solid geometry
+//
+// csg() on two closed meshes finds the pairs of intersecting triangles with
+// a triangle_bvh of each mesh, cuts those triangles along the other mesh and
+// keeps the pieces on the right side. Triangles away from the intersection are
+// kept or dropped a whole connected region at a time, so the inside tests and
+// cutting scale with the size of the intersection, not the size of the meshes.
+//
+// csg() on two sparse fields combines signed distances before marching cubes.
+// Only bricks stored in either field are visited.
+
+#ifndef MESHUTILS_CSG_INCLUDED
+#define MESHUTILS_CSG_INCLUDED
+
+#include <meshutils/mesh.hpp>
+#include <meshutils/bvh.hpp>
+#include <meshutils/parallel.hpp>
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+namespace meshutils {
+
+// a - b for csg_difference.
+enum csg_operation {
+  csg_union,
+  csg_intersection,
+  csg_difference,
+};
+
+// Combine two values of functions which are negative inside.
+inline float csg_combine(csg_operation op, float a, float b) {
+  switch (op) {
+    case csg_union: return std::min(a, b);
+    case csg_intersection: return std::max(a, b);
+    default: return std::max(a, -b);
+  }
+}
+
+// Combine two fields which are negative inside. Bricks stored in only one field are
+// combined with the background of the other and bricks which end up all background are
+// not stored, eg. bricks of a which are outside b for csg_intersection.
+inline void csg(sparse_field &result, const sparse_field &a, const sparse_field &b, csg_operation op, unsigned num_threads = 0) {
+  enum { volume = sparse_field::brick_volume };
+  float background = csg_combine(op, a.background(), b.background());
+
+  std::vector<uint64_t> keys(a.keys());
+  for (uint64_t k : b.keys()) {
+    int bi, bj, bk;
+    sparse_field::unkey(k, bi, bj, bk);
+    if (!a.findBrick(bi, bj, bk)) keys.push_back(k);
+  }
+
+  std::vector<float> values(keys.size() * volume);
+  std::vector<uint8_t> keep(keys.size());
+  parallel_for(0, (int)keys.size(), [&](int n) {
+    int bi, bj, bk;
+    sparse_field::unkey(keys[n], bi, bj, bk);
+    const float *pa = a.findBrick(bi, bj, bk), *pb = b.findBrick(bi, bj, bk);
+    float *dest = values.data() + (size_t)n * volume;
+    bool all_background = true;
+    for (int i = 0; i != volume; ++i) {
+      dest[i] = csg_combine(op, pa ? pa[i] : a.background(), pb ? pb[i] : b.background());
+      all_background &= dest[i] == background;
+    }
+    keep[n] = !all_background;
+  }, num_threads);
+
+  result = sparse_field(background);
+  for (size_t n = 0; n != keys.size(); ++n) {
+    if (!keep[n]) continue;
+    int bi, bj, bk;
+    sparse_field::unkey(keys[n], bi, bj, bk);
+    std::memcpy(result.brick(bi, bj, bk), values.data() + n * volume, volume * sizeof(float));
+  }
+}
+
+namespace detail {
+  // A convex piece of a triangle. bary are the barycentric coordinates of pos in the triangle.
+  struct csg_polygon {
+    std::vector<glm::vec3> pos;
+    std::vector<glm::vec3> bary;
+  };
+
+  // Cut in by the plane of triangle tri if the cut crosses tri, putting the pieces in front and back.
+  // With front == nullptr, only test for a cut.
+  inline bool csg_cut(const csg_polygon &in, const glm::vec3 *tri, float epsilon, csg_polygon *front, csg_polygon *back) {
+    glm::vec3 normal = glm::cross(tri[1] - tri[0], tri[2] - tri[0]);
+    float len2 = glm::dot(normal, normal);
+    if (!(len2 > 0)) return false;
+    normal = normal * (1.0f / std::sqrt(len2));
+
+    size_t n = in.pos.size();
+    float dist[64];
+    if (n > 64) return false;
+    bool above = false, below = false;
+    for (size_t i = 0; i != n; ++i) {
+      dist[i] = glm::dot(normal, in.pos[i] - tri[0]);
+      above |= dist[i] > epsilon;
+      below |= dist[i] < -epsilon;
+    }
+    if (!above || !below) return false;
+
+    // the ends of the cut are the vertices on the plane and the points where edges cross it.
+    glm::vec3 ends[2];
+    int num_ends = 0;
+    auto crossing = [&](size_t i, size_t j) { return dist[i] / (dist[i] - dist[j]); };
+    for (size_t i = 0; i != n && num_ends != 2; ++i) {
+      size_t j = i + 1 == n ? 0 : i + 1;
+      if (std::abs(dist[i]) <= epsilon) {
+        ends[num_ends++] = in.pos[i];
+      } else if (std::abs(dist[j]) > epsilon && (dist[i] > 0) != (dist[j] > 0)) {
+        ends[num_ends++] = glm::mix(in.pos[i], in.pos[j], crossing(i, j));
+      }
+    }
+    if (num_ends != 2) return false;
+
+    // clip the cut to the inside of each edge of tri.
+    float tmin = 0, tmax = 1;
+    for (int e = 0; e != 3; ++e) {
+      glm::vec3 edge = tri[e == 2 ? 0 : e + 1] - tri[e];
+      glm::vec3 inward = glm::cross(normal, edge);
+      float eps = epsilon * std::sqrt(glm::dot(inward, inward));
+      float d0 = glm::dot(inward, ends[0] - tri[e]), d1 = glm::dot(inward, ends[1] - tri[e]);
+      if (d0 < -eps && d1 < -eps) return false;
+      if (d0 < -eps) tmin = std::max(tmin, (d0 + eps) / (d0 - d1));
+      if (d1 < -eps) tmax = std::min(tmax, (d0 + eps) / (d0 - d1));
+    }
+    if (tmin > tmax) return false;
+    if (!front) return true;
+
+    front->pos.clear(); front->bary.clear();
+    back->pos.clear(); back->bary.clear();
+    auto add = [](csg_polygon *p, const glm::vec3 &pos, const glm::vec3 &bary) {
+      p->pos.push_back(pos);
+      p->bary.push_back(bary);
+    };
+    for (size_t i = 0; i != n; ++i) {
+      size_t j = i + 1 == n ? 0 : i + 1;
+      if (dist[i] >= -epsilon) add(front, in.pos[i], in.bary[i]);
+      if (dist[i] <= epsilon) add(back, in.pos[i], in.bary[i]);
+      if ((dist[i] > epsilon && dist[j] < -epsilon) || (dist[i] < -epsilon && dist[j] > epsilon)) {
+        float t = crossing(i, j);
+        glm::vec3 pos = glm::mix(in.pos[i], in.pos[j], t), bary = glm::mix(in.bary[i], in.bary[j], t);
+        add(front, pos, bary);
+        add(back, pos, bary);
+      }
+    }
+    return true;
+  }
+
+  // The pieces of each cut triangle of one mesh and which of them to keep.
+  template <class MeshTraits>
+  struct csg_side {
+    typedef typename MeshTraits::vertex_t vertex_t;
+    typedef typename MeshTraits::index_t index_t;
+
+    const basic_mesh<MeshTraits> *mesh;
+    const triangle_bvh *bvh;
+    std::vector<uint32_t> cut_first;     // cut triangle t is cut by cuts[cut_first[t] .. cut_first[t+1])
+    std::vector<uint32_t> cuts;
+    std::vector<uint32_t> cut_triangles;
+    std::vector<std::vector<csg_polygon>> pieces;  // for each of cut_triangles
+    std::vector<std::vector<uint8_t>> keep_piece;
+    std::vector<uint8_t> keep_triangle;  // for triangles which are not cut
+
+    glm::vec3 corner(uint32_t t, int c) const { return mesh->vertices()[mesh->indices()[t * 3 + c]].pos(); }
+
+    // pairs are (this triangle, other triangle) for triangles which cross, sorted.
+    void setCuts(const std::vector<std::pair<uint32_t, uint32_t>> &pairs) {
+      size_t num_triangles = mesh->indices().size() / 3;
+      cut_first.assign(num_triangles + 1, 0);
+      cuts.resize(pairs.size());
+      for (size_t i = 0; i != pairs.size(); ++i) {
+        cut_first[pairs[i].first + 1]++;
+        cuts[i] = pairs[i].second;
+        if (i == 0 || pairs[i].first != pairs[i-1].first) cut_triangles.push_back(pairs[i].first);
+      }
+      for (size_t t = 0; t != num_triangles; ++t) cut_first[t + 1] += cut_first[t];
+    }
+
+    // Cut each triangle by the triangles of other which cross it.
+    void cut(const csg_side &other, float epsilon, unsigned num_threads) {
+      pieces.resize(cut_triangles.size());
+      parallel_for(0, (int)cut_triangles.size(), [&](int n) {
+        uint32_t t = cut_triangles[n];
+        std::vector<csg_polygon> &result = pieces[n];
+        csg_polygon tri;
+        for (int c = 0; c != 3; ++c) {
+          tri.pos.push_back(corner(t, c));
+          glm::vec3 bary(0.0f);
+          bary[c] = 1;
+          tri.bary.push_back(bary);
+        }
+        result.push_back(tri);
+
+        csg_polygon front, back;
+        glm::vec3 other_tri[3];
+        for (uint32_t k = cut_first[t]; k != cut_first[t + 1]; ++k) {
+          for (int c = 0; c != 3; ++c) other_tri[c] = other.corner(cuts[k], c);
+          for (size_t p = 0, e = result.size(); p != e; ++p) {
+            if (csg_cut(result[p], other_tri, epsilon, &front, &back)) {
+              result[p] = front;
+              result.push_back(back);
+            }
+          }
+        }
+      }, num_threads);
+    }
+
+    // Decide which pieces to keep: want_inside says whether to keep the parts of this mesh inside other.
+    void classify(const csg_side &other, bool want_inside, unsigned num_threads) {
+      keep_piece.resize(cut_triangles.size());
+      parallel_for(0, (int)cut_triangles.size(), [&](int n) {
+        keep_piece[n].resize(pieces[n].size());
+        for (size_t p = 0; p != pieces[n].size(); ++p) {
+          const csg_polygon &poly = pieces[n][p];
+          glm::vec3 centre(0.0f);
+          for (const glm::vec3 &v : poly.pos) centre += v;
+          centre = centre * (1.0f / poly.pos.size());
+          keep_piece[n][p] = other.bvh->inside(centre) == want_inside;
+        }
+      }, num_threads);
+
+      // triangles which are not cut and share a vertex are on the same side of other,
+      // so test one triangle of each connected region.
+      const std::vector<index_t> &indices = mesh->indices();
+      size_t num_triangles = indices.size() / 3;
+      std::vector<uint32_t> parent(mesh->vertices().size());
+      for (size_t v = 0; v != parent.size(); ++v) parent[v] = (uint32_t)v;
+      auto find = [&parent](uint32_t v) {
+        while (parent[v] != v) v = parent[v] = parent[parent[v]];
+        return v;
+      };
+      for (size_t t = 0; t != num_triangles; ++t) {
+        if (cut_first[t] != cut_first[t + 1]) continue;
+        uint32_t r0 = find((uint32_t)indices[t*3]);
+        for (int c = 1; c != 3; ++c) {
+          uint32_t r = find((uint32_t)indices[t*3+c]);
+          if (r != r0) parent[r] = r0;
+        }
+      }
+
+      enum { unknown = 2 };
+      std::vector<uint8_t> region_inside(parent.size(), unknown);
+      keep_triangle.assign(num_triangles, 0);
+      for (size_t t = 0; t != num_triangles; ++t) {
+        if (cut_first[t] != cut_first[t + 1]) continue;
+        uint32_t r = find((uint32_t)indices[t*3]);
+        if (region_inside[r] == unknown) {
+          region_inside[r] = other.bvh->inside((corner((uint32_t)t, 0) + corner((uint32_t)t, 1) + corner((uint32_t)t, 2)) * (1.0f / 3));
+        }
+        keep_triangle[t] = (region_inside[r] != 0) == want_inside;
+      }
+    }
+
+    // Append the kept triangles, flipped if flip is set.
+    void output(std::vector<vertex_t> &vertices, std::vector<index_t> &result, bool flip) const {
+      const std::vector<vertex_t> &mv = mesh->vertices();
+      const std::vector<index_t> &mi = mesh->indices();
+      auto add = [&](vertex_t v) {
+        if (flip) v.normal(-v.normal());
+        vertices.push_back(v);
+        return (index_t)(vertices.size() - 1);
+      };
+      auto triangle = [&](index_t i0, index_t i1, index_t i2) {
+        result.push_back(i0);
+        result.push_back(flip ? i2 : i1);
+        result.push_back(flip ? i1 : i2);
+      };
+
+      const uint32_t unused = ~0u;
+      std::vector<uint32_t> remap(mv.size(), unused);
+      for (size_t t = 0; t != keep_triangle.size(); ++t) {
+        if (!keep_triangle[t]) continue;
+        index_t idx[3];
+        for (int c = 0; c != 3; ++c) {
+          index_t v = mi[t * 3 + c];
+          if (remap[v] == unused) remap[v] = (uint32_t)add(mv[v]);
+          idx[c] = (index_t)remap[v];
+        }
+        triangle(idx[0], idx[1], idx[2]);
+      }
+
+      for (size_t n = 0; n != cut_triangles.size(); ++n) {
+        uint32_t t = cut_triangles[n];
+        const vertex_t *tv[3] = { &mv[mi[t*3]], &mv[mi[t*3+1]], &mv[mi[t*3+2]] };
+        for (size_t p = 0; p != pieces[n].size(); ++p) {
+          if (!keep_piece[n][p]) continue;
+          const csg_polygon &poly = pieces[n][p];
+          index_t first = (index_t)vertices.size();
+          for (size_t k = 0; k != poly.pos.size(); ++k) {
+            const glm::vec3 &b = poly.bary[k];
+            float s = b.x + b.y;
+            vertex_t v01 = s > 0 ? vertex_t(*tv[0], *tv[1], b.y / s) : *tv[0];
+            vertex_t v(v01, *tv[2], b.z);
+            glm::vec3 normal = v.normal();
+            float len2 = glm::dot(normal, normal);
+            if (len2 > 0) v.normal(normal * (1.0f / std::sqrt(len2)));
+            add(v.pos(poly.pos[k]));
+          }
+          for (size_t k = 1; k + 1 < poly.pos.size(); ++k) {
+            triangle(first, (index_t)(first + k), (index_t)(first + k + 1));
+          }
+        }
+      }
+    }
+  };
+}
+
+// Union, intersection or difference of two closed, consistently wound meshes,
+// using trees which have already been built for them.
+// Cut triangles are split into convex pieces, so new vertices along the cut are not
+// shared and may leave T junctions. Faces which are coplanar with the other mesh are not cut.
+template <class MeshTraits>
+void csg(
+  basic_mesh<MeshTraits> &result,
+  const basic_mesh<MeshTraits> &a, const triangle_bvh &a_bvh,
+  const basic_mesh<MeshTraits> &b, const triangle_bvh &b_bvh,
+  csg_operation op, unsigned num_threads = 0
+) {
+  typedef typename MeshTraits::vertex_t vertex_t;
+  typedef typename MeshTraits::index_t index_t;
+
+  detail::csg_side<MeshTraits> sa, sb;
+  sa.mesh = &a; sa.bvh = &a_bvh;
+  sb.mesh = &b; sb.bvh = &b_bvh;
+
+  glm::vec3 amin, amax, bmin, bmax;
+  float epsilon = 0;
+  if (a_bvh.bounds(amin, amax) && b_bvh.bounds(bmin, bmax)) {
+    glm::vec3 extent = glm::max(amax, bmax) - glm::min(amin, bmin);
+    epsilon = std::sqrt(glm::dot(extent, extent)) * 1e-6f;
+  }
+
+  // candidate pairs from the trees, then the pairs of triangles which actually cross.
+  std::vector<std::pair<uint32_t, uint32_t>> pairs;
+  a_bvh.query(b_bvh, [&pairs](uint32_t ta, uint32_t tb) { pairs.emplace_back(ta, tb); });
+  std::vector<uint8_t> crosses(pairs.size());
+  parallel_for_range(0, (int)pairs.size(), 256, [&](int lo, int hi) {
+    detail::csg_polygon pa, pb;
+    glm::vec3 ta[3], tb[3];
+    for (int i = lo; i != hi; ++i) {
+      pa.pos.clear(); pb.pos.clear();
+      for (int c = 0; c != 3; ++c) {
+        ta[c] = sa.corner(pairs[i].first, c);
+        tb[c] = sb.corner(pairs[i].second, c);
+        pa.pos.push_back(ta[c]);
+        pb.pos.push_back(tb[c]);
+      }
+      crosses[i] = detail::csg_cut(pa, tb, epsilon, nullptr, nullptr) || detail::csg_cut(pb, ta, epsilon, nullptr, nullptr);
+    }
+  }, num_threads);
+
+  std::vector<std::pair<uint32_t, uint32_t>> a_pairs, b_pairs;
+  for (size_t i = 0; i != pairs.size(); ++i) {
+    if (!crosses[i]) continue;
+    a_pairs.push_back(pairs[i]);
+    b_pairs.emplace_back(pairs[i].second, pairs[i].first);
+  }
+  std::sort(a_pairs.begin(), a_pairs.end());
+  std::sort(b_pairs.begin(), b_pairs.end());
+  sa.setCuts(a_pairs);
+  sb.setCuts(b_pairs);
+
+  sa.cut(sb, epsilon, num_threads);
+  sb.cut(sa, epsilon, num_threads);
+  sa.classify(sb, op == csg_intersection, num_threads);
+  sb.classify(sa, op != csg_union, num_threads);
+
+  std::vector<vertex_t> vertices;
+  std::vector<index_t> indices;
+  sa.output(vertices, indices, false);
+  sb.output(vertices, indices, op == csg_difference);
+  if (vertices.size() > (size_t)std::numeric_limits<index_t>::max()) {
+    throw std::runtime_error("too many vertices in csg result");
+  }
+  result = basic_mesh<MeshTraits>(std::move(vertices), std::move(indices));
+}
+
+// Union, intersection or difference of two closed, consistently wound meshes.
+template <class MeshTraits>
+void csg(basic_mesh<MeshTraits> &result, const basic_mesh<MeshTraits> &a, const basic_mesh<MeshTraits> &b, csg_operation op, unsigned num_threads = 0) {
+  typedef typename MeshTraits::index_t index_t;
+  auto a_pos = [&a](index_t i) { return a.vertices()[i].pos(); };
+  auto b_pos = [&b](index_t i) { return b.vertices()[i].pos(); };
+  triangle_bvh a_bvh(a.indices().data(), a.indices().size(), a_pos, num_threads);
+  triangle_bvh b_bvh(b.indices().data(), b.indices().size(), b_pos, num_threads);
+  csg(result, a, a_bvh, b, b_bvh, op, num_threads);
+}
+
+} // meshutils
+
+#endif
@@ -0,0 +1,393 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: quadric error mesh simplification
+//
+// decimator reduces the triangle count of a basic_mesh by collapsing edges,
+// choosing the edges whose removal moves the surface least as measured by
+// the sum of squared distances to the planes of the original triangles
+// (Garland and Heckbert's quadric error metric).
+//
+// Work is done in passes. Each pass builds a flat vertex to triangle table,
+// costs every edge in parallel and then collapses the cheapest edges whose
+// neighbourhoods do not overlap. Collapsed vertices are made with the
+// lerp constructor of the vertex so normals, uvs and colours follow.
+//
+// Edges with only one triangle (holes and attribute seams) are kept in place
+// by extra planes through the edge.
+
+#ifndef MESHUTILS_DECIMATE_INCLUDED
+#define MESHUTILS_DECIMATE_INCLUDED
+
+#include <meshutils/mesh.hpp>
+#include <meshutils/parallel.hpp>
+
+#include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+namespace meshutils {
+
+template <class MeshTraits>
+class decimator {
+public:
+  typedef typename MeshTraits::vertex_t vertex_t;
+  typedef typename MeshTraits::index_t index_t;
+
+  // Copy a triangle mesh to simplify. Degenerate triangles are dropped.
+  explicit decimator(const basic_mesh<MeshTraits> &mesh, unsigned num_threads = 0) : num_threads_(num_threads) {
+    vertices_ = mesh.vertices();
+    auto &indices = mesh.indices();
+    triangles_.reserve(indices.size());
+    for (size_t i = 0; i + 3 <= indices.size(); i += 3) {
+      uint32_t a = (uint32_t)indices[i], b = (uint32_t)indices[i+1], c = (uint32_t)indices[i+2];
+      if (a == b || b == c || c == a) continue;
+      if (a >= vertices_.size() || b >= vertices_.size() || c >= vertices_.size()) continue;
+      triangles_.push_back(a);
+      triangles_.push_back(b);
+      triangles_.push_back(c);
+    }
+    initQuadrics();
+  }
+
+  size_t numTriangles() const { return triangles_.size() / 3; }
+
+  // Collapse edges until there are at most target_triangles triangles or
+  // every remaining collapse would move the surface by more than max_error.
+  // max_error is a distance in mesh units. Can be called again with a smaller target.
+  void simplify(size_t target_triangles, float max_error = std::numeric_limits<float>::max()) {
+    double max_cost = (double)max_error * max_error;
+    while (numTriangles() > target_triangles) {
+      buildAdjacency();
+      std::vector<collapse> collapses;
+      findCollapses(collapses, max_cost);
+      if (collapses.empty()) break;
+
+      std::sort(collapses.begin(), collapses.end(), [](const collapse &a, const collapse &b) { return a.cost < b.cost; });
+
+      // each collapse removes about two triangles.
+      size_t budget = (numTriangles() - target_triangles + 1) / 2;
+      if (!applyCollapses(collapses, std::max(budget, (size_t)1))) break;
+    }
+  }
+
+  // The simplified mesh with the unused vertices removed.
+  void getMesh(basic_mesh<MeshTraits> &result) const {
+    std::vector<uint32_t> remap(vertices_.size(), ~0u);
+    std::vector<vertex_t> vertices;
+    std::vector<index_t> indices(triangles_.size());
+    for (size_t i = 0; i != triangles_.size(); ++i) {
+      uint32_t v = triangles_[i];
+      if (remap[v] == ~0u) {
+        remap[v] = (uint32_t)vertices.size();
+        vertices.push_back(vertices_[v]);
+      }
+      indices[i] = (index_t)remap[v];
+    }
+    result = basic_mesh<MeshTraits>(std::move(vertices), std::move(indices));
+  }
+
+  // Make a chain of levels of detail, each with ratios[i] of the original triangles.
+  // The ratios should get smaller. Each level starts from the previous one.
+  void lodChain(const std::vector<float> &ratios, std::vector<std::unique_ptr<basic_mesh<MeshTraits>>> &lods, float max_error = std::numeric_limits<float>::max()) {
+    size_t original = numTriangles();
+    for (float ratio : ratios) {
+      simplify((size_t)(original * ratio), max_error);
+      lods.emplace_back(new basic_mesh<MeshTraits>());
+      getMesh(*lods.back());
+    }
+  }
+
+private:
+  // Symmetric 4x4 matrix of summed plane equations and the area they came from.
+  struct quadric {
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+    double weight = 0;
+
+    quadric() {}
+
+    // weight * (distance to the plane n.p + d = 0) squared.
+    quadric(const glm::vec3 &n, double d, double w) {
+      double a = n.x, b = n.y, c = n.z;
+      a2 = a*a*w; ab = a*b*w; ac = a*c*w; ad = a*d*w;
+      b2 = b*b*w; bc = b*c*w; bd = b*d*w;
+      c2 = c*c*w; cd = c*d*w;
+      d2 = d*d*w;
+      weight = w;
+    }
+
+    quadric &operator+=(const quadric &q) {
+      a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2;
+      bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2;
+      weight += q.weight;
+      return *this;
+    }
+
+    double error(const glm::vec3 &p) const {
+      double x = p.x, y = p.y, z = p.z;
+      return
+        a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x +
+        b2*y*y + 2*bc*y*z + 2*bd*y +
+        c2*z*z + 2*cd*z +
+        d2;
+    }
+
+    // The point of least error, false if the planes are nearly parallel.
+    bool minimum(glm::vec3 &result) const {
+      double det =
+        a2 * (b2*c2 - bc*bc) - ab * (ab*c2 - bc*ac) + ac * (ab*bc - b2*ac);
+      double trace = a2 + b2 + c2;
+      if (!(std::fabs(det) > 1e-9 * trace * trace * trace)) return false;
+      double inv = -1.0 / det;
+      result.x = (float)(inv * (ad * (b2*c2 - bc*bc) - bd * (ab*c2 - ac*bc) + cd * (ab*bc - ac*b2)));
+      result.y = (float)(inv * (a2 * (bd*c2 - cd*bc) - ab * (ad*c2 - cd*ac) + ac * (ad*bc - bd*ac)));
+      result.z = (float)(inv * (a2 * (b2*cd - bc*bd) - ab * (ab*cd - bc*ad) + ac * (ab*bd - b2*ad)));
+      return true;
+    }
+  };
+
+  struct collapse {
+    double cost;
+    uint32_t keep;
+    uint32_t remove;
+    glm::vec3 pos;
+    float lambda;
+  };
+
+  // Penalty on moving edges that have only one triangle.
+  enum { boundary_weight = 10 };
+
+  glm::vec3 pos(uint32_t v) const { return vertices_[v].pos(); }
+
+  static float length(const glm::vec3 &v) {
+    return std::sqrt(glm::dot(v, v));
+  }
+
+  // Plane quadrics of each triangle, weighted by area, summed at the corners.
+  void initQuadrics() {
+    buildAdjacency();
+    size_t nv = vertices_.size();
+    quadrics_.assign(nv, quadric());
+    parallel_for_range(0, (int)nv, 0x1000, [this](int lo, int hi) {
+      for (int v = lo; v != hi; ++v) {
+        quadric &q = quadrics_[v];
+        for (uint32_t k = first_[v]; k != first_[v+1]; ++k) {
+          const uint32_t *t = &triangles_[tris_[k] * 3];
+          glm::vec3 p0 = pos(t[0]), p1 = pos(t[1]), p2 = pos(t[2]);
+          glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+          float len = length(n);
+          if (len == 0) continue;
+          n = n * (1.0f / len);
+          q += quadric(n, -glm::dot(n, p0), len * 0.5);
+
+          // a boundary edge from this vertex gets a plane at right angles to the triangle.
+          for (int e = 0; e != 3; ++e) {
+            uint32_t a = t[e], b = t[(e + 1) % 3];
+            if ((a != (uint32_t)v && b != (uint32_t)v) || countShared(a, b) != 1) continue;
+            glm::vec3 dir = pos(b) - pos(a);
+            glm::vec3 side = glm::cross(dir, n);
+            float side_len = length(side);
+            if (side_len == 0) continue;
+            side = side * (1.0f / side_len);
+            q += quadric(side, -glm::dot(side, pos(a)), boundary_weight * glm::dot(dir, dir));
+          }
+        }
+      }
+    }, num_threads_);
+  }
+
+  // first_[v]..first_[v+1] index tris_, the triangles using vertex v.
+  // Built with a counting sort in O(n).
+  void buildAdjacency() {
+    size_t nv = vertices_.size();
+    first_.assign(nv + 1, 0);
+    for (uint32_t v : triangles_) first_[v + 1]++;
+    for (size_t v = 0; v != nv; ++v) first_[v + 1] += first_[v];
+    tris_.resize(triangles_.size());
+    std::vector<uint32_t> fill(first_.begin(), first_.end() - 1);
+    for (size_t i = 0; i != triangles_.size(); ++i) {
+      tris_[fill[triangles_[i]]++] = (uint32_t)(i / 3);
+    }
+  }
+
+  // Number of triangles using both a and b.
+  uint32_t countShared(uint32_t a, uint32_t b) const {
+    uint32_t result = 0;
+    for (uint32_t k = first_[a]; k != first_[a+1]; ++k) {
+      const uint32_t *t = &triangles_[tris_[k] * 3];
+      result += t[0] == b || t[1] == b || t[2] == b;
+    }
+    return result;
+  }
+
+  // Vertices sharing a triangle with v, not including v.
+  void neighbours(uint32_t v, std::vector<uint32_t> &result) const {
+    result.clear();
+    for (uint32_t k = first_[v]; k != first_[v+1]; ++k) {
+      const uint32_t *t = &triangles_[tris_[k] * 3];
+      for (int i = 0; i != 3; ++i) {
+        if (t[i] != v && std::find(result.begin(), result.end(), t[i]) == result.end()) result.push_back(t[i]);
+      }
+    }
+  }
+
+  // Cost every edge once.
+  void findCollapses(std::vector<collapse> &result, double max_cost) const {
+    int nv = (int)vertices_.size();
+    const int chunk = 0x1000;
+    int num_chunks = (nv + chunk - 1) / chunk;
+    std::vector<std::vector<collapse>> found(num_chunks);
+    parallel_for(0, num_chunks, [&](int c) {
+      std::vector<uint32_t> na;
+      for (int v = c * chunk; v != std::min(nv, (c + 1) * chunk); ++v) {
+        uint32_t a = (uint32_t)v;
+        if (first_[a] == first_[a+1]) continue;
+        neighbours(a, na);
+        for (uint32_t b : na) {
+          if (b < a) continue;
+          collapse col;
+          if (!cost(a, b, col)) continue;
+          if (col.cost > max_cost) continue;
+          found[c].push_back(col);
+        }
+      }
+    }, num_threads_);
+
+    size_t total = 0;
+    for (auto &f : found) total += f.size();
+    result.reserve(total);
+    for (auto &f : found) result.insert(result.end(), f.begin(), f.end());
+  }
+
+  // Best place for the merged vertex: the best of the two ends, the middle and
+  // the quadric minimum if that is near the edge.
+  bool cost(uint32_t a, uint32_t b, collapse &result) const {
+    quadric q = quadrics_[a];
+    q += quadrics_[b];
+    glm::vec3 pa = pos(a), pb = pos(b);
+    glm::vec3 d = pb - pa;
+    double len2 = glm::dot(d, d);
+
+    glm::vec3 candidates[4] = { pa, pb, pa + d * 0.5f };
+    int num_candidates = 3;
+    glm::vec3 opt;
+    if (q.minimum(opt) && len2 > 0) {
+      double t = glm::dot(opt - pa, d) / len2;
+      if (t >= 0 && t <= 1 && length(opt - (pa + d * (float)t)) <= std::sqrt(len2)) {
+        candidates[num_candidates++] = opt;
+      }
+    }
+
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i != num_candidates; ++i) {
+      double e = q.error(candidates[i]);
+      if (e < best) {
+        best = e;
+        result.pos = candidates[i];
+      }
+    }
+    if (!(best < std::numeric_limits<double>::max())) return false;
+
+    // normalise by area so the cost is a mean squared distance.
+    result.cost = std::max(best, 0.0) / std::max(q.weight, 1e-30);
+    result.keep = a;
+    result.remove = b;
+    double t = len2 > 0 ? glm::dot(result.pos - pa, d) / len2 : 0;
+    result.lambda = (float)std::min(std::max(t, 0.0), 1.0);
+    return true;
+  }
+
+  bool valid(const collapse &col) {
+    neighbours(col.keep, ring_a_);
+    neighbours(col.remove, ring_b_);
+    return linkCondition(col.keep, col.remove, ring_a_, ring_b_) && !flips(col.keep, col.remove, col.pos) && !flips(col.remove, col.keep, col.pos);
+  }
+
+  // The edge must have one or two triangles and the ends must have no other
+  // common neighbours, or the collapse would fold the surface.
+  bool linkCondition(uint32_t a, uint32_t b, const std::vector<uint32_t> &na, const std::vector<uint32_t> &nb) const {
+    uint32_t shared = countShared(a, b);
+    if (shared == 0 || shared > 2) return false;
+    uint32_t common = 0;
+    for (uint32_t v : na) {
+      if (v != b && std::find(nb.begin(), nb.end(), v) != nb.end()) ++common;
+    }
+    return common == shared;
+  }
+
+  // True if moving v to p turns over one of its triangles that does not use other.
+  bool flips(uint32_t v, uint32_t other, const glm::vec3 &p) const {
+    for (uint32_t k = first_[v]; k != first_[v+1]; ++k) {
+      const uint32_t *t = &triangles_[tris_[k] * 3];
+      if (t[0] == other || t[1] == other || t[2] == other) continue;
+      glm::vec3 p0 = pos(t[0]), p1 = pos(t[1]), p2 = pos(t[2]);
+      glm::vec3 before = glm::cross(p1 - p0, p2 - p0);
+      if (t[0] == v) p0 = p; else if (t[1] == v) p1 = p; else p2 = p;
+      glm::vec3 after = glm::cross(p1 - p0, p2 - p0);
+      // more than about 75 degrees of turn.
+      float d = glm::dot(before, after);
+      if (d <= 0 || d * d <= 0.0625f * glm::dot(before, before) * glm::dot(after, after)) return true;
+    }
+    return false;
+  }
+
+  // Apply the sorted collapses that share no triangles with collapses already
+  // made in this pass, so the costs and checks made for them still hold.
+  // Returns false if none were applied.
+  bool applyCollapses(const std::vector<collapse> &collapses, size_t budget) {
+    std::vector<uint8_t> touched(numTriangles());
+    std::vector<uint32_t> remap(vertices_.size());
+    for (size_t v = 0; v != remap.size(); ++v) remap[v] = (uint32_t)v;
+
+    size_t applied = 0;
+    for (const collapse &col : collapses) {
+      if (applied == budget) break;
+      bool free = true;
+      for (uint32_t v : { col.keep, col.remove }) {
+        for (uint32_t k = first_[v]; k != first_[v+1]; ++k) free = free && !touched[tris_[k]];
+      }
+      if (!free || !valid(col)) continue;
+      for (uint32_t v : { col.keep, col.remove }) {
+        for (uint32_t k = first_[v]; k != first_[v+1]; ++k) touched[tris_[k]] = 1;
+      }
+
+      vertex_t merged(vertices_[col.keep], vertices_[col.remove], col.lambda);
+      merged.pos(col.pos);
+      vertices_[col.keep] = merged;
+      quadrics_[col.keep] += quadrics_[col.remove];
+      remap[col.remove] = col.keep;
+      ++applied;
+    }
+
+    if (applied == 0) return false;
+
+    // remap the corners and drop the triangles that have become edges.
+    size_t dest = 0;
+    for (size_t i = 0; i != triangles_.size(); i += 3) {
+      uint32_t a = remap[triangles_[i]], b = remap[triangles_[i+1]], c = remap[triangles_[i+2]];
+      if (a == b || b == c || c == a) continue;
+      triangles_[dest++] = a;
+      triangles_[dest++] = b;
+      triangles_[dest++] = c;
+    }
+    triangles_.resize(dest);
+    return true;
+  }
+
+  std::vector<vertex_t> vertices_;
+  std::vector<uint32_t> triangles_;
+  std::vector<quadric> quadrics_;
+  std::vector<uint32_t> first_;
+  std::vector<uint32_t> tris_;
+  std::vector<uint32_t> ring_a_;
+  std::vector<uint32_t> ring_b_;
+  unsigned num_threads_;
+};
+
+} // meshutils
+
+#endif
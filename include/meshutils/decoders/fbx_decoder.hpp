@@ -13,19 +13,27 @@
 #include <string>
 //#include <filesystem>
 #include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
 
 #include <meshutils/scene.hpp>
+#include <meshutils/mapped_file.hpp>
+#include <meshutils/parallel.hpp>
+#include <meshutils/stats.hpp>
 #include <minizip/deflate_decoder.hpp>
 #include <glm/glm.hpp>
 
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
+
 // see https://code.blender.org/2013/08/fbx-binary-file-format-specification/
 // and https://banexdevblog.wordpress.com/2014/06/23/a-quick-tutorial-about-the-fbx-ascii-format/
 
 namespace meshutils {
 
   class fbx_decoder {
-    enum { debug = 1 };
-
     static inline std::uint8_t u1(const char *p) {
       const unsigned char *q = (const unsigned char *)p;
       std::uint32_t res = q[0];
@@ -201,6 +209,11 @@ namespace meshutils {
         return 0;
       }
 
+      // array properties: number of elements, 0 = raw or 1 = zlib and size in the file.
+      size_t arrayLength() const { return u4(begin_ + offset + 1); }
+      size_t arrayEncoding() const { return u4(begin_ + offset + 5); }
+      size_t arrayCompressedLength() const { return u4(begin_ + offset + 9); }
+
       template <class Type, char Kind>
       bool getArray(std::vector<Type> &result, const minizip::deflate_decoder &decoder) const {
         Type *begin = nullptr;
@@ -234,18 +247,122 @@ namespace meshutils {
       const char *begin_;
     };
   public:
-    /*fbx_decoder(const std::string &filename) {
-      std::ifstream f(filename, std::ios_base::binary);
-      if (f.good()) {
-        f.seekg(0, std::ios_base::end);
-        bytes.resize((size_t)f.tellg());
-        f.seekg(0, std::ios_base::beg);
-        f.read((char*)bytes.data(), bytes.size());
-        init((char*)bytes.data(), (char*)bytes.data() + f.gcount());
+    // empty decoder, use open() to map a file.
+    fbx_decoder() {
+    }
+
+    // If indexed is set, a table of all the nodes is built for find() and findObject().
+    fbx_decoder(const char *begin, const char *end, bool indexed = false) {
+      init(begin, end);
+      if (indexed) buildIndex();
+    }
+
+    // Map a file and decode it in place without reading it into memory.
+    // Returns false if the file can not be opened and throws if it is not a binary fbx file.
+    bool open(const char *filename, bool indexed = false) {
+      auto file = std::make_shared<mapped_file>();
+      if (!file->open(filename)) return false;
+      file_ = file;
+      init((const char *)file_->begin(), (const char *)file_->end());
+      if (indexed) buildIndex();
+      return true;
+    }
+
+    // Report phase timings and counters to stats, or nothing if it is null. See stats.hpp.
+    void setStats(stats_sink *stats) {
+      stats_ = stats;
+    }
+
+    // Read the header of every node once. This only touches the node headers and
+    // the ids of objects, so the array data of a large file is not paged in.
+    void buildIndex() {
+      scoped_phase phase(stats_, "fbx_decoder.buildIndex");
+      index_.clear();
+      names_.clear();
+      name_ids_.clear();
+      children_.clear();
+      objects_.clear();
+      int prev = -1;
+      for (auto n : *this) {
+        int idx = indexNode(n, -1, 0);
+        if (prev != -1) index_[prev].nextSibling = idx;
+        prev = idx;
+      }
+      for (auto &e : index_) {
+        if (e.parent != -1 && index_[e.parent].parent == -1 && names_[index_[e.parent].name] == "Objects") {
+          auto vp = node(begin_, e.offset).get_props().begin();
+          if (vp.kind() == 'L') objects_.emplace(vp.getLong(), (int)(&e - index_.data()));
+        }
       }
-    }*/
+    }
 
-    fbx_decoder(const char *begin, const char *end) { init(begin, end); }
+    bool indexed() const { return !index_.empty(); }
+
+    // All the nodes on a path of names such as "Objects/Geometry", in file order.
+    // This walks the file unless buildIndex() has been called.
+    std::vector<node> find(const char *path) const {
+      std::vector<std::string> names;
+      for (const char *p = path; ; ++p) {
+        const char *e = p;
+        while (*e && *e != '/') ++e;
+        names.emplace_back(p, e);
+        if (!*e) break;
+        p = e;
+      }
+
+      std::vector<node> result;
+      if (indexed()) {
+        std::vector<int> parents(1, -1), next;
+        for (auto &name : names) {
+          auto id = name_ids_.find(name);
+          if (id == name_ids_.end()) return result;
+          next.clear();
+          for (int parent : parents) {
+            auto c = children_.find(childKey(parent, id->second));
+            for (int i = c == children_.end() ? -1 : c->second.first; i != -1; i = index_[i].nextSameName) {
+              next.push_back(i);
+            }
+          }
+          parents.swap(next);
+        }
+        for (int i : parents) result.push_back(node(begin_, index_[i].offset));
+      } else {
+        for (auto n : *this) {
+          if (n.name() == names[0]) result.push_back(n);
+        }
+        for (size_t i = 1; i != names.size(); ++i) {
+          std::vector<node> next;
+          for (auto &parent : result) {
+            for (auto child : parent) {
+              if (child.name() == names[i]) next.push_back(child);
+            }
+          }
+          result.swap(next);
+        }
+      }
+      return result;
+    }
+
+    // Find a child of Objects, such as a Geometry or Model, by its id.
+    bool findObject(uint64_t id, node &result) const {
+      if (indexed()) {
+        auto i = objects_.find(id);
+        if (i == objects_.end()) return false;
+        result = node(begin_, index_[i->second].offset);
+        return true;
+      }
+      for (auto section : *this) {
+        if (!section.name_is("Objects")) continue;
+        for (auto obj : section) {
+          auto vp = obj.get_props().begin();
+          if (vp.kind() == 'L' && vp.getLong() == id) {
+            result = obj;
+            return true;
+          }
+        }
+      }
+      return false;
+    }
 
     node begin() const { return node(begin_, 27); }
     node end() const { return node(begin_, end_offset); }
@@ -285,215 +402,128 @@ namespace meshutils {
       return result;
     };
 
+    // Load the meshes and nodes of the file into a scene.
+    // The Geometry arrays are found by a scan of the Objects section and are then
+    // copied or inflated in parallel, largest first, before being converted to meshes.
+    // The meshes use alloc, eg. arena_allocator<vertex_t>(worker_arena).
     template<class MeshType>
-    bool loadScene(meshutils::scene &scene) {
-      std::vector<double> fbxVertices;
-      std::vector<double> fbxNormals;
-      std::vector<double> fbxUVs;
-      std::vector<double> fbxColors;
-      std::vector<int32_t> fbxUVIndices;
-      std::vector<int32_t> fbxColorIndices;
-      std::vector<int32_t> fbxNormalIndices;
-      std::vector<int32_t> fbxIndices;
-      std::string fbxNormalMapping;
-      std::string fbxUVMapping;
-      std::string fbxColorMapping;
-      std::string fbxNormalRef;
-      std::string fbxUVRef;
-      std::string fbxColorRef;
+    bool loadScene(meshutils::scene &scene, unsigned num_threads = 0, const typename MeshType::allocator_t &alloc = typename MeshType::allocator_t()) {
+      scoped_phase phase(stats_, "fbx_decoder.loadScene");
+      stats_count(stats_, "fbx_decoder.bytes", (uint64_t)(end_ - begin_));
+      std::vector<std::unique_ptr<geometry_arrays>> geometries;
+      std::vector<array_desc> arrays;
 
       std::vector<uint64_t> geometryIds;
       std::vector<uint64_t> modelIds;
       std::vector<glm::mat4> transforms;
       std::vector<int> parents;
       std::vector<int> meshIdxs;
+      int firstMesh = -1;
 
       for (auto section : *this) {
         if (section.name_is("Objects")) {
-          for (auto obj : section) {
-            if (obj.name_is("Geometry")) {
-              auto ovp = obj.get_props().begin();
-              geometryIds.push_back(ovp.getLong());
-              for (auto comp : obj) {
-                auto vp = comp.get_props().begin();
-                if (debug) printf("%s %c\n", comp.name().c_str(), vp.kind());
-                if (comp.name_is("Vertices")) {
-                  vp.getArray<double, 'd'>(fbxVertices, decoder_);
-                } else if (comp.name_is("LayerElementNormal")) {
-                  for (auto sub : comp) {
-                    auto vp = sub.get_props().begin();
-                    if (debug) printf("  %s %c\n", sub.name().c_str(), vp.kind());
-                    if (sub.name_is("MappingInformationType")) {
-                      vp.getString(fbxNormalMapping);
-                    } else if (sub.name_is("ReferenceInformationType")) {
-                      vp.getString(fbxNormalRef);
-                    } else if (sub.name_is("NormalIndex")) {
-                      vp.getArray<int32_t, 'i'>(fbxNormalIndices, decoder_);
-                    } else if (sub.name_is("Normals")) {
-                      vp.getArray<double, 'd'>(fbxNormals, decoder_);
-                    }
-                  }
-                } else if (comp.name_is("LayerElementUV")) {
-                  for (auto sub : comp) {
-                    auto vp = sub.get_props().begin();
-                    if (debug) printf("  %s %c\n", sub.name().c_str(), vp.kind());
-                    if (sub.name_is("MappingInformationType")) {
-                      vp.getString(fbxUVMapping);
-                    } else if (sub.name_is("ReferenceInformationType")) {
-                      vp.getString(fbxUVRef);
-                    } else if (sub.name_is("UVIndex")) {
-                      vp.getArray<int32_t, 'i'>(fbxUVIndices, decoder_);
-                    } else if (sub.name_is("UV")) {
-                      vp.getArray<double, 'd'>(fbxUVs, decoder_);
-                    }
-                  }
-                } else if (comp.name_is("LayerElementColor")) {
-                  for (auto sub : comp) {
-                    auto vp = sub.get_props().begin();
-                    if (debug) printf("  %s %c\n", sub.name().c_str(), vp.kind());
-                    if (sub.name_is("MappingInformationType")) {
-                      vp.getString(fbxColorMapping);
-                    } else if (sub.name_is("ReferenceInformationType")) {
-                      vp.getString(fbxColorRef);
-                    } else if (sub.name_is("ColorIndex")) {
-                      vp.getArray<int32_t, 'i'>(fbxColorIndices, decoder_);
-                    } else if (sub.name_is("Colors")) {
-                      vp.getArray<double, 'd'>(fbxColors, decoder_);
-                    }
-                  }
-                } else if (comp.name_is("PolygonVertexIndex")) {
-                  vp.getArray<int32_t, 'i'>(fbxIndices, decoder_);
-                }
-              }
-
-              auto normalMapping = fbx_decoder::decodeMapping(fbxNormalMapping);
-              auto uvMapping = fbx_decoder::decodeMapping(fbxUVMapping);
-              auto cMapping = fbx_decoder::decodeMapping(fbxColorMapping);
-              auto normalRef = fbx_decoder::decodeRef(fbxNormalRef);
-              auto uvRef = fbx_decoder::decodeRef(fbxUVRef);
-              auto cRef = fbx_decoder::decodeRef(fbxColorRef);
-
-              if (fbxNormals.empty()) {
-                fbxNormals.resize(3);
-              }
-              if (fbxUVs.empty()) {
-                fbxUVs.resize(2);
-              }
-              if (fbxColors.empty()) {
-                fbxColors.resize(4);
-                fbxColors[0] = fbxColors[1] = fbxColors[2] = fbxColors[3] = 1;
-              }
-
-              // https://banexdevblog.wordpress.com/2014/06/23/a-quick-tutorial-about-the-fbx-ascii-format/
-              if (debug) printf("%s %s\n", fbxNormalMapping.c_str(), fbxUVMapping.c_str());
-              if (debug) printf("%s %s\n", fbxNormalRef.c_str(), fbxUVRef.c_str());
-              if (debug) printf("%d vertices %d indices %d normals %d uvs %d colors %d uvindices\n", (int)fbxVertices.size(), (int)fbxIndices.size(), (int)fbxNormals.size(), (int)fbxUVs.size(), (int)fbxColors.size(), (int)fbxUVIndices.size());
-
-              std::vector<glm::vec3> pos;
-              std::vector<glm::vec3> normal;
-              std::vector<glm::vec2> uv;
-              std::vector<glm::vec4> color;
-              std::vector<int> material;
-
-              // map the fbx data to real vertices
-              size_t pi = 0;
-              for (size_t i = 0; i != fbxIndices.size(); ++i) {
-                size_t ni = normalRef == fbx_decoder::Ref::IndexToDirect ? fbxNormalIndices[i] : i;
-                size_t uvi = uvRef == fbx_decoder::Ref::IndexToDirect ? fbxUVIndices[i] : i;
-                size_t ci = cRef == fbx_decoder::Ref::IndexToDirect ? fbxColorIndices[i] : i;
-                int32_t vi = fbxIndices[i];
-                if (vi < 0) vi = -1 - vi;
-
-                size_t nj = map(normalMapping, pi, ni, vi);
-                size_t uvj = map(uvMapping, pi, uvi, vi);
-                size_t cj = map(cMapping, pi, ci, vi);
-
-                glm::vec3 vpos(fbxVertices[vi*3+0], fbxVertices[vi*3+1], fbxVertices[vi*3+2]);
-                glm::vec3 vnormal = glm::vec3(fbxNormals[nj*3+0], fbxNormals[nj*3+1], fbxNormals[nj*3+2]);
-                glm::vec2 vuv = glm::vec2(fbxUVs[uvj*2+0], fbxUVs[uvj*2+1]);
-                glm::vec4 vcolor = glm::vec4(fbxColors[cj*2+0], fbxColors[cj*2+1], fbxColors[cj*2+2], fbxColors[cj*2+3]);
-
-                pos.push_back(vpos);
-                normal.push_back(vnormal);
-                uv.push_back(vuv);
-                color.push_back(vcolor);
-
-                pi += fbxIndices[i] < 0;
-              }
-
-              // map the fbx data to real indices
-              // todo: add a function to re-index
-              std::vector<uint32_t> indices;
-              for (size_t i = 0, j = 0; i != fbxIndices.size(); ++i) {
-                if (fbxIndices[i] < 0) {
-                  for (size_t k = j+2; k <= i; ++k) {
-                    indices.push_back((uint32_t)j);
-                    indices.push_back((uint32_t)k-1);
-                    indices.push_back((uint32_t)k);
-                  }
-                  j = i + 1;
-                }
-              }
-
-              MeshType *mesh = new MeshType(pos, normal, uv, color, indices);
-              scene.addMesh(mesh);
-            } else if (obj.name_is("Model")) {
-              auto ovp = obj.get_props().begin();
-              modelIds.push_back(ovp.getLong());
-              std::string str1;
-              std::string str2;
-              double rx = 0, ry = 0, rz = 0;
-              double sx = 0, sy = 0, sz = 0;
-              for (auto comp : obj) {
-                if (comp.name_is("Properties70")) {
-                  for (auto prop : comp) {
-                    if (prop.name_is("P")) {
-                      auto props = prop.get_props();
-                      auto prop = props.begin();
-                      prop.getString(str1);
-                      ++prop;
-                      prop.getString(str2);
-                      ++prop;
-                      ++prop;
-                      ++prop;
-                      if (str1 == "Lcl Rotation") {
-                        rx = prop.getDouble(); ++prop;
-                        ry = prop.getDouble(); ++prop;
-                        rz = prop.getDouble();
-                      } else if (str1 == "Lcl Scaling") {
-                        sx = prop.getDouble(); ++prop;
-                        sy = prop.getDouble(); ++prop;
-                        sz = prop.getDouble();
+          {
+            scoped_phase scan_phase(stats_, "fbx_decoder.scan");
+            for (auto obj : section) {
+              if (obj.name_is("Geometry")) {
+                auto ovp = obj.get_props().begin();
+                geometryIds.push_back(ovp.getLong());
+                geometries.emplace_back(new geometry_arrays());
+                scanGeometry(obj, *geometries.back(), arrays);
+              } else if (obj.name_is("Model")) {
+                auto ovp = obj.get_props().begin();
+                modelIds.push_back(ovp.getLong());
+                std::string str1;
+                std::string str2;
+                double rx = 0, ry = 0, rz = 0;
+                double sx = 0, sy = 0, sz = 0;
+                for (auto comp : obj) {
+                  if (comp.name_is("Properties70")) {
+                    for (auto prop : comp) {
+                      if (prop.name_is("P")) {
+                        auto props = prop.get_props();
+                        auto prop = props.begin();
+                        prop.getString(str1);
+                        ++prop;
+                        prop.getString(str2);
+                        ++prop;
+                        ++prop;
+                        ++prop;
+                        if (str1 == "Lcl Rotation") {
+                          rx = prop.getDouble(); ++prop;
+                          ry = prop.getDouble(); ++prop;
+                          rz = prop.getDouble();
+                        } else if (str1 == "Lcl Scaling") {
+                          sx = prop.getDouble(); ++prop;
+                          sy = prop.getDouble(); ++prop;
+                          sz = prop.getDouble();
+                        }
                       }
                     }
                   }
                 }
+                // see blen_read_object_transform_do
+                // in /usr/share/blender/2.77/scripts/addons/io_scene_fbx/import_fbx.py
+                // todo: support pivots and other 
+                glm::mat4 mat;
+                transforms.push_back(mat);
+                parents.push_back(-1);
+                meshIdxs.push_back(-1);
               }
-              // see blen_read_object_transform_do
-              // in /usr/share/blender/2.77/scripts/addons/io_scene_fbx/import_fbx.py
-              // todo: support pivots and other 
-              glm::mat4 mat;
-              transforms.push_back(mat);
-              parents.push_back(0);
-              meshIdxs.push_back(0);
             }
           }
+
+          decodeArrays(arrays, num_threads);
+          arrays.clear();
+
+          // a single large geometry uses the threads to weld its vertices instead.
+          std::vector<MeshType *> meshes(geometries.size());
+          unsigned weld_threads = geometries.size() == 1 ? num_threads : 1;
+          {
+            scoped_phase mesh_phase(stats_, "fbx_decoder.makeMesh");
+            parallel_for(0, (int)geometries.size(), [&](int i) {
+              meshes[i] = makeMesh<MeshType>(*geometries[i], weld_threads, alloc);
+              geometries[i].reset();
+            }, num_threads);
+          }
+          for (MeshType *mesh : meshes) {
+            int idx = scene.addMesh(mesh);
+            if (firstMesh < 0) firstMesh = idx;
+            stats_count(stats_, "fbx_decoder.vertices", mesh->vertices().size());
+            stats_count(stats_, "fbx_decoder.indices", mesh->indices().size());
+          }
+          stats_count(stats_, "fbx_decoder.meshes", meshes.size());
+          geometries.clear();
         } else if (section.name_is("Connections")) {
+          std::unordered_map<uint64_t, int> modelIndex, geometryIndex;
+          for (size_t i = 0; i != modelIds.size(); ++i) modelIndex[modelIds[i]] = (int)i;
+          for (size_t i = 0; i != geometryIds.size(); ++i) geometryIndex[geometryIds[i]] = (int)i;
+          int firstNode = (int)scene.transforms().size();
           std::string kind;
           for (auto connection : section) {
             if (connection.name_is("C")) {
               auto cvp = connection.get_props().begin();
               cvp.getString(kind); ++cvp;
               if (kind == "OO") {
-                uint64_t from = cvp.getLong();
+                uint64_t from = cvp.getLong(); ++cvp;
                 uint64_t to = cvp.getLong();
-                // todo: connect heirachy
+                // Model -> Model is a child, Geometry -> Model is the model's mesh.
+                auto model = modelIndex.find(to);
+                if (model == modelIndex.end()) continue;
+                auto child = modelIndex.find(from);
+                auto geometry = geometryIndex.find(from);
+                if (child != modelIndex.end()) {
+                  parents[child->second] = firstNode + model->second;
+                } else if (geometry != geometryIndex.end() && firstMesh >= 0) {
+                  meshIdxs[model->second] = firstMesh + geometry->second;
+                }
               }
             }
           }
           for (size_t i = 0; i != transforms.size(); ++i) {
             scene.addNode(transforms[i], parents[i], meshIdxs[i]);
           }
+          transforms.clear();
         }
       }
 
@@ -501,6 +531,19 @@ namespace meshutils {
       return true;
     }
 
+    // Load a single Geometry node, eg. one found by findObject().
+    // Returns nullptr if the node is not a Geometry. The mesh uses alloc.
+    template<class MeshType>
+    MeshType *loadMesh(const node &geometry, unsigned num_threads = 0, const typename MeshType::allocator_t &alloc = typename MeshType::allocator_t()) const {
+      if (!geometry.name_is("Geometry")) return nullptr;
+      geometry_arrays g;
+      std::vector<array_desc> arrays;
+      scanGeometry(geometry, g, arrays);
+      decodeArrays(arrays, num_threads);
+      scoped_phase phase(stats_, "fbx_decoder.makeMesh");
+      return makeMesh<MeshType>(g, num_threads, alloc);
+    }
+
   private:
 
     static size_t map(fbx_decoder::Mapping m, size_t polygon_index, size_t pvi, size_t vi) {
@@ -514,6 +557,241 @@ namespace meshutils {
       }
     }
 
+    // The arrays and layer settings of one Geometry node.
+    struct geometry_arrays {
+      std::vector<double> vertices;
+      std::vector<double> normals;
+      std::vector<double> uvs;
+      std::vector<double> colors;
+      std::vector<int32_t> uvIndices;
+      std::vector<int32_t> colorIndices;
+      std::vector<int32_t> normalIndices;
+      std::vector<int32_t> indices;
+      std::string normalMapping;
+      std::string uvMapping;
+      std::string colorMapping;
+      std::string normalRef;
+      std::string uvRef;
+      std::string colorRef;
+    };
+
+    // An array property found by the scan in loadScene(), decoded later into one of d or i.
+    struct array_desc {
+      prop value;
+      size_t bytes;
+      std::vector<double> *d;
+      std::vector<int32_t> *i;
+    };
+
+    static void addArray(std::vector<array_desc> &arrays, const prop &value, std::vector<double> &dest) {
+      if (value.kind() == 'd') arrays.push_back(array_desc{ value, arraySize(value, 8), &dest, nullptr });
+    }
+
+    static void addArray(std::vector<array_desc> &arrays, const prop &value, std::vector<int32_t> &dest) {
+      if (value.kind() == 'i') arrays.push_back(array_desc{ value, arraySize(value, 4), nullptr, &dest });
+    }
+
+    static size_t arraySize(const prop &value, size_t elem_size) {
+      return value.arrayEncoding() ? value.arrayCompressedLength() : value.arrayLength() * elem_size;
+    }
+
+    // Find the arrays and layer settings of a Geometry node. The arrays are decoded by decodeArrays().
+    static void scanGeometry(node obj, geometry_arrays &g, std::vector<array_desc> &arrays) {
+      for (auto comp : obj) {
+        auto vp = comp.get_props().begin();
+        if (comp.name_is("Vertices")) {
+          addArray(arrays, vp, g.vertices);
+        } else if (comp.name_is("LayerElementNormal")) {
+          for (auto sub : comp) {
+            auto vp = sub.get_props().begin();
+            if (sub.name_is("MappingInformationType")) {
+              vp.getString(g.normalMapping);
+            } else if (sub.name_is("ReferenceInformationType")) {
+              vp.getString(g.normalRef);
+            } else if (sub.name_is("NormalIndex")) {
+              addArray(arrays, vp, g.normalIndices);
+            } else if (sub.name_is("Normals")) {
+              addArray(arrays, vp, g.normals);
+            }
+          }
+        } else if (comp.name_is("LayerElementUV")) {
+          for (auto sub : comp) {
+            auto vp = sub.get_props().begin();
+            if (sub.name_is("MappingInformationType")) {
+              vp.getString(g.uvMapping);
+            } else if (sub.name_is("ReferenceInformationType")) {
+              vp.getString(g.uvRef);
+            } else if (sub.name_is("UVIndex")) {
+              addArray(arrays, vp, g.uvIndices);
+            } else if (sub.name_is("UV")) {
+              addArray(arrays, vp, g.uvs);
+            }
+          }
+        } else if (comp.name_is("LayerElementColor")) {
+          for (auto sub : comp) {
+            auto vp = sub.get_props().begin();
+            if (sub.name_is("MappingInformationType")) {
+              vp.getString(g.colorMapping);
+            } else if (sub.name_is("ReferenceInformationType")) {
+              vp.getString(g.colorRef);
+            } else if (sub.name_is("ColorIndex")) {
+              addArray(arrays, vp, g.colorIndices);
+            } else if (sub.name_is("Colors")) {
+              addArray(arrays, vp, g.colors);
+            }
+          }
+        } else if (comp.name_is("PolygonVertexIndex")) {
+          addArray(arrays, vp, g.indices);
+        }
+      }
+    }
+
+    // Copy or inflate the arrays into their geometries. The largest arrays are handed
+    // out first so that one big mesh does not finish on its own at the end.
+    void decodeArrays(std::vector<array_desc> &arrays, unsigned num_threads) const {
+      scoped_phase phase(stats_, "fbx_decoder.decodeArrays");
+      std::stable_sort(arrays.begin(), arrays.end(), [](const array_desc &a, const array_desc &b) { return a.bytes > b.bytes; });
+      parallel_for(0, (int)arrays.size(), [&](int i) {
+        const array_desc &a = arrays[i];
+        if (a.d) {
+          a.value.getArray<double, 'd'>(*a.d, decoder_);
+        } else {
+          a.value.getArray<int32_t, 'i'>(*a.i, decoder_);
+        }
+      }, num_threads);
+
+      // each array is decoded into its own allocation.
+      uint64_t bytes = 0;
+      for (const array_desc &a : arrays) bytes += a.bytes;
+      stats_count(stats_, "fbx_decoder.arrays", arrays.size());
+      stats_count(stats_, "fbx_decoder.allocations", arrays.size());
+      stats_count(stats_, "fbx_decoder.array_bytes", bytes);
+    }
+
+    // Convert the doubles to floats in place. Float i is stored at byte 4*i so
+    // the buffer is read ahead of where it is written.
+    static void narrow(std::vector<double> &values) {
+      uint8_t *p = (uint8_t *)values.data();
+      size_t n = values.size(), i = 0;
+      #if defined(__SSE2__) || defined(_M_X64)
+        for (; i + 4 <= n; i += 4) {
+          __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd((const double *)(p + i * 8)));
+          __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd((const double *)(p + i * 8 + 16)));
+          _mm_storeu_ps((float *)(p + i * 4), _mm_movelh_ps(lo, hi));
+        }
+      #endif
+      for (; i != n; ++i) {
+        double d;
+        memcpy(&d, p + i * 8, 8);
+        float f = (float)d;
+        memcpy(p + i * 4, &f, 4);
+      }
+    }
+
+    // Element i of a narrowed array of vectors with n floats each.
+    template <class Vec>
+    static Vec element(const std::vector<double> &values, size_t i) {
+      const size_t n = sizeof(Vec) / sizeof(float);
+      if ((i + 1) * n > values.size()) throw std::runtime_error("bad fbx index");
+      Vec result;
+      memcpy(&result, (const uint8_t *)values.data() + i * sizeof(Vec), sizeof(Vec));
+      return result;
+    }
+
+    // Build the vertices of a mesh straight from the decoded arrays.
+    // Each polygon corner becomes a vertex_t; identical corners are welded and the
+    // polygons are split into fans of triangles. The mesh uses alloc. The temporaries
+    // are freed before this returns, which the heap reuses straight away but an arena
+    // only would at the next reset(), so they use the default allocator.
+    template<class MeshType>
+    static MeshType *makeMesh(geometry_arrays &g, unsigned num_threads, const typename MeshType::allocator_t &alloc) {
+      typedef typename MeshType::vertex_t vertex_t;
+      typedef typename MeshType::index_t index_t;
+
+      auto normalMapping = fbx_decoder::decodeMapping(g.normalMapping);
+      auto uvMapping = fbx_decoder::decodeMapping(g.uvMapping);
+      auto cMapping = fbx_decoder::decodeMapping(g.colorMapping);
+      auto normalRef = fbx_decoder::decodeRef(g.normalRef);
+      auto uvRef = fbx_decoder::decodeRef(g.uvRef);
+      auto cRef = fbx_decoder::decodeRef(g.colorRef);
+
+      if (g.normals.empty()) {
+        g.normals.assign(3, 0.0);
+      }
+      if (g.uvs.empty()) {
+        g.uvs.assign(2, 0.0);
+      }
+      if (g.colors.empty()) {
+        g.colors.assign(4, 1.0);
+      }
+
+      // after narrowing, the arrays hold half as many floats as doubles.
+      narrow(g.vertices);
+      narrow(g.normals);
+      narrow(g.uvs);
+      narrow(g.colors);
+
+      auto lookup = [](const std::vector<int32_t> &idx, size_t i) -> size_t {
+        if (i >= idx.size() || idx[i] < 0) throw std::runtime_error("bad fbx index");
+        return (size_t)idx[i];
+      };
+
+      // map the fbx data to real vertices, one per polygon corner.
+      std::vector<int32_t> fbxIndices;
+      fbxIndices.swap(g.indices);
+      std::vector<vertex_t> corners;
+      corners.reserve(fbxIndices.size());
+      size_t pi = 0;
+      for (size_t i = 0; i != fbxIndices.size(); ++i) {
+        size_t ni = normalRef == fbx_decoder::Ref::IndexToDirect ? lookup(g.normalIndices, i) : i;
+        size_t uvi = uvRef == fbx_decoder::Ref::IndexToDirect ? lookup(g.uvIndices, i) : i;
+        size_t ci = cRef == fbx_decoder::Ref::IndexToDirect ? lookup(g.colorIndices, i) : i;
+        int32_t vi = fbxIndices[i];
+        if (vi < 0) vi = -1 - vi;
+
+        size_t nj = map(normalMapping, pi, ni, vi);
+        size_t uvj = map(uvMapping, pi, uvi, vi);
+        size_t cj = map(cMapping, pi, ci, vi);
+
+        corners.emplace_back(
+          element<glm::vec3>(g.vertices, vi),
+          element<glm::vec3>(g.normals, nj),
+          element<glm::vec2>(g.uvs, uvj),
+          element<glm::vec4>(g.colors, cj)
+        );
+
+        pi += fbxIndices[i] < 0;
+      }
+
+      // the decoded arrays are no longer needed.
+      g = geometry_arrays();
+
+      typename MeshType::vertex_vector vertices(alloc);
+      std::vector<index_t> cornerIdx;
+      weld(vertices, cornerIdx, corners, num_threads);
+      std::vector<vertex_t>().swap(corners);
+
+      typename MeshType::index_vector indices(alloc);
+      // a polygon of n corners makes n-2 triangles.
+      indices.reserve(fbxIndices.size() > pi * 2 ? (fbxIndices.size() - pi * 2) * 3 : 0);
+      for (size_t i = 0, j = 0; i != fbxIndices.size(); ++i) {
+        if (fbxIndices[i] < 0) {
+          for (size_t k = j+2; k <= i; ++k) {
+            indices.push_back(cornerIdx[j]);
+            indices.push_back(cornerIdx[k-1]);
+            indices.push_back(cornerIdx[k]);
+          }
+          j = i + 1;
+        }
+      }
+
+      return new MeshType(std::move(vertices), std::move(indices));
+    }
+
+    // Real files nest a few levels deep. The limit stops a corrupt file from
+    // overflowing the stack in indexNode() and dump().
+    enum { max_depth = 256 };
+
     void init(const char *begin, const char *end) {
       begin_ = begin;
       end_ = end;
@@ -536,6 +814,7 @@ namespace meshutils {
     }
 
     void dump(std::ostream &os, node &n, int depth, char *tmp, size_t tmp_size) const {
+      if (depth == max_depth) bad_fbx();
       snprintf(tmp, tmp_size, "%*sbegin(\"%s\");\n", depth*2, "", n.name().c_str());
       os << tmp;
       std::vector<uint64_t> ldata;
@@ -577,16 +856,67 @@ namespace meshutils {
 
     friend std::ostream &operator<<(std::ostream &os, const fbx_decoder &fbx);
 
-    void bad_fbx() { throw std::runtime_error("bad fbx"); }
+    // One node of the index. Children are linked in file order and nextSameName
+    // links the children of the same parent that have the same name.
+    struct index_entry {
+      size_t offset;
+      uint32_t name;
+      int parent;
+      int firstChild;
+      int nextSibling;
+      int nextSameName;
+    };
+
+    static uint64_t childKey(int parent, uint32_t name) {
+      return ((uint64_t)(uint32_t)(parent + 1) << 32) | name;
+    }
 
-    //std::vector<std::uint8_t> bytes;
-    //scene the_scene;
+    uint32_t intern(const std::string &name) {
+      auto i = name_ids_.find(name);
+      if (i != name_ids_.end()) return i->second;
+      uint32_t id = (uint32_t)names_.size();
+      names_.push_back(name);
+      name_ids_.emplace(name, id);
+      return id;
+    }
 
+    int indexNode(node &n, int parent, int depth) {
+      if (depth == max_depth) bad_fbx();
+      int idx = (int)index_.size();
+      index_entry e = { n.offset(), intern(n.name()), parent, -1, -1, -1 };
+      index_.push_back(e);
+
+      // children_ holds the first and last child with each name.
+      auto c = children_.emplace(childKey(parent, e.name), std::make_pair(idx, idx));
+      if (!c.second) {
+        index_[c.first->second.second].nextSameName = idx;
+        c.first->second.second = idx;
+      }
+
+      int prev = -1;
+      for (auto child : n) {
+        int ci = indexNode(child, idx, depth + 1);
+        if (prev == -1) index_[idx].firstChild = ci; else index_[prev].nextSibling = ci;
+        prev = ci;
+      }
+      return idx;
+    }
+
+    static void bad_fbx() { throw std::runtime_error("bad fbx"); }
+
+    std::shared_ptr<mapped_file> file_;
     minizip::deflate_decoder decoder_;
+    stats_sink *stats_ = nullptr;
+
+    std::vector<index_entry> index_;
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, uint32_t> name_ids_;
+    std::unordered_map<uint64_t, std::pair<int, int>> children_;
+    std::unordered_map<uint64_t, int> objects_;
 
-    size_t end_offset;
-    const char *begin_;
-    const char *end_;
+    size_t end_offset = 27;
+    const char *begin_ = nullptr;
+    const char *end_ = nullptr;
   };
 
   inline std::ostream &operator<<(std::ostream &os, const fbx_decoder &fbx) {
@@ -15,8 +15,14 @@
 #include <cstring>
 #include <vector>
 #include <cmath>
+#include <memory>
+#include <algorithm>
 
 #include <glm/glm.hpp>
+#include <meshutils/mapped_file.hpp>
+#include <meshutils/parallel.hpp>
+#include <meshutils/span.hpp>
+#include <meshutils/stats.hpp>
 
 
 // https://en.wikipedia.org/wiki/Protein_Data_Bank_(file_format)
@@ -59,51 +65,176 @@ namespace meshutils {
       float tempFactor() const { return atof(p_ - 1 + 61, p_ + 66); }
       std::string element() const { return std::string(p_ - 1 + 77, p_ + 78); }
       std::string charge() const { return std::string(p_ - 1 + 79, p_ + 80); }
+
+      // Columns packed into four bytes, padded with spaces. These do not read past the end of the line.
+      uint32_t atomNameCode() const { return code(p_ - 1 + 13, p_ + 16, eol_); }
+      uint32_t resNameCode() const { return code(p_ - 1 + 18, p_ + 20, eol_); }
+      uint32_t elementCode() const { return code(p_ - 1 + 77, p_ + 78, eol_); }
     };
 
-    pdb_decoder(const uint8_t *begin, const uint8_t *end) {
-      for (const uint8_t *p = begin; p != end; ) {
-        const uint8_t *eol = p;
-        while (eol != end && *eol != '\n') ++eol;
-        const uint8_t *next_p = eol != end ? eol + 1 : end;
-        while (eol != p && (*eol == '\r' || *eol == '\n')) --eol;
-        if (p != eol) {
-          switch (*p) {
-            case 'A': {
-              if (p + 5 < eol && !memcmp(p, "ATOM  ", 6)) {
-                atoms_.emplace_back(p, eol);
-              }
-            } break;
-            case 'H': {
-              if (p + 5 < eol && !memcmp(p, "HETATM", 6)) {
-                hetatoms_.emplace_back(p, eol);
-              }
-            } break;
-          }
+    // All atoms decoded into contiguous columns, one entry per atom in atoms().
+    // Names are packed four byte codes, see code().
+    struct atom_columns {
+      std::vector<float> x;
+      std::vector<float> y;
+      std::vector<float> z;
+      std::vector<float> occupancy;
+      std::vector<float> tempFactor;
+      std::vector<uint32_t> atomName;
+      std::vector<uint32_t> resName;
+      std::vector<uint32_t> element;
+      std::vector<char> chainID;
+      std::vector<int> serial;
+
+      size_t size() const { return x.size(); }
+
+      void clear() {
+        x.clear(); y.clear(); z.clear(); occupancy.clear(); tempFactor.clear();
+        atomName.clear(); resName.clear(); element.clear(); chainID.clear(); serial.clear();
+      }
+
+      void push_back(const atom &a) {
+        x.push_back(a.x());
+        y.push_back(a.y());
+        z.push_back(a.z());
+        occupancy.push_back(a.occupancy());
+        tempFactor.push_back(a.tempFactor());
+        atomName.push_back(a.atomNameCode());
+        resName.push_back(a.resNameCode());
+        element.push_back(a.elementCode());
+        chainID.push_back(a.chainID());
+        serial.push_back(a.serial());
+      }
+
+      void append(const atom_columns &rhs) {
+        append(x, rhs.x); append(y, rhs.y); append(z, rhs.z);
+        append(occupancy, rhs.occupancy); append(tempFactor, rhs.tempFactor);
+        append(atomName, rhs.atomName); append(resName, rhs.resName); append(element, rhs.element);
+        append(chainID, rhs.chainID); append(serial, rhs.serial);
+      }
+
+      // Reorder so that entry i becomes entry order[i].
+      void permute(const std::vector<uint32_t> &order) {
+        permute(x, order); permute(y, order); permute(z, order);
+        permute(occupancy, order); permute(tempFactor, order);
+        permute(atomName, order); permute(resName, order); permute(element, order);
+        permute(chainID, order); permute(serial, order);
+      }
+
+    private:
+      template <class T>
+      static void append(std::vector<T> &dest, const std::vector<T> &src) {
+        dest.insert(dest.end(), src.begin(), src.end());
+      }
+
+      template <class T>
+      static void permute(std::vector<T> &v, const std::vector<uint32_t> &order) {
+        std::vector<T> result(v.size());
+        for (size_t i = 0; i != order.size(); ++i) {
+          result[i] = v[order[i]];
         }
-        p = next_p;
+        v.swap(result);
       }
+    };
+
+    // Indices [begin, end) into atoms() and columns().
+    struct atom_range {
+      size_t begin;
+      size_t end;
+      size_t size() const { return end - begin; }
+    };
+
+    // A run of atoms with the same chain, residue sequence number and insertion code.
+    struct residue {
+      char chainID;
+      char iCode;
+      int resSeq;
+      uint32_t resName;
+      atom_range atoms;
+    };
+
+    pdb_decoder() {
+    }
+
+    // If eager is set, decode every atom into columns() using num_threads threads (0 = one per core).
+    pdb_decoder(const uint8_t *begin, const uint8_t *end, bool eager = false, unsigned num_threads = 0) {
+      init(begin, end, eager, num_threads);
+    }
+
+    // Map a file and decode it in place. The atoms point into the mapped file
+    // which stays open for the lifetime of the decoder and its copies.
+    bool open(const char *filename, bool eager = false, unsigned num_threads = 0) {
+      auto file = std::make_shared<mapped_file>();
+      if (!file->open(filename)) return false;
+      file_ = file;
+      init(file_->begin(), file_->end(), eager, num_threads);
+      return true;
     }
 
+    // ATOM records grouped by chain, in file order within each chain.
     const std::vector<atom> &atoms() const { return atoms_; }
 
+    // Atoms of one chain, '?' for all chains.
+    span<const atom> atoms(char chainID) const {
+      atom_range r = chainRange(chainID);
+      return span<const atom>(atoms_.data() + r.begin, r.size());
+    }
+
+    // Range of atoms of one chain, '?' for all chains.
+    atom_range chainRange(char chainID) const {
+      if (chainID == '?') return atom_range{ 0, atoms_.size() };
+      uint8_t c = (uint8_t)chainID;
+      return atom_range{ chain_atoms_[c], chain_atoms_[c+1] };
+    }
+
+    // Residues in the same order as atoms().
+    const std::vector<residue> &residues() const { return residues_; }
+
+    // Residues of one chain, '?' for all chains.
+    span<const residue> residues(char chainID) const {
+      if (chainID == '?') return span<const residue>(residues_);
+      uint8_t c = (uint8_t)chainID;
+      return span<const residue>(residues_.data() + chain_residues_[c], residues_.data() + chain_residues_[c+1]);
+    }
+
+    // Decoded atoms, empty unless the decoder was created in eager mode.
+    const atom_columns &columns() const { return columns_; }
+
+    bool eager() const { return eager_; }
+
+    // Report phase timings and counters of open() to stats, or nothing if it is null. See stats.hpp.
+    void setStats(stats_sink *stats) {
+      stats_ = stats;
+    }
+
     std::string chains() const {
-      bool used[256] = {};
-      for (auto &p : atoms_) {
-        used[p.chainID()] = true;
-      }
       std::string result;
       for (size_t i = 0; i != 128; ++i) {
-        if (used[i]) result.push_back((char)i);
+        if (chain_atoms_[i+1] != chain_atoms_[i]) result.push_back((char)i);
       }
       return std::move(result);
     }
 
+    // Positions of the atoms of one chain, '?' for all chains.
     std::vector<glm::vec3> pos(char chainID = '?') const {
+      return pos(std::string(1, chainID));
+    }
+
+    // Positions of the atoms of a set of chains, eg. "ABE", in the order given.
+    std::vector<glm::vec3> pos(const std::string &chainIDs) const {
+      std::vector<atom_range> ranges = select(chainIDs);
       std::vector<glm::vec3> result;
-      for (auto &p : atoms_) {
-        if (chainID == '?' || p.chainID() == chainID) {
-          result.push_back(glm::vec3(p.x(), p.y(), p.z()));
+      result.reserve(count(ranges));
+      for (atom_range r : ranges) {
+        if (eager_) {
+          for (size_t i = r.begin; i != r.end; ++i) {
+            result.push_back(glm::vec3(columns_.x[i], columns_.y[i], columns_.z[i]));
+          }
+        } else {
+          for (size_t i = r.begin; i != r.end; ++i) {
+            const atom &p = atoms_[i];
+            result.push_back(glm::vec3(p.x(), p.y(), p.z()));
+          }
         }
       }
       return std::move(result);
@@ -111,49 +242,243 @@ namespace meshutils {
 
     // Van Der Walls radii of atoms
     std::vector<float> radii(char chainID = '?') const {
+      return radii(std::string(1, chainID));
+    }
+
+    std::vector<float> radii(const std::string &chainIDs) const {
+      std::vector<atom_range> ranges = select(chainIDs);
       std::vector<float> result;
-      for (auto &p : atoms_) {
-        if (chainID == '?' || p.chainID() == chainID) {
-          result.push_back(vdvRadius(p.element()));
+      result.reserve(count(ranges));
+      for (atom_range r : ranges) {
+        for (size_t i = r.begin; i != r.end; ++i) {
+          result.push_back(vdvRadius(eager_ ? columns_.element[i] : atoms_[i].elementCode()));
         }
       }
       return std::move(result);
     }
 
     std::vector<glm::vec4> colorsByFunction(char chainID = '?') const {
+      return colorsByFunction(std::string(1, chainID));
+    }
+
+    std::vector<glm::vec4> colorsByFunction(const std::string &chainIDs) const {
+      std::vector<atom_range> ranges = select(chainIDs);
       std::vector<glm::vec4> result;
-      for (auto &p : atoms_) {
-        if (chainID == '?' || p.chainID() == chainID) {
-          std::string atom = p.atomName();
-          std::string resName = p.resName();
-          if (
-            (atom == " NZ " && resName == "LYS") ||
-            (atom == " NH1" && resName == "ARG") ||
-            (atom == " NH2" && resName == "ARG") ||
-            (atom == " ND1" && resName == "HIS") ||
-            (atom == " NE2" && resName == "HIS")
-          ) {
-            // Positive: blue
-            result.push_back(glm::vec4(0, 0, 1, 1));
-          } else if (
-            (atom == " OE1" && resName == "GLU") ||
-            (atom == " OE2" && resName == "GLU") ||
-            (atom == " OD1" && resName == "ASP") ||
-            (atom == " OD2" && resName == "ASP")
-          ) {
-            // Negative: red
-            result.push_back(glm::vec4(1, 0, 0, 1));
-          } else {
-            // default: white
-            result.push_back(glm::vec4(1, 1, 1, 1));
+      result.reserve(count(ranges));
+      for (atom_range r : ranges) {
+        if (eager_) {
+          for (size_t i = r.begin; i != r.end; ++i) {
+            result.push_back(colorByFunction(columns_.atomName[i], columns_.resName[i]));
+          }
+        } else {
+          for (size_t i = r.begin; i != r.end; ++i) {
+            result.push_back(colorByFunction(atoms_[i].atomNameCode(), atoms_[i].resNameCode()));
           }
         }
       }
       return std::move(result);
     }
+
+    // Pack up to four characters of a column into a little endian code, padded with spaces.
+    // eg. code(" CA ") for an atom name or code("LYS") for a residue name.
+    static constexpr uint32_t code(const char *str) {
+      return code(str, 0);
+    }
   private:
+    static constexpr uint32_t code(const char *str, int i) {
+      return i == 4 ? 0 : ((uint32_t)(uint8_t)(*str ? *str : ' ') << (i * 8)) | code(*str ? str + 1 : str, i + 1);
+    }
+
+    static uint32_t code(const uint8_t *b, const uint8_t *e, const uint8_t *eol) {
+      uint32_t result = 0x20202020;
+      for (int i = 0; i != 4 && b + i != e && b + i < eol; ++i) {
+        result ^= (uint32_t)(b[i] ^ ' ') << (i * 8);
+      }
+      return result;
+    }
+
+    static glm::vec4 colorByFunction(uint32_t atom, uint32_t resName) {
+      if (
+        (atom == code(" NZ ") && resName == code("LYS")) ||
+        (atom == code(" NH1") && resName == code("ARG")) ||
+        (atom == code(" NH2") && resName == code("ARG")) ||
+        (atom == code(" ND1") && resName == code("HIS")) ||
+        (atom == code(" NE2") && resName == code("HIS"))
+      ) {
+        // Positive: blue
+        return glm::vec4(0, 0, 1, 1);
+      } else if (
+        (atom == code(" OE1") && resName == code("GLU")) ||
+        (atom == code(" OE2") && resName == code("GLU")) ||
+        (atom == code(" OD1") && resName == code("ASP")) ||
+        (atom == code(" OD2") && resName == code("ASP"))
+      ) {
+        // Negative: red
+        return glm::vec4(1, 0, 0, 1);
+      } else {
+        // default: white
+        return glm::vec4(1, 1, 1, 1);
+      }
+    }
+
+    // Ranges of a set of chains, each chain once. '?' selects all atoms.
+    std::vector<atom_range> select(const std::string &chainIDs) const {
+      std::vector<atom_range> result;
+      bool used[256] = {};
+      for (char c : chainIDs) {
+        if (c == '?') return std::vector<atom_range>(1, chainRange('?'));
+        if (used[(uint8_t)c]) continue;
+        used[(uint8_t)c] = true;
+        atom_range r = chainRange(c);
+        if (r.size()) result.push_back(r);
+      }
+      return std::move(result);
+    }
+
+    static size_t count(const std::vector<atom_range> &ranges) {
+      size_t result = 0;
+      for (atom_range r : ranges) result += r.size();
+      return result;
+    }
+
+    struct chunk {
+      std::vector<atom> atoms;
+      std::vector<atom> hetatoms;
+      atom_columns columns;
+    };
+
+    static void decodeLines(chunk &dest, const uint8_t *begin, const uint8_t *end, bool eager) {
+      for (const uint8_t *p = begin; p != end; ) {
+        const uint8_t *eol = p;
+        while (eol != end && *eol != '\n') ++eol;
+        const uint8_t *next_p = eol != end ? eol + 1 : end;
+        // eol is one past the last character of the line, as for a line without a newline.
+        while (eol != p && eol[-1] == '\r') --eol;
+        if (p != eol) {
+          switch (*p) {
+            case 'A': {
+              if (p + 5 < eol && !memcmp(p, "ATOM  ", 6)) {
+                dest.atoms.emplace_back(p, eol);
+                if (eager) dest.columns.push_back(dest.atoms.back());
+              }
+            } break;
+            case 'H': {
+              if (p + 5 < eol && !memcmp(p, "HETATM", 6)) {
+                dest.hetatoms.emplace_back(p, eol);
+              }
+            } break;
+          }
+        }
+        p = next_p;
+      }
+    }
+
+    void init(const uint8_t *begin, const uint8_t *end, bool eager, unsigned num_threads) {
+      atoms_.clear();
+      hetatoms_.clear();
+      columns_.clear();
+      eager_ = eager;
+      scoped_phase phase(stats_, eager ? "pdb_decoder.decodeEager" : "pdb_decoder.decode");
+      stats_count(stats_, "pdb_decoder.bytes", (uint64_t)(end - begin));
+
+      // Lazy decoding only finds the lines, so only split the file when decoding columns.
+      const size_t chunk_size = 256 * 1024;
+      size_t size = (size_t)(end - begin);
+      size_t num_chunks = eager ? size / chunk_size + 1 : 1;
+
+      // Chunks start at the beginning of a line.
+      std::vector<const uint8_t *> starts(num_chunks + 1);
+      starts[0] = begin;
+      starts[num_chunks] = end;
+      for (size_t i = 1; i != num_chunks; ++i) {
+        const uint8_t *p = std::max(starts[i-1], begin + i * size / num_chunks);
+        while (p != end && p[-1] != '\n') ++p;
+        starts[i] = p;
+      }
+
+      if (num_chunks == 1) {
+        chunk result;
+        decodeLines(result, begin, end, eager);
+        atoms_.swap(result.atoms);
+        hetatoms_.swap(result.hetatoms);
+        columns_ = std::move(result.columns);
+        buildIndex();
+        return;
+      }
+
+      std::vector<chunk> chunks(num_chunks);
+      parallel_for(0, (int)num_chunks, [&](int i) {
+        decodeLines(chunks[i], starts[i], starts[i+1], eager);
+      }, num_threads);
+
+      for (auto &c : chunks) {
+        atoms_.insert(atoms_.end(), c.atoms.begin(), c.atoms.end());
+        hetatoms_.insert(hetatoms_.end(), c.hetatoms.begin(), c.hetatoms.end());
+        columns_.append(c.columns);
+      }
+      buildIndex();
+    }
+
+    // Group the atoms by chain with a stable counting sort and find the residues.
+    void buildIndex() {
+      stats_count(stats_, "pdb_decoder.atoms", atoms_.size());
+      stats_count(stats_, "pdb_decoder.hetatoms", hetatoms_.size());
+      std::fill(chain_atoms_, chain_atoms_ + 257, 0);
+      std::fill(chain_residues_, chain_residues_ + 257, 0);
+      residues_.clear();
+
+      bool sorted = true;
+      uint8_t prev = 0;
+      for (auto &a : atoms_) {
+        uint8_t c = (uint8_t)a.chainID();
+        chain_atoms_[c+1]++;
+        sorted = sorted && c >= prev;
+        prev = c;
+      }
+      for (size_t c = 1; c != 257; ++c) {
+        chain_atoms_[c] += chain_atoms_[c-1];
+      }
+
+      // Most files already have their chains in order.
+      if (!sorted) {
+        std::vector<uint32_t> order(atoms_.size());
+        std::vector<size_t> next(chain_atoms_, chain_atoms_ + 256);
+        for (size_t i = 0; i != atoms_.size(); ++i) {
+          order[next[(uint8_t)atoms_[i].chainID()]++] = (uint32_t)i;
+        }
+        std::vector<atom> atoms;
+        atoms.reserve(atoms_.size());
+        for (uint32_t i : order) atoms.push_back(atoms_[i]);
+        atoms_.swap(atoms);
+        if (eager_) columns_.permute(order);
+      }
+
+      for (size_t i = 0; i != atoms_.size(); ++i) {
+        const atom &a = atoms_[i];
+        char chainID = a.chainID();
+        char iCode = a.iCode();
+        int resSeq = a.resSeq();
+        if (residues_.empty() || residues_.back().chainID != chainID || residues_.back().resSeq != resSeq || residues_.back().iCode != iCode) {
+          residue r = { chainID, iCode, resSeq, a.resNameCode(), atom_range{ i, i } };
+          residues_.push_back(r);
+          chain_residues_[(uint8_t)chainID+1]++;
+        }
+        residues_.back().atoms.end = i + 1;
+      }
+      for (size_t c = 1; c != 257; ++c) {
+        chain_residues_[c] += chain_residues_[c-1];
+      }
+    }
+
+    std::shared_ptr<mapped_file> file_;
     std::vector<atom> atoms_;
     std::vector<atom> hetatoms_;
+    atom_columns columns_;
+    std::vector<residue> residues_;
+    size_t chain_atoms_[257] = {};
+    size_t chain_residues_[257] = {};
+    bool eager_ = false;
+    stats_sink *stats_ = nullptr;
 
     static int atoi(const uint8_t *b, const uint8_t *e) {
       while (b != e && *b == ' ') ++b;
@@ -186,7 +511,8 @@ namespace meshutils {
       }
     }
 
-    static float vdvRadius(const std::string &element) {
+    // element is a right justified two letter symbol packed by code().
+    static float vdvRadius(uint32_t element) {
       // https://en.wikipedia.org/wiki/Atomic_radii_of_the_elements_(data_page)
 
       struct data_t { char name[4]; short vdv; };
@@ -201,8 +527,9 @@ namespace meshutils {
         "BI", 207, "PO", 197, "AT", 202, "RN", 220, "FR", 348, "RA", 283, "U ", 186,
       };
 
-      char e0 = element[1];
-      char e1 = element[2];
+      char e0 = (char)(element & 0xff);
+      char e1 = (char)((element >> 8) & 0xff);
+      if (e0 == ' ') { e0 = e1; e1 = ' '; }
       for (const data_t &d : data) {
         if (e0 == d.name[0] && e1 == d.name[1]) {
           return d.vdv * 0.01f;
@@ -0,0 +1,174 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Multi-model PDB reader for molecular dynamics trajectories
+//
+// The first MODEL is decoded in full by pdb_decoder and used as the topology
+// (names, elements, radii, chains). Later models only have their coordinates read.
+
+#ifndef MESHUTILS_pdb_trajectory_INCLUDED
+#define MESHUTILS_pdb_trajectory_INCLUDED
+
+#include <meshutils/decoders/pdb_decoder.hpp>
+#include <stdexcept>
+
+namespace meshutils {
+  class pdb_trajectory {
+  public:
+    // The byte range of one MODEL ... ENDMDL block.
+    struct frame {
+      const uint8_t *begin;
+      const uint8_t *end;
+      int model;
+    };
+
+    pdb_trajectory() {
+    }
+
+    pdb_trajectory(const uint8_t *begin, const uint8_t *end) {
+      init(begin, end);
+    }
+
+    // Map a file. Frames are read from the mapping as they are needed.
+    bool open(const char *filename) {
+      auto file = std::make_shared<mapped_file>();
+      if (!file->open(filename)) return false;
+      file_ = file;
+      init(file_->begin(), file_->end());
+      return true;
+    }
+
+    // The first model. Positions from next() are in the order of topology().atoms().
+    const pdb_decoder &topology() const { return topology_; }
+
+    size_t numAtoms() const { return order_.size(); }
+
+    // Go back to the first frame.
+    void rewind() {
+      cursor_ = begin_;
+    }
+
+    // Find the next frame without decoding it, returns false at the end of the file.
+    bool nextFrame(frame &result) {
+      const uint8_t *b = nullptr;
+      int model = 0;
+      const uint8_t *p = cursor_;
+      while (p != end_ && !b) {
+        const uint8_t *next_p = nextLine(p);
+        if (record(p, next_p, "MODEL ")) {
+          b = next_p;
+          model = atoi(p + 10, std::min(p + 14, next_p));
+        } else if (record(p, next_p, "ATOM  ") || record(p, next_p, "HETATM")) {
+          // a file without MODEL records is a single frame.
+          b = p;
+        }
+        p = next_p;
+      }
+      if (!b) {
+        cursor_ = end_;
+        return false;
+      }
+
+      const uint8_t *e = end_;
+      for (p = b; p != end_; ) {
+        const uint8_t *next_p = nextLine(p);
+        if (record(p, next_p, "ENDMDL")) {
+          e = p;
+          p = next_p;
+          break;
+        } else if (record(p, next_p, "MODEL ")) {
+          e = p;
+          break;
+        }
+        p = next_p;
+      }
+      cursor_ = p;
+      result = frame{ b, e, model };
+      return true;
+    }
+
+    // Read the ATOM coordinates of a frame into pos, reusing its memory.
+    // This does not change the reader, so frame N+1 can be decoded on another
+    // thread while frame N is being meshed.
+    void decode(const frame &f, std::vector<glm::vec3> &pos) const {
+      pos.resize(order_.size());
+      size_t k = 0;
+      for (const uint8_t *p = f.begin; p != f.end; ) {
+        const uint8_t *next_p = nextLine(p);
+        if (record(p, next_p, "ATOM  ")) {
+          if (k < order_.size()) {
+            pdb_decoder::atom a(p, next_p);
+            pos[order_[k]] = glm::vec3(a.x(), a.y(), a.z());
+          }
+          ++k;
+        }
+        p = next_p;
+      }
+      if (k != order_.size()) {
+        throw std::runtime_error("pdb model has a different number of atoms to the first model");
+      }
+    }
+
+    // Read the next frame into pos, returns false at the end of the file.
+    bool next(std::vector<glm::vec3> &pos) {
+      frame f;
+      if (!nextFrame(f)) return false;
+      decode(f, pos);
+      return true;
+    }
+  private:
+    void init(const uint8_t *begin, const uint8_t *end) {
+      begin_ = cursor_ = begin;
+      end_ = end;
+      order_.clear();
+
+      frame f;
+      if (!nextFrame(f)) {
+        topology_ = pdb_decoder();
+        rewind();
+        return;
+      }
+      topology_ = pdb_decoder(f.begin, f.end, true, 1);
+
+      // pdb_decoder groups atoms by chain with a stable sort, map file order to its order.
+      size_t next[256];
+      for (size_t c = 0; c != 256; ++c) {
+        next[c] = topology_.chainRange((char)c).begin;
+      }
+      for (const uint8_t *p = f.begin; p != f.end; ) {
+        const uint8_t *next_p = nextLine(p);
+        if (record(p, next_p, "ATOM  ")) {
+          order_.push_back((uint32_t)next[p[21]]++);
+        }
+        p = next_p;
+      }
+      rewind();
+    }
+
+    const uint8_t *nextLine(const uint8_t *p) const {
+      const uint8_t *e = (const uint8_t *)memchr(p, '\n', (size_t)(end_ - p));
+      return e ? e + 1 : end_;
+    }
+
+    static bool record(const uint8_t *p, const uint8_t *next_p, const char *name) {
+      return next_p - p >= 6 && !memcmp(p, name, 6);
+    }
+
+    static int atoi(const uint8_t *b, const uint8_t *e) {
+      while (b < e && *b == ' ') ++b;
+      int n = 0;
+      while (b < e && *b >= '0' && *b <= '9') n = n * 10 + *b++ - '0';
+      return n;
+    }
+
+    std::shared_ptr<mapped_file> file_;
+    pdb_decoder topology_;
+    std::vector<uint32_t> order_;
+    const uint8_t *begin_ = nullptr;
+    const uint8_t *end_ = nullptr;
+    const uint8_t *cursor_ = nullptr;
+  };
+}
+
+#endif
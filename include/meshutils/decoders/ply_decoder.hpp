@@ -0,0 +1,386 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Stanford PLY file decoder
+//
+// Reads ascii and binary PLY files from memory or a mapped file.
+// Binary vertices whose properties have the same layout as the mesh's vertex_t
+// are copied into the mesh in one block.
+
+#ifndef MESHUTILS_ply_decoder_INCLUDED
+#define MESHUTILS_ply_decoder_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <meshutils/mesh.hpp>
+#include <meshutils/mapped_file.hpp>
+
+// http://paulbourke.net/dataformats/ply/
+namespace meshutils {
+  class ply_decoder {
+  public:
+    enum class format {
+      ascii,
+      binary_little_endian,
+      binary_big_endian,
+    };
+
+    // type is a struct style code (see mesh.hpp attribute): b B h H i I f d.
+    // Lists also have a count type, otherwise count_type is 0.
+    struct property {
+      std::string name;
+      char type;
+      char count_type;
+    };
+
+    struct element {
+      std::string name;
+      size_t count;
+      std::vector<property> properties;
+    };
+
+    ply_decoder() {
+    }
+
+    // Decode the header of a PLY file in memory, throws if it is not a PLY file.
+    ply_decoder(const uint8_t *begin, const uint8_t *end) {
+      init(begin, end);
+    }
+
+    // Map a file and decode its header.
+    // Returns false if the file can not be opened and throws if it is not a PLY file.
+    bool open(const char *filename) {
+      auto file = std::make_shared<mapped_file>();
+      if (!file->open(filename)) return false;
+      file_ = file;
+      init(file_->begin(), file_->end());
+      return true;
+    }
+
+    format fileFormat() const { return format_; }
+    const std::vector<element> &elements() const { return elements_; }
+
+    // Read the vertex and face elements into a mesh. Polygons are split into fans of
+    // triangles and other elements are skipped. Returns false if there is no vertex element.
+    // The mesh keeps its allocator, eg. an arena.
+    template <class MeshTraits, class Allocator>
+    bool loadMesh(basic_mesh<MeshTraits, Allocator> &mesh) const {
+      typedef basic_mesh<MeshTraits, Allocator> mesh_t;
+
+      typename mesh_t::vertex_vector vertices(mesh.get_allocator());
+      typename mesh_t::index_vector indices(mesh.get_allocator());
+      bool has_vertices = false;
+
+      const uint8_t *p = data_;
+      for (auto &elem : elements_) {
+        if (elem.name == "vertex" && !has_vertices) {
+          p = readVertices(vertices, elem, p);
+          has_vertices = true;
+        } else if (elem.name == "face" && indices.empty()) {
+          p = readFaces(indices, elem, p, vertices.size());
+        } else {
+          p = skip(elem, p);
+        }
+      }
+
+      mesh = mesh_t(std::move(vertices), std::move(indices));
+      return has_vertices;
+    }
+
+  private:
+    // vertex attribute slots, see vertexSlot().
+    enum { num_slots = 12, pos_slot = 0, normal_slot = 3, uv_slot = 6, color_slot = 8 };
+
+    template <class VertexType, class VertexAlloc>
+    const uint8_t *readVertices(std::vector<VertexType, VertexAlloc> &vertices, const element &elem, const uint8_t *p) const {
+      std::vector<int> slots;
+      for (auto &prop : elem.properties) {
+        slots.push_back(vertexSlot(prop.name));
+      }
+
+      if (format_ == format::binary_little_endian && little_endian() && sameLayout<VertexType>(elem, slots)) {
+        if (elem.count > (size_t)(end_ - p) / sizeof(VertexType)) bad_ply();
+        size_t bytes = elem.count * sizeof(VertexType);
+        vertices.resize(elem.count);
+        memcpy(vertices.data(), p, bytes);
+        return p + bytes;
+      }
+
+      // every vertex takes at least one byte, do not trust the count any further than that.
+      vertices.reserve(std::min(elem.count, (size_t)(end_ - p)));
+      for (size_t i = 0; i != elem.count; ++i) {
+        float values[num_slots] = { 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 1, 1 };
+        for (size_t j = 0; j != elem.properties.size(); ++j) {
+          auto &prop = elem.properties[j];
+          if (prop.count_type) {
+            p = skipList(prop, p);
+            continue;
+          }
+          double value;
+          p = read(value, prop.type, p);
+          if (slots[j] >= 0) {
+            // integer colours are 0..255.
+            bool scale = slots[j] >= color_slot && prop.type != 'f' && prop.type != 'd';
+            values[slots[j]] = scale ? (float)(value * (1.0 / 255)) : (float)value;
+          }
+        }
+        vertices.emplace_back(
+          glm::vec3(values[0], values[1], values[2]),
+          glm::vec3(values[3], values[4], values[5]),
+          glm::vec2(values[6], values[7]),
+          glm::vec4(values[8], values[9], values[10], values[11])
+        );
+      }
+      return p;
+    }
+
+    template <class IndexType, class IndexAlloc>
+    const uint8_t *readFaces(std::vector<IndexType, IndexAlloc> &indices, const element &elem, const uint8_t *p, size_t num_vertices) const {
+      std::vector<uint32_t> poly;
+      indices.reserve(std::min(elem.count, (size_t)(end_ - p)) * 3);
+      for (size_t i = 0; i != elem.count; ++i) {
+        for (auto &prop : elem.properties) {
+          if (!prop.count_type) {
+            double value;
+            p = read(value, prop.type, p);
+          } else if (prop.name != "vertex_indices" && prop.name != "vertex_index") {
+            p = skipList(prop, p);
+          } else {
+            double count;
+            p = read(count, prop.count_type, p);
+            if (!validCount(count, p)) bad_ply();
+            poly.resize((size_t)count);
+            for (auto &idx : poly) {
+              double value;
+              p = read(value, prop.type, p);
+              if (!(value >= 0 && value < (double)num_vertices)) bad_ply();
+              idx = (uint32_t)value;
+            }
+            for (size_t k = 2; k < poly.size(); ++k) {
+              indices.push_back((IndexType)poly[0]);
+              indices.push_back((IndexType)poly[k-1]);
+              indices.push_back((IndexType)poly[k]);
+            }
+          }
+        }
+      }
+      return p;
+    }
+
+    const uint8_t *skip(const element &elem, const uint8_t *p) const {
+      for (size_t i = 0; i != elem.count; ++i) {
+        for (auto &prop : elem.properties) {
+          if (prop.count_type) {
+            p = skipList(prop, p);
+          } else {
+            double value;
+            p = read(value, prop.type, p);
+          }
+        }
+      }
+      return p;
+    }
+
+    // A list count read from the file. Every value takes at least one byte, so
+    // larger counts, negative counts and NaN are errors.
+    bool validCount(double count, const uint8_t *p) const {
+      return count >= 0 && count <= (double)(end_ - p);
+    }
+
+    const uint8_t *skipList(const property &prop, const uint8_t *p) const {
+      double count;
+      p = read(count, prop.count_type, p);
+      if (!validCount(count, p)) bad_ply();
+      for (size_t k = 0; k < (size_t)count; ++k) {
+        double value;
+        p = read(value, prop.type, p);
+      }
+      return p;
+    }
+
+    // True if the vertices in the file are bitwise the same as VertexType.
+    template <class VertexType>
+    static bool sameLayout(const element &elem, const std::vector<int> &slots) {
+      for (auto &prop : elem.properties) {
+        if (prop.count_type || prop.type != 'f') return false;
+      }
+      return same_float_layout<VertexType>(slots.data(), slots.size());
+    }
+
+    static int vertexSlot(const std::string &name) {
+      static const char *names[] = {
+        "x", "y", "z", "nx", "ny", "nz", "u", "v", "red", "green", "blue", "alpha",
+      };
+      for (int i = 0; i != num_slots; ++i) {
+        if (name == names[i]) return i;
+      }
+      if (name == "s" || name == "texture_u") return uv_slot;
+      if (name == "t" || name == "texture_v") return uv_slot + 1;
+      return -1;
+    }
+
+    // Read one value of a property.
+    const uint8_t *read(double &value, char type, const uint8_t *p) const {
+      if (format_ == format::ascii) {
+        return readAscii(value, p);
+      }
+
+      size_t size = typeSize(type);
+      if ((size_t)(end_ - p) < size) bad_ply();
+      uint8_t bytes[8];
+      memcpy(bytes, p, size);
+      if ((format_ == format::binary_big_endian) == little_endian()) {
+        std::reverse(bytes, bytes + size);
+      }
+      switch (type) {
+        case 'b': { int8_t v; memcpy(&v, bytes, 1); value = v; } break;
+        case 'B': { uint8_t v; memcpy(&v, bytes, 1); value = v; } break;
+        case 'h': { int16_t v; memcpy(&v, bytes, 2); value = v; } break;
+        case 'H': { uint16_t v; memcpy(&v, bytes, 2); value = v; } break;
+        case 'i': { int32_t v; memcpy(&v, bytes, 4); value = v; } break;
+        case 'I': { uint32_t v; memcpy(&v, bytes, 4); value = v; } break;
+        case 'f': { float v; memcpy(&v, bytes, 4); value = v; } break;
+        default: { double v; memcpy(&v, bytes, 8); value = v; } break;
+      }
+      return p + size;
+    }
+
+    // Fast decimal parser for ascii files. Numbers with more than 19 digits or
+    // large exponents are passed to strtod.
+    const uint8_t *readAscii(double &value, const uint8_t *p) const {
+      while (p != end_ && isSpace(*p)) ++p;
+      const uint8_t *b = p;
+
+      bool negative = false;
+      if (p != end_ && (*p == '-' || *p == '+')) negative = *p++ == '-';
+      uint64_t m = 0;
+      int digits = 0, exp10 = 0;
+      bool any = false;
+      for (; p != end_ && *p >= '0' && *p <= '9'; ++p, any = true) {
+        if (digits < 19) { m = m * 10 + (*p - '0'); digits += m != 0; } else ++exp10;
+      }
+      if (p != end_ && *p == '.') {
+        for (++p; p != end_ && *p >= '0' && *p <= '9'; ++p, any = true) {
+          if (digits < 19) { m = m * 10 + (*p - '0'); digits += m != 0; --exp10; }
+        }
+      }
+      if (!any) bad_ply();
+      if (p != end_ && (*p == 'e' || *p == 'E')) {
+        const uint8_t *q = p + 1;
+        bool eneg = false;
+        if (q != end_ && (*q == '-' || *q == '+')) eneg = *q++ == '-';
+        int e = 0;
+        if (q == end_ || *q < '0' || *q > '9') bad_ply();
+        for (; q != end_ && *q >= '0' && *q <= '9'; ++q) e = std::min(e * 10 + (*q - '0'), 10000);
+        exp10 += eneg ? -e : e;
+        p = q;
+      }
+      if (p != end_ && !isSpace(*p)) bad_ply();
+
+      // m and the power of ten are exact doubles so v is rounded once.
+      if (m <= (1ull << 53) && digits < 19 && exp10 >= -22 && exp10 <= 22) {
+        double v = (double)m;
+        v = exp10 < 0 ? v / exact_pow10(-exp10) : v * exact_pow10(exp10);
+        value = negative ? -v : v;
+      } else {
+        std::string text(b, p);
+        value = strtod(text.c_str(), nullptr);
+      }
+      return p;
+    }
+
+    static bool isSpace(uint8_t c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+    static size_t typeSize(char type) {
+      switch (type) {
+        case 'b': case 'B': return 1;
+        case 'h': case 'H': return 2;
+        case 'i': case 'I': case 'f': return 4;
+        default: return 8;
+      }
+    }
+
+    static char decodeType(const std::string &name) {
+      if (name == "char" || name == "int8") return 'b';
+      if (name == "uchar" || name == "uint8") return 'B';
+      if (name == "short" || name == "int16") return 'h';
+      if (name == "ushort" || name == "uint16") return 'H';
+      if (name == "int" || name == "int32") return 'i';
+      if (name == "uint" || name == "uint32") return 'I';
+      if (name == "float" || name == "float32") return 'f';
+      if (name == "double" || name == "float64") return 'd';
+      throw std::runtime_error("bad ply property type " + name);
+    }
+
+    void init(const uint8_t *begin, const uint8_t *end) {
+      begin_ = begin;
+      end_ = end;
+      elements_.clear();
+
+      const uint8_t *p = begin;
+      std::vector<std::string> words;
+      bool has_format = false;
+      for (int line = 0; ; ++line) {
+        if (p == end) bad_ply();
+        const uint8_t *eol = (const uint8_t *)memchr(p, '\n', (size_t)(end - p));
+        if (!eol) bad_ply();
+
+        words.clear();
+        for (const uint8_t *q = p; q != eol; ) {
+          while (q != eol && isSpace(*q)) ++q;
+          const uint8_t *w = q;
+          while (q != eol && !isSpace(*q)) ++q;
+          if (q != w) words.emplace_back(w, q);
+        }
+        p = eol + 1;
+
+        if (line == 0) {
+          if (words.size() != 1 || words[0] != "ply") bad_ply();
+        } else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+        } else if (words[0] == "end_header") {
+          break;
+        } else if (words[0] == "format" && words.size() >= 2) {
+          if (words[1] == "ascii") format_ = format::ascii;
+          else if (words[1] == "binary_little_endian") format_ = format::binary_little_endian;
+          else if (words[1] == "binary_big_endian") format_ = format::binary_big_endian;
+          else bad_ply();
+          has_format = true;
+        } else if (words[0] == "element" && words.size() == 3) {
+          elements_.push_back(element{ words[1], (size_t)strtoull(words[2].c_str(), nullptr, 10), {} });
+        } else if (words[0] == "property" && !elements_.empty()) {
+          if (words.size() == 5 && words[1] == "list") {
+            elements_.back().properties.push_back(property{ words[4], decodeType(words[3]), decodeType(words[2]) });
+          } else if (words.size() == 3) {
+            elements_.back().properties.push_back(property{ words[2], decodeType(words[1]), 0 });
+          } else {
+            bad_ply();
+          }
+        } else {
+          bad_ply();
+        }
+      }
+      if (!has_format) bad_ply();
+      data_ = p;
+    }
+
+    static void bad_ply() { throw std::runtime_error("bad ply file"); }
+
+    std::shared_ptr<mapped_file> file_;
+    std::vector<element> elements_;
+    format format_ = format::ascii;
+    const uint8_t *begin_ = nullptr;
+    const uint8_t *end_ = nullptr;
+    const uint8_t *data_ = nullptr;
+  };
+}
+
+#endif
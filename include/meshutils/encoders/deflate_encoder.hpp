@@ -0,0 +1,471 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Deflate (RFC 1951) encoder producing zlib (RFC 1950) streams
+//
+// Matches are found with hash chains and written in dynamic huffman blocks,
+// or stored blocks when those are smaller. For multi-threaded encoding, the input
+// is split into chunks which do not refer to each other and the chunks are
+// joined with empty stored blocks, so any inflater can decode the result.
+
+#ifndef MESHUTILS_DEFLATE_ENCODER_INCLUDED
+#define MESHUTILS_DEFLATE_ENCODER_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <thread>
+
+#include <meshutils/parallel.hpp>
+
+namespace meshutils {
+
+class deflate_encoder {
+public:
+  // level 0 stores the data, 1 is fastest and 9 gives the smallest output.
+  deflate_encoder(int level = 6) : level_(std::max(0, std::min(level, 9))) {
+  }
+
+  int level() const { return level_; }
+
+  // Append a zlib stream containing size bytes of src to dest.
+  // Inputs of more than about a megabyte are split between num_threads threads (0 = one per core).
+  void encode(std::vector<uint8_t> &dest, const uint8_t *src, size_t size, unsigned num_threads = 1) const {
+    static const uint8_t flags[] = { 0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0x9c, 0xda, 0xda };
+    dest.push_back(0x78);
+    dest.push_back(flags[level_]);
+
+    if (num_threads == 0) num_threads = thread_pool::globalThreads();
+    const size_t min_chunk = 0x40000;
+    size_t num_chunks = num_threads <= 1 ? 1 : std::min((size_t)num_threads * 2, size / min_chunk + 1);
+
+    if (num_chunks == 1) {
+      encodeChunk(dest, src, size, true);
+    } else {
+      std::vector<std::vector<uint8_t>> chunks(num_chunks);
+      parallel_for(0, (int)num_chunks, [&](int c) {
+        size_t b = size * c / num_chunks, e = size * (c + 1) / num_chunks;
+        encodeChunk(chunks[c], src + b, e - b, c == (int)num_chunks - 1);
+      }, num_threads);
+      for (auto &c : chunks) {
+        dest.insert(dest.end(), c.begin(), c.end());
+      }
+    }
+
+    uint32_t adler = adler32(src, size);
+    for (int i = 24; i >= 0; i -= 8) {
+      dest.push_back((uint8_t)(adler >> i));
+    }
+  }
+
+  static uint32_t adler32(const uint8_t *src, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size) {
+      // 5552 is the largest n for which b can not overflow.
+      size_t n = std::min(size, (size_t)5552);
+      for (size_t i = 0; i != n; ++i) {
+        a += src[i];
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+      src += n;
+      size -= n;
+    }
+    return (b << 16) | a;
+  }
+
+private:
+  enum {
+    window_size = 0x8000,
+    window_mask = window_size - 1,
+    hash_bits = 15,
+    min_match = 3,
+    max_match = 258,
+    max_block_tokens = 0x10000,
+  };
+
+  // A literal if dist == 0, otherwise a match of length len.
+  struct token {
+    uint16_t len;
+    uint16_t dist;
+  };
+
+  class bit_writer {
+  public:
+    bit_writer(std::vector<uint8_t> &dest) : dest_(dest) {
+    }
+
+    // Write the low n bits of value, first bit first.
+    void put(uint32_t value, int n) {
+      bits_ |= (uint64_t)value << num_bits_;
+      num_bits_ += n;
+      while (num_bits_ >= 8) {
+        dest_.push_back((uint8_t)bits_);
+        bits_ >>= 8;
+        num_bits_ -= 8;
+      }
+    }
+
+    void align() {
+      if (num_bits_) put(0, 8 - num_bits_);
+    }
+
+    std::vector<uint8_t> &dest() { return dest_; }
+
+  private:
+    std::vector<uint8_t> &dest_;
+    uint64_t bits_ = 0;
+    int num_bits_ = 0;
+  };
+
+  // Compress one chunk as a sequence of complete blocks ending on a byte boundary.
+  void encodeChunk(std::vector<uint8_t> &dest, const uint8_t *src, size_t size, bool final) const {
+    bit_writer bw(dest);
+
+    if (level_ == 0 || size < min_match) {
+      writeStored(bw, src, size, final);
+    } else {
+      encodeMatches(bw, src, size, final);
+    }
+
+    if (!final) {
+      // an empty stored block aligns the output so that the next chunk can start a new block.
+      writeStored(bw, src, 0, false);
+    }
+  }
+
+  void encodeMatches(bit_writer &bw, const uint8_t *src, size_t size, bool final) const {
+    static const int max_chain[] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+    static const int nice_length[] = { 0, 8, 16, 32, 32, 64, 128, 128, 258, 258 };
+    int chain_limit = max_chain[level_];
+    int nice = nice_length[level_];
+    bool lazy = level_ >= 4;
+
+    std::vector<int> head((size_t)1 << hash_bits, -1);
+    std::vector<int> prev(window_size, -1);
+    std::vector<token> tokens;
+    tokens.reserve(max_block_tokens);
+
+    int n = (int)size;
+    auto hash = [src](int pos) {
+      uint32_t v = src[pos] | (src[pos+1] << 8) | (src[pos+2] << 16);
+      return (v * 2654435761u) >> (32 - hash_bits);
+    };
+
+    auto insert = [&](int pos) {
+      if (pos + min_match <= n) {
+        uint32_t h = hash(pos);
+        prev[pos & window_mask] = head[h];
+        head[h] = pos;
+      }
+    };
+
+    // longest earlier match for pos, returns 0 if there is none of at least min_match bytes.
+    auto find = [&](int pos, int &dist) {
+      int max_len = std::min(n - pos, (int)max_match);
+      if (max_len < min_match) return 0;
+      int best = min_match - 1;
+      int limit = pos - window_size;
+      int chain = chain_limit;
+      for (int cand = head[hash(pos)]; cand >= 0 && cand > limit && chain--; cand = prev[cand & window_mask]) {
+        if (src[cand + best] != src[pos + best] || src[cand] != src[pos]) continue;
+        int len = 1;
+        while (len < max_len && src[cand + len] == src[pos + len]) ++len;
+        if (len > best) {
+          best = len;
+          dist = pos - cand;
+          if (len >= nice || len == max_len) break;
+        }
+      }
+      return best >= min_match ? best : 0;
+    };
+
+    int block_start = 0;
+    auto flushBlock = [&](int pos, bool last) {
+      writeBlock(bw, tokens, src + block_start, (size_t)(pos - block_start), last);
+      tokens.clear();
+      block_start = pos;
+    };
+
+    int len = 0, dist = 0;
+    bool have_match = false;
+    for (int i = 0; i < n; ) {
+      if (!have_match) len = find(i, dist);
+      have_match = false;
+      insert(i);
+
+      if (len && lazy && len < nice && i + 1 < n) {
+        // a longer match at the next byte is better than this one.
+        int dist2 = 0;
+        int len2 = find(i + 1, dist2);
+        if (len2 > len) {
+          tokens.push_back(token{ src[i], 0 });
+          ++i;
+          len = len2;
+          dist = dist2;
+          have_match = true;
+          if (tokens.size() >= max_block_tokens) flushBlock(i, false);
+          continue;
+        }
+      }
+
+      if (len) {
+        tokens.push_back(token{ (uint16_t)len, (uint16_t)dist });
+        for (int k = 1; k != len; ++k) insert(i + k);
+        i += len;
+      } else {
+        tokens.push_back(token{ src[i], 0 });
+        ++i;
+      }
+      if (tokens.size() >= max_block_tokens && i < n) flushBlock(i, false);
+    }
+    flushBlock(n, final);
+  }
+
+  static void writeStored(bit_writer &bw, const uint8_t *src, size_t size, bool final) {
+    do {
+      size_t n = std::min(size, (size_t)0xffff);
+      bool last = final && n == size;
+      bw.put(last ? 1 : 0, 1);
+      bw.put(0, 2);
+      bw.align();
+      bw.put((uint32_t)n, 16);
+      bw.put((uint32_t)n ^ 0xffff, 16);
+      bw.dest().insert(bw.dest().end(), src, src + n);
+      src += n;
+      size -= n;
+    } while (size);
+  }
+
+  static int lengthCode(int len) {
+    return (int)(std::upper_bound(lengthBase(), lengthBase() + 29, len) - lengthBase()) - 1;
+  }
+
+  static int distCode(int dist) {
+    return (int)(std::upper_bound(distBase(), distBase() + 30, dist) - distBase()) - 1;
+  }
+
+  static const uint16_t *lengthBase() {
+    static const uint16_t base[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+    return base;
+  }
+
+  static const uint8_t *lengthExtra() {
+    static const uint8_t extra[] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+    return extra;
+  }
+
+  static const uint16_t *distBase() {
+    static const uint16_t base[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+    return base;
+  }
+
+  static const uint8_t *distExtra() {
+    static const uint8_t extra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+    return extra;
+  }
+
+  // Huffman code lengths of at most limit bits for n symbols.
+  // Frequencies are halved until the tree is shallow enough.
+  static void buildLengths(const uint32_t *freq, int n, int limit, uint8_t *lengths) {
+    std::vector<uint32_t> f(freq, freq + n);
+    std::fill(lengths, lengths + n, 0);
+    for (;;) {
+      struct item {
+        uint32_t weight;
+        int id;
+        bool operator<(const item &rhs) const { return weight != rhs.weight ? weight > rhs.weight : id > rhs.id; }
+      };
+      std::priority_queue<item> queue;
+      std::vector<int> parent;
+      std::vector<int> symbol;
+      for (int i = 0; i != n; ++i) {
+        if (f[i]) {
+          queue.push(item{ f[i], (int)parent.size() });
+          parent.push_back(-1);
+          symbol.push_back(i);
+        }
+      }
+      if (parent.empty()) return;
+      if (parent.size() == 1) {
+        lengths[symbol[0]] = 1;
+        return;
+      }
+
+      size_t num_leaves = parent.size();
+      while (queue.size() > 1) {
+        item a = queue.top(); queue.pop();
+        item b = queue.top(); queue.pop();
+        int id = (int)parent.size();
+        parent.push_back(-1);
+        parent[a.id] = id;
+        parent[b.id] = id;
+        queue.push(item{ a.weight + b.weight, id });
+      }
+
+      // parents are always after their children.
+      std::vector<int> depth(parent.size(), 0);
+      int max_depth = 0;
+      for (int i = (int)parent.size() - 2; i >= 0; --i) {
+        depth[i] = depth[parent[i]] + 1;
+        max_depth = std::max(max_depth, depth[i]);
+      }
+
+      if (max_depth <= limit) {
+        for (size_t i = 0; i != num_leaves; ++i) {
+          lengths[symbol[i]] = (uint8_t)depth[i];
+        }
+        return;
+      }
+
+      for (auto &x : f) {
+        if (x) x = (x + 1) >> 1;
+      }
+    }
+  }
+
+  // Canonical codes with the bits reversed for writing first bit first.
+  static void buildCodes(const uint8_t *lengths, int n, uint16_t *codes) {
+    int count[16] = {};
+    for (int i = 0; i != n; ++i) count[lengths[i]]++;
+    count[0] = 0;
+    int next[16] = {};
+    for (int bits = 1, code = 0; bits != 16; ++bits) {
+      code = (code + count[bits-1]) << 1;
+      next[bits] = code;
+    }
+    for (int i = 0; i != n; ++i) {
+      int len = lengths[i];
+      if (!len) continue;
+      uint32_t code = next[len]++;
+      uint32_t rev = 0;
+      for (int b = 0; b != len; ++b) {
+        rev = (rev << 1) | ((code >> b) & 1);
+      }
+      codes[i] = (uint16_t)rev;
+    }
+  }
+
+  void writeBlock(bit_writer &bw, const std::vector<token> &tokens, const uint8_t *raw, size_t raw_size, bool final) const {
+    const uint8_t *len_extra = lengthExtra();
+    const uint8_t *dist_extra = distExtra();
+
+    uint32_t lit_freq[286] = {};
+    uint32_t dist_freq[30] = {};
+    for (auto &t : tokens) {
+      if (t.dist) {
+        lit_freq[257 + lengthCode(t.len)]++;
+        dist_freq[distCode(t.dist)]++;
+      } else {
+        lit_freq[t.len]++;
+      }
+    }
+    lit_freq[256] = 1;
+    // some inflaters reject codes with a single symbol.
+    if (std::count_if(lit_freq, lit_freq + 286, [](uint32_t x) { return x != 0; }) < 2) lit_freq[0]++;
+    for (int i = 0; std::count_if(dist_freq, dist_freq + 30, [](uint32_t x) { return x != 0; }) < 2; ++i) {
+      if (!dist_freq[i]) dist_freq[i] = 1;
+    }
+
+    uint8_t lit_len[286];
+    uint8_t dist_len[30];
+    buildLengths(lit_freq, 286, 15, lit_len);
+    buildLengths(dist_freq, 30, 15, dist_len);
+
+    int hlit = 286;
+    while (hlit > 257 && !lit_len[hlit-1]) --hlit;
+    int hdist = 30;
+    while (hdist > 1 && !dist_len[hdist-1]) --hdist;
+
+    // run length encode the code lengths with symbols 16 (repeat previous), 17 and 18 (zeros).
+    std::vector<uint8_t> all(lit_len, lit_len + hlit);
+    all.insert(all.end(), dist_len, dist_len + hdist);
+    std::vector<std::pair<uint8_t, uint8_t>> cl_symbols;
+    uint32_t cl_freq[19] = {};
+    for (size_t i = 0; i != all.size(); ) {
+      uint8_t v = all[i];
+      size_t run = 1;
+      while (i + run != all.size() && all[i + run] == v) ++run;
+      size_t left = run;
+      if (v == 0) {
+        while (left >= 11) { size_t r = std::min(left, (size_t)138); cl_symbols.emplace_back(18, (uint8_t)(r - 11)); left -= r; }
+        if (left >= 3) { cl_symbols.emplace_back(17, (uint8_t)(left - 3)); left = 0; }
+      } else {
+        cl_symbols.emplace_back(v, 0);
+        --left;
+        while (left >= 3) { size_t r = std::min(left, (size_t)6); cl_symbols.emplace_back(16, (uint8_t)(r - 3)); left -= r; }
+      }
+      while (left--) cl_symbols.emplace_back(v, 0);
+      i += run;
+    }
+    for (auto &s : cl_symbols) cl_freq[s.first]++;
+
+    uint8_t cl_len[19];
+    buildLengths(cl_freq, 19, 7, cl_len);
+    static const uint8_t cl_order[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    int hclen = 19;
+    while (hclen > 4 && !cl_len[cl_order[hclen-1]]) --hclen;
+
+    // choose stored blocks if they are smaller.
+    size_t bits = 3 + 14 + hclen * 3;
+    static const int cl_extra[] = { 2, 3, 7 };
+    for (auto &s : cl_symbols) bits += cl_len[s.first] + (s.first >= 16 ? cl_extra[s.first - 16] : 0);
+    for (int i = 0; i != 286; ++i) {
+      bits += (size_t)lit_freq[i] * lit_len[i];
+      if (i >= 257) bits += (size_t)lit_freq[i] * len_extra[i - 257];
+    }
+    for (int i = 0; i != 30; ++i) bits += (size_t)dist_freq[i] * (dist_len[i] + dist_extra[i]);
+    size_t stored_bits = (raw_size + (raw_size / 0xffff + 1) * 5) * 8 + 7;
+    if (stored_bits <= bits) {
+      writeStored(bw, raw, raw_size, final);
+      return;
+    }
+
+    uint16_t lit_code[286] = {};
+    uint16_t dist_code[30] = {};
+    uint16_t cl_code[19] = {};
+    buildCodes(lit_len, 286, lit_code);
+    buildCodes(dist_len, 30, dist_code);
+    buildCodes(cl_len, 19, cl_code);
+
+    bw.put(final ? 1 : 0, 1);
+    bw.put(2, 2);
+    bw.put(hlit - 257, 5);
+    bw.put(hdist - 1, 5);
+    bw.put(hclen - 4, 4);
+    for (int i = 0; i != hclen; ++i) {
+      bw.put(cl_len[cl_order[i]], 3);
+    }
+    for (auto &s : cl_symbols) {
+      bw.put(cl_code[s.first], cl_len[s.first]);
+      if (s.first >= 16) bw.put(s.second, cl_extra[s.first - 16]);
+    }
+
+    const uint16_t *len_base = lengthBase();
+    const uint16_t *dist_base = distBase();
+    for (auto &t : tokens) {
+      if (t.dist) {
+        int lc = lengthCode(t.len);
+        bw.put(lit_code[257 + lc], lit_len[257 + lc]);
+        bw.put(t.len - len_base[lc], len_extra[lc]);
+        int dc = distCode(t.dist);
+        bw.put(dist_code[dc], dist_len[dc]);
+        bw.put(t.dist - dist_base[dc], dist_extra[dc]);
+      } else {
+        bw.put(lit_code[t.len], lit_len[t.len]);
+      }
+    }
+    bw.put(lit_code[256], lit_len[256]);
+    if (final) bw.align();
+  }
+
+  int level_;
+};
+
+} // meshutils
+
+#endif
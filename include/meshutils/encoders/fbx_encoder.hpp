@@ -14,46 +14,25 @@
 #include <vector>
 #include <exception>
 #include <cstring>
+#include <algorithm>
+#include <unordered_map>
 
 #include <glm/glm.hpp>
 #include <meshutils/mesh.hpp>
 #include <meshutils/scene.hpp>
+#include <meshutils/weld.hpp>
+#include <meshutils/byte_sink.hpp>
+#include <meshutils/encoders/deflate_encoder.hpp>
+#include <meshutils/stats.hpp>
 
 // see https://code.blender.org/2013/08/fbx-binary-file-format-specification/
 // and https://banexdevblog.wordpress.com/2014/06/23/a-quick-tutorial-about-the-fbx-ascii-format/
 
 namespace meshutils {
+  // Sort based welding, values_out is in memcmp order. See weld.hpp.
   template<class ValueType, class IdxType>
   void make_index(std::vector<ValueType> &values_out, std::vector<IdxType> &idx_out, const std::vector<ValueType> &values_in) {
-    struct evec_t {
-      ValueType v;
-      size_t orginal_idx;
-    };
-
-    std::vector<evec_t> evec(values_in.size());
-    for (size_t i = 0; i != values_in.size(); ++i) {
-      evec[i] = evec_t{ values_in[i], i };
-    }
-
-    std::sort(
-      evec.begin(), evec.end(),
-      [](evec_t &a, evec_t &b) { return memcmp(&a.v, &b.v, sizeof(a.v)) < 0; }
-    );
-
-    values_out.resize(0);
-    idx_out.resize(evec.size());
-    size_t index = 0;
-    for (size_t i = 0; i != evec.size();) {
-      evec_t &e = evec[i];
-      size_t new_idx = values_out.size();
-      values_out.push_back(e.v);
-      idx_out[e.orginal_idx] = (IdxType)new_idx;
-      ++i;
-      while (i != evec.size() && !memcmp(&evec[i].v, &e.v, sizeof(e.v))) {
-        idx_out[evec[i].orginal_idx] = (IdxType)new_idx;
-        ++i;
-      }
-    }
+    weld_sorted(values_out, idx_out, values_in);
   }
 
   class fbx_encoder {
@@ -61,6 +40,25 @@ namespace meshutils {
     fbx_encoder() {
     }
 
+    // Deflate array properties of at least min_bytes bytes, as Blender and Maya do.
+    // level 0 turns compression off. Large arrays are compressed on num_threads threads (0 = one per core).
+    void setCompression(int level, size_t min_bytes = 128, unsigned num_threads = 0) {
+      compression_level_ = level;
+      compression_min_bytes_ = min_bytes;
+      compression_threads_ = num_threads;
+    }
+
+    // Also share one Geometry between meshes with the same contents, not just
+    // between nodes that use the same mesh object. Costs a pass over every mesh.
+    void setContentHashing(bool enable) {
+      content_hashing_ = enable;
+    }
+
+    // Report phase timings and counters to stats, or nothing if it is null. See stats.hpp.
+    void setStats(stats_sink *stats) {
+      stats_ = stats;
+    }
+
     std::vector<uint8_t> saveMesh(meshutils::mesh &mesh) {
       meshutils::scene scene;
       scene.addMesh(&mesh);
@@ -68,19 +66,59 @@ namespace meshutils {
       return std::move(saveScene(scene));
     }
 
+    // Write a mesh to a sink, see saveScene().
+    bool saveMesh(meshutils::mesh &mesh, byte_sink &sink, size_t chunk_size = 0x100000) {
+      meshutils::scene scene;
+      scene.addMesh(&mesh);
+      scene.addNode(glm::mat4(), 0, 0);
+      return saveScene(scene, sink, chunk_size);
+    }
+
     std::vector<uint8_t> saveScene(const meshutils::scene &scene) {
-      //const std::vector<const mesh*> &meshes, const std::vector<glm::mat4> &transforms, const std::vector<int> &parent_transforms, const std::vector<int> &mesh_indices) {
+      sink_ = nullptr;
+      flushed_ = 0;
       bytes_.resize(0);
+      bytes_.reserve(0x10000);
+      {
+        scoped_phase phase(stats_, "fbx_encoder.saveScene");
+        writeScene(scene);
+        stats_count(stats_, "fbx_encoder.bytes", tell());
+      }
+      return std::move(bytes_);
+    }
 
+    // Write a scene to a sink such as a file_sink. Bytes are passed to the sink
+    // about chunk_size at a time and node headers are patched through the sink,
+    // so the file is never held in memory. Returns false if the sink failed.
+    bool saveScene(const meshutils::scene &scene, byte_sink &sink, size_t chunk_size = 0x100000) {
+      sink_ = &sink;
+      sink_base_ = sink.size();
+      chunk_size_ = chunk_size;
+      flushed_ = 0;
+      bytes_.resize(0);
+      bytes_.reserve(chunk_size + 0x1000);
+      {
+        scoped_phase phase(stats_, "fbx_encoder.saveScene");
+        writeScene(scene);
+        stats_count(stats_, "fbx_encoder.bytes", tell());
+        flush();
+      }
+      sink_ = nullptr;
+      bytes_ = std::vector<uint8_t>();
+      return sink.good();
+    }
+  public:
+
+    void writeScene(const meshutils::scene &scene) {
+      //const std::vector<const mesh*> &meshes, const std::vector<glm::mat4> &transforms, const std::vector<int> &parent_transforms, const std::vector<int> &mesh_indices) {
       int version = 0x1ce8;
 
       static const uint8_t fbx_header[] = {
         0x4b, 0x61, 0x79, 0x64, 0x61, 0x72, 0x61, 0x20, 0x46, 0x42, 0x58, 0x20,
         0x42, 0x69, 0x6e, 0x61, 0x72, 0x79, 0x20, 0x20, 0x00, 0x1a, 0x00, 
       };
-      bytes_.reserve(0x10000);
 
-      bytes_.assign(fbx_header, fbx_header + sizeof(fbx_header));
+      raw(fbx_header, sizeof(fbx_header));
       u4(version);
 
       writeFBXHeaderExtension();
@@ -103,13 +141,18 @@ namespace meshutils {
       begin("References");
       end("References");
 
-      writeDefinitions();
+      // one Geometry per distinct mesh, shared by all the Models that use it.
+      auto &meshes = scene.meshes();
+      auto &transforms = scene.transforms();
+      std::vector<size_t> geometry_of;
+      std::vector<const mesh *> geometries;
+      findGeometries(scene, geometry_of, geometries);
+
+      writeDefinitions(geometries.size(), transforms.size());
 
       begin("Objects");
-        auto &meshes = scene.meshes();
-        auto &transforms = scene.transforms();
-        for (size_t i = 0; i != meshes.size(); ++i) {
-          writeGeometry(*meshes[i], i);
+        for (size_t i = 0; i != geometries.size(); ++i) {
+          writeGeometry(*geometries[i], i);
         }
 
         for (size_t i = 0; i != transforms.size(); ++i) {
@@ -120,22 +163,25 @@ namespace meshutils {
         //writeMaterial(0);
       end("Objects");
 
-      size_t model_index = 0;
-      size_t mesh_index = 0;
-      size_t material_index = 0;
       begin("Connections");
-        // root node
-        begin("C");
-          S("OO");
-          L(0x20000000 + model_index);
-          L(0);
-        end("C");
-
-        begin("C");
-          S("OO");
-          L(0x10000000 + mesh_index);
-          L(0x20000000 + model_index);
-        end("C");
+        for (size_t i = 0; i != transforms.size(); ++i) {
+          // Model -> parent Model, or the root node 0.
+          int parent = scene.parent((int)i);
+          begin("C");
+            S("OO");
+            L(0x20000000 + i);
+            L(parent < 0 ? 0 : 0x20000000 + (size_t)parent);
+          end("C");
+
+          int mesh_index = scene.mesh_indices()[i];
+          if (mesh_index >= 0 && mesh_index < (int)meshes.size()) {
+            begin("C");
+              S("OO");
+              L(0x10000000 + geometry_of[mesh_index]);
+              L(0x20000000 + i);
+            end("C");
+          }
+        }
 
         /*begin("C");
           S("OO");
@@ -154,20 +200,18 @@ namespace meshutils {
 
       // like the header, this footer seems to server no function other than to infuriate codec writers.
       static const uint8_t foot_id[] = { 0xfa,0xbc,0xab,0x09,0xd0,0xc8,0xd4,0x66,0xb1,0x76,0xfb,0x83,0x1c,0xf7,0x26,0x7e,0x00,0x00,0x00,0x00 };
-      for (size_t i = 0; i != sizeof(foot_id); ++i) bytes_.push_back(foot_id[i]);
+      raw(foot_id, sizeof(foot_id));
 
-      //int pad = ((bytes_.size() + 15) & ~15) - bytes_.size();
-      //if (pad == 0) pad = 16;
-      while (bytes_.size() & 0x0f) bytes_.push_back(0x00);
+      //int pad = ((tell() + 15) & ~15) - tell();
+      //if (pad == 0) pad = 16;
+      while (tell() & 0x0f) u1(0x00);
 
       u4(version);
-      for (int i = 0; i != 120; ++i) bytes_.push_back(0x00);
+      for (int i = 0; i != 120; ++i) u1(0x00);
 
       // another seemingly pointless binary string
       static const uint8_t unknown_id[] = { 0xf8,0x5a,0x8c,0x6a,0xde,0xf5,0xd9,0x7e,0xec,0xe9,0x0c,0xe3,0x75,0x8f,0x29,0x0b };
-      for (size_t i = 0; i != sizeof(unknown_id); ++i) bytes_.push_back(unknown_id[i]);
-
-      return std::move(bytes_);
+      raw(unknown_id, sizeof(unknown_id));
     }
   public:
 
@@ -493,7 +537,7 @@ namespace meshutils {
       end("Documents");
     }
 
-    void writeDefinitions() {
+    void writeDefinitions(size_t num_geometries, size_t num_models) {
       begin("Definitions");
         begin("Version");
           I(100);
@@ -510,7 +554,7 @@ namespace meshutils {
         begin("ObjectType");
           S("Geometry");
           begin("Count");
-            I(1);
+            I((int)num_geometries);
           end("Count");
           begin("PropertyTemplate");
             S("FbxMesh");
@@ -569,7 +613,7 @@ namespace meshutils {
         begin("ObjectType");
           S("Model");
           begin("Count");
-            I(1);
+            I((int)num_models);
           end("Count");
           begin("PropertyTemplate");
             S("FbxNode");
@@ -1311,14 +1355,15 @@ namespace meshutils {
     }
 
     void writeGeometry(const mesh &mesh, size_t index) {
-      std::vector<uint32_t> indices = mesh.indices32();
-      std::vector<glm::vec3> pos = mesh.pos();
-      std::vector<glm::vec3> normal = mesh.normal();
-      std::vector<glm::vec4> color = mesh.color();
+      // read the mesh in place, only the welded values are copied.
+      attribute_view indices = mesh.indexView();
+      attribute_view pos = mesh.posView();
+      attribute_view normal = mesh.normalView();
+      attribute_view color = mesh.colorView();
 
-      for (auto &p : color) {
-        printf("%f %f %f %f\n", p.x, p.y, p.z, p.w);
-      }
+      scoped_phase phase(stats_, "fbx_encoder.writeGeometry");
+      stats_count(stats_, "fbx_encoder.vertices", pos.count);
+      stats_count(stats_, "fbx_encoder.indices", indices.count);
 
       std::vector<glm::vec3> epos;
       //std::vector<glm::vec3> enormal;
@@ -1327,13 +1372,12 @@ namespace meshutils {
       //std::vector<glm::uint32_t> inormal;
       std::vector<glm::uint32_t> icolor;
 
-      make_index(epos, ipos, pos);
-      //make_index(epos, ipos, pos);
-      make_index(ecolor, icolor, color);
+      weld(epos, ipos, pos.ptr<glm::vec3>(), pos.stride, pos.count);
+      weld(ecolor, icolor, color.ptr<glm::vec4>(), color.stride, color.count);
+      stats_count(stats_, "fbx_encoder.allocations", 4);
 
       glm::vec4 white(1, 1, 1, 1);
       bool has_color = ecolor.size() != 1 || ecolor[0] != white;
-      printf("has_color=%d\n", has_color);
 
       begin("Geometry");
         L(index + 0x10000000);
@@ -1345,30 +1389,14 @@ namespace meshutils {
           I(124);
         end("GeometryVersion");
         begin("Vertices");
-          std::vector<double> dpos;
-          dpos.reserve(epos.size() * 3);
-          for (auto &p : epos) {
-            dpos.push_back((double)p.x);
-            dpos.push_back((double)p.y);
-            dpos.push_back((double)p.z);
-          }
-          d(dpos.data(), dpos.size());
+          d(epos.size() * 3, [&](size_t k) { return epos[k / 3][k % 3]; });
         end("Vertices");
         begin("PolygonVertexIndex");
-          std::vector<uint32_t> pvi;
-          for (size_t i = 0; i < ipos.size(); i += 3) {
-            pvi.push_back(ipos[i+0]);
-            pvi.push_back(ipos[i+1]);
-            pvi.push_back(~ipos[i+2]);
-          }
-          i(pvi.data(), pvi.size());
+          // the last vertex of each triangle is complemented.
+          i(indices.size(), [&](size_t k) { uint32_t v = ipos[indices.u32(k)]; return k % 3 == 2 ? ~v : v; });
         end("PolygonVertexIndex");
         begin("Edges");
-          std::vector<uint32_t> edges;
-          for (size_t i = 0; i < indices.size(); i += 3) {
-            edges.push_back(i);
-          }
-          i(edges.data(), edges.size());
+          i((indices.size() + 2) / 3, [](size_t k) { return (uint32_t)(k * 3); });
         end("Edges");
         begin("LayerElementNormal");
           I(0);
@@ -1385,13 +1413,7 @@ namespace meshutils {
             S("Direct");
           end("ReferenceInformationType");
           begin("Normals");
-            std::vector<double> dnormal;
-            for (auto &p : mesh.normal()) {
-              dnormal.push_back((double)p.x);
-              dnormal.push_back((double)p.y);
-              dnormal.push_back((double)p.z);
-            }
-            d(dnormal.data(), dnormal.size());
+            d(indices.size() * 3, [&](size_t k) { return normal.get<glm::vec3>(indices.u32(k / 3))[k % 3]; });
           end("Normals");
         end("LayerElementNormal");
         /*begin("LayerElementMaterial");
@@ -1429,18 +1451,10 @@ namespace meshutils {
               S("IndexToDirect");
             end("ReferenceInformationType");
             begin("Colors");
-              std::vector<double> dcolor;
-              dcolor.reserve(ecolor.size() * 4);
-              for (auto &p : ecolor) {
-                dcolor.push_back((double)p.x);
-                dcolor.push_back((double)p.y);
-                dcolor.push_back((double)p.z);
-                dcolor.push_back((double)p.w);
-              }
-              d(dcolor.data(), dcolor.size());
+              d(ecolor.size() * 4, [&](size_t k) { return ecolor[k / 4][k % 4]; });
             end("Colors");
             begin("ColorIndex");
-              i(icolor.data(), icolor.size());
+              i(indices.size(), [&](size_t k) { return icolor[indices.u32(k)]; });
             end("ColorIndex");
           end("LayerElementColor");
         }
@@ -1653,6 +1667,86 @@ namespace meshutils {
       end("Material");
     }
 
+    // geometry_of[m] is the Geometry written for scene mesh m, geometries are the distinct meshes.
+    // Meshes are the same if they are the same object or, with content hashing,
+    // if all their attributes and indices are equal.
+    void findGeometries(const meshutils::scene &scene, std::vector<size_t> &geometry_of, std::vector<const mesh *> &geometries) const {
+      auto &meshes = scene.meshes();
+      std::unordered_map<const mesh *, size_t> by_pointer;
+      std::unordered_multimap<uint64_t, size_t> by_hash;
+      geometry_of.resize(meshes.size());
+      geometries.clear();
+      for (size_t i = 0; i != meshes.size(); ++i) {
+        auto p = by_pointer.find(meshes[i]);
+        if (p != by_pointer.end()) {
+          geometry_of[i] = p->second;
+          continue;
+        }
+
+        size_t geometry = geometries.size();
+        if (content_hashing_) {
+          uint64_t hash = hashMesh(*meshes[i]);
+          auto range = by_hash.equal_range(hash);
+          for (auto h = range.first; h != range.second; ++h) {
+            if (sameMesh(*geometries[h->second], *meshes[i])) {
+              geometry = h->second;
+              break;
+            }
+          }
+          if (geometry == geometries.size()) by_hash.emplace(hash, geometry);
+        }
+
+        if (geometry == geometries.size()) geometries.push_back(meshes[i]);
+        by_pointer.emplace(meshes[i], geometry);
+        geometry_of[i] = geometry;
+      }
+    }
+
+    static std::vector<attribute_view> meshViews(const mesh &m) {
+      return std::vector<attribute_view>{ m.posView(), m.normalView(), m.uvView(0), m.colorView() };
+    }
+
+    // FNV-1a of the attribute values and index values.
+    static uint64_t hashMesh(const mesh &m) {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      auto mix = [&hash](uint32_t word) {
+        hash = (hash ^ word) * 0x100000001b3ull;
+      };
+      for (const attribute_view &v : meshViews(m)) {
+        size_t size = v.components * attribute_type_size(v.type);
+        mix((uint32_t)v.count);
+        for (size_t i = 0; i != v.count; ++i) {
+          const uint8_t *p = v.data + i * v.stride;
+          for (size_t j = 0; j < size; j += 4) {
+            uint32_t word = 0;
+            memcpy(&word, p + j, std::min(size - j, (size_t)4));
+            mix(word);
+          }
+        }
+      }
+      attribute_view indices = m.indexView();
+      mix((uint32_t)indices.count);
+      for (size_t i = 0; i != indices.count; ++i) mix(indices.u32(i));
+      return hash;
+    }
+
+    static bool sameMesh(const mesh &a, const mesh &b) {
+      std::vector<attribute_view> va = meshViews(a), vb = meshViews(b);
+      for (size_t k = 0; k != va.size(); ++k) {
+        if (va[k].count != vb[k].count || va[k].components != vb[k].components || va[k].type != vb[k].type) return false;
+        size_t size = va[k].components * attribute_type_size(va[k].type);
+        for (size_t i = 0; i != va[k].count; ++i) {
+          if (memcmp(va[k].data + i * va[k].stride, vb[k].data + i * vb[k].stride, size)) return false;
+        }
+      }
+      attribute_view ia = a.indexView(), ib = b.indexView();
+      if (ia.count != ib.count) return false;
+      for (size_t i = 0; i != ia.count; ++i) {
+        if (ia.u32(i) != ib.u32(i)) return false;
+      }
+      return true;
+    }
+
     struct node {
       size_t offset;
       uint32_t num_properties;
@@ -1661,9 +1755,48 @@ namespace meshutils {
       const char *name;
     };
 
+    // bytes not yet passed to sink_, or the whole file if there is no sink.
     std::vector<uint8_t> bytes_;
     std::vector<node> nodes;
     bool just_ended = false;
+    byte_sink *sink_ = nullptr;
+    size_t sink_base_ = 0;
+    size_t chunk_size_ = 0x100000;
+    size_t flushed_ = 0;
+
+    // offset from the start of the file.
+    size_t tell() const {
+      return flushed_ + bytes_.size();
+    }
+
+    void flush() {
+      if (sink_ && !bytes_.empty()) {
+        sink_->write(bytes_.data(), bytes_.size());
+        flushed_ += bytes_.size();
+        bytes_.resize(0);
+      }
+    }
+
+    // FBX is little endian, as are all the platforms we build for, so arrays are copied as they are.
+    void raw(const void *data, size_t size) {
+      const uint8_t *p = (const uint8_t *)data;
+      if (sink_ && bytes_.size() + size > chunk_size_) {
+        flush();
+        if (size >= chunk_size_) {
+          sink_->write(p, size);
+          flushed_ += size;
+          return;
+        }
+      }
+      bytes_.insert(bytes_.end(), p, p + size);
+    }
+
+    // overwrite bytes which have been written, some of which may have gone to the sink.
+    void patch(size_t offset, const uint8_t *data, size_t size) {
+      size_t n = offset < flushed_ ? std::min(size, flushed_ - offset) : 0;
+      if (n) sink_->patch(sink_base_ + offset, data, n);
+      if (n != size) memcpy(bytes_.data() + (offset + n - flushed_), data + n, size - n);
+    }
 
     void u1(int value) {
       bytes_.push_back((uint8_t)value);
@@ -1686,10 +1819,11 @@ namespace meshutils {
 
     void begin(const char *name) {
       just_ended = false;
-      //printf("begin %x %s\n", (unsigned)bytes_.size(), name);
+      //printf("begin %x %s\n", (unsigned)tell(), name);
+      if (sink_ && bytes_.size() >= chunk_size_) flush();
 
       node n = {};
-      n.offset = bytes_.size();
+      n.offset = tell();
       n.name = name;
 
       u4(0);
@@ -1698,33 +1832,26 @@ namespace meshutils {
       u1((int)strlen(name));
       while (*name) u1(*name++);
 
-      n.property_list_start = bytes_.size();
+      n.property_list_start = tell();
       nodes.push_back(n);
     }
 
     void nullnode() {
-      for (int i = 0; i != 13; ++i) bytes_.push_back(0);
+      for (int i = 0; i != 13; ++i) u1(0);
     }
 
     void end(const char *name) {
       node &n = nodes.back();
-      if (just_ended || n.property_list_start == bytes_.size()) {
+      if (just_ended || n.property_list_start == tell()) {
         nullnode();
       }
-      uint32_t offset = (uint32_t)n.offset;
-      uint32_t end_offset = (uint32_t)bytes_.size();
-      bytes_[offset+0] = (uint8_t)(end_offset >> 0);
-      bytes_[offset+1] = (uint8_t)(end_offset >> 8);
-      bytes_[offset+2] = (uint8_t)(end_offset >> 16);
-      bytes_[offset+3] = (uint8_t)(end_offset >> 24);
-      bytes_[offset+4] = (uint8_t)(n.num_properties >> 0);
-      bytes_[offset+5] = (uint8_t)(n.num_properties >> 8);
-      bytes_[offset+6] = (uint8_t)(n.num_properties >> 16);
-      bytes_[offset+7] = (uint8_t)(n.num_properties >> 24);
-      bytes_[offset+8] = (uint8_t)(n.property_list_len >> 0);
-      bytes_[offset+9] = (uint8_t)(n.property_list_len >> 8);
-      bytes_[offset+10] = (uint8_t)(n.property_list_len >> 16);
-      bytes_[offset+11] = (uint8_t)(n.property_list_len >> 24);
+      uint32_t end_offset = (uint32_t)tell();
+      uint32_t values[3] = { end_offset, n.num_properties, (uint32_t)n.property_list_len };
+      uint8_t header[12];
+      for (int i = 0; i != 12; ++i) {
+        header[i] = (uint8_t)(values[i/4] >> ((i % 4) * 8));
+      }
+      patch(n.offset, header, sizeof(header));
 
       if (strcmp(name, n.name)) {
         throw std::runtime_error("non-matching end");
@@ -1742,7 +1869,7 @@ namespace meshutils {
 
     void propend() {
       node &node = nodes.back();
-      node.property_list_len = bytes_.size() - node.property_list_start;
+      node.property_list_len = tell() - node.property_list_start;
     }
 
     void Y(int value) {
@@ -1785,63 +1912,98 @@ namespace meshutils {
       propend();
     }
 
-    void f(const float *value, size_t size) {
-      prop('f');
+    int compression_level_ = 0;
+    size_t compression_min_bytes_ = 128;
+    unsigned compression_threads_ = 0;
+    bool content_hashing_ = false;
+    stats_sink *stats_ = nullptr;
+
+    bool compressed(size_t bytes) const {
+      return compression_level_ > 0 && bytes >= compression_min_bytes_;
+    }
+
+    // array of size elements of type T.
+    template <class T>
+    void array(char code, const T *value, size_t size) {
+      prop(code);
       u4((int)size);
-      u4(0);
-      u4((int)size * 4);
-      union { float f; int v; } u;
-      while (size--) {
-        u.f = *value++;
-        u4(u.v);
+      if (compressed(size * sizeof(T))) {
+        std::vector<uint8_t> deflated;
+        {
+          scoped_phase phase(stats_, "fbx_encoder.deflate");
+          deflate_encoder(compression_level_).encode(deflated, (const uint8_t *)value, size * sizeof(T), compression_threads_);
+        }
+        stats_count(stats_, "fbx_encoder.allocations", 1);
+        stats_count(stats_, "fbx_encoder.deflate_in", size * sizeof(T));
+        stats_count(stats_, "fbx_encoder.deflate_out", deflated.size());
+        u4(1);
+        u4((int)deflated.size());
+        raw(deflated.data(), deflated.size());
+      } else {
+        u4(0);
+        u4((int)(size * sizeof(T)));
+        raw(value, size * sizeof(T));
       }
       propend();
     }
 
-    void d(const double *value, size_t size) {
-      prop('d');
+    // array of size elements of type T where element k is fn(k).
+    // Uncompressed elements are generated into a small buffer so there is no copy of the whole array.
+    template <class T, class F>
+    void array(char code, size_t size, F fn) {
+      if (compressed(size * sizeof(T))) {
+        stats_count(stats_, "fbx_encoder.allocations", 1);
+        std::vector<T> values(size);
+        for (size_t k = 0; k != size; ++k) {
+          values[k] = (T)fn(k);
+        }
+        array(code, values.data(), size);
+        return;
+      }
+
+      prop(code);
       u4((int)size);
       u4(0);
-      u4((int)size * 8);
-      union { double f; uint64_t v; } u;
-      while (size--) {
-        u.f = *value++;
-        u8(u.v);
+      u4((int)(size * sizeof(T)));
+      T buf[1024];
+      for (size_t b = 0; b < size; b += 1024) {
+        size_t n = std::min(size - b, (size_t)1024);
+        for (size_t k = 0; k != n; ++k) {
+          buf[k] = (T)fn(b + k);
+        }
+        raw(buf, n * sizeof(T));
       }
       propend();
     }
 
+    void f(const float *value, size_t size) {
+      array('f', value, size);
+    }
+
+    void d(const double *value, size_t size) {
+      array('d', value, size);
+    }
+
+    template <class F>
+    void d(size_t size, F fn) {
+      array<double>('d', size, fn);
+    }
+
     void l(const uint64_t *value, size_t size) {
-      prop('l');
-      u4((int)size);
-      u4(0);
-      u4((int)size * 8);
-      while (size--) {
-        u8(*value++);
-      }
-      propend();
+      array('l', value, size);
     }
 
     void i(const uint32_t *value, size_t size) {
-      prop('i');
-      u4((int)size);
-      u4(0);
-      u4((int)size * 4);
-      while (size--) {
-        u4(*value++);
-      }
-      propend();
+      array('i', value, size);
+    }
+
+    template <class F>
+    void i(size_t size, F fn) {
+      array<uint32_t>('i', size, fn);
     }
 
     void b(const int *value, size_t size) {
-      prop('b');
-      u4((int)size);
-      u4(0);
-      u4((int)size * 4);
-      while (size--) {
-        u4(*value++);
-      }
-      propend();
+      array('b', value, size);
     }
 
     void S(const char *value) {
@@ -3,11 +3,20 @@
 // (C) Andy Thomason 2016
 //
 // meshutils: Stanford PLY encoder class
-// 
+//
 
 #ifndef MESHUTILS_PLY_ENCODER_INCLUDED
 #define MESHUTILS_PLY_ENCODER_INCLUDED
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <meshutils/mesh.hpp>
+#include <meshutils/stats.hpp>
+
 namespace meshutils {
 
 class ply_encoder {
@@ -15,10 +24,24 @@ public:
   ply_encoder() {
   }
 
-  template <class MeshTraits, class Writer>
-  void encode(const basic_mesh<MeshTraits> &mesh, Writer &writer, bool ascii=true, const char *features="pnuc") {
-    auto wr = [&writer](const char *stuff) {
-      writer.write(stuff, strlen(stuff));
+  // Report phase timings and counters to stats, or nothing if it is null. See stats.hpp.
+  void setStats(stats_sink *stats) {
+    stats_ = stats;
+  }
+
+  // Write a mesh to writer, which needs a write(const char *, size_t) method (eg. std::ostream).
+  // Writes are collected into large blocks. Binary files copy the vertices directly
+  // when the vertex layout is the same as the properties in the header.
+  template <class MeshTraits, class Allocator, class Writer>
+  void encode(const basic_mesh<MeshTraits, Allocator> &mesh, Writer &writer, bool ascii=true, const char *features="pnuc") {
+    typedef typename MeshTraits::vertex_t vertex_t;
+    scoped_phase phase(stats_, ascii ? "ply_encoder.ascii" : "ply_encoder.binary");
+    stats_count(stats_, "ply_encoder.vertices", mesh.vertices().size());
+    stats_count(stats_, "ply_encoder.indices", mesh.indices().size());
+    block_writer<Writer> out(writer);
+
+    auto wr = [&out](const char *stuff) {
+      out.write(stuff, strlen(stuff));
     };
 
     char tmp[256];
@@ -32,29 +55,26 @@ public:
     snprintf(tmp, sizeof(tmp), "element vertex %d\n", (int)mesh.vertices().size());
     wr(tmp);
 
-    bool pos_enabled = strchr(features, 'p') != nullptr;
-    bool normal_enabled = strchr(features, 'n') != nullptr;
-    bool uv_enabled = strchr(features, 'u') != nullptr;
-    bool color_enabled = strchr(features, 'c') != nullptr;
+    layout l(features);
 
-    if (pos_enabled) {
+    if (l.pos) {
       wr("property float x\n");
       wr("property float y\n");
       wr("property float z\n");
     }
 
-    if (normal_enabled) {
+    if (l.normal) {
       wr("property float nx\n");
       wr("property float ny\n");
       wr("property float nz\n");
     }
 
-    if (uv_enabled) {
+    if (l.uv) {
       wr("property float u\n");
       wr("property float v\n");
     }
 
-    if (color_enabled) {
+    if (l.color) {
       wr("property uchar red\n");
       wr("property uchar green\n");
       wr("property uchar blue\n");
@@ -65,80 +85,266 @@ public:
     wr("property list uchar uint vertex_indices\n");
     wr("end_header\n");
 
-    auto touchar = [](float x) { return std::max(std::min(int(x*256), 255), 0); };
-
-    for (auto &v : mesh.vertices()) {
-      char *p = tmp;
-      char *e = tmp + sizeof(tmp);
-
-      auto wf32 = [&p, e](float v) {
-        union { uint32_t u; float f; } u;
-        u.f = v;
-        if (p < e-3) { *p++ = (char)u.u; *p++ = (char)(u.u >> 8); *p++ = (char)(u.u >> 16); *p++ = (char)(u.u >> 24); }
-      };
-      auto wu8 = [&p, e](int v) {
-        if (p != e) *p++ = (char)v;
-      };
-        
-      if (pos_enabled) {
-        glm::vec3 pos = v.pos();
-        if (ascii) {
-          p += snprintf(p, e - p, "%f %f %f ", pos.x, pos.y, pos.z);
-        } else {
-          wf32(pos.x); wf32(pos.y); wf32(pos.z);
+    auto &vertices = mesh.vertices();
+    auto &indices = mesh.indices();
+
+    if (ascii) {
+      for (auto &v : vertices) {
+        char *p = out.reserve(max_ascii_vertex);
+        if (l.pos) {
+          glm::vec3 pos = v.pos();
+          p = formatFloat(p, pos.x); *p++ = ' ';
+          p = formatFloat(p, pos.y); *p++ = ' ';
+          p = formatFloat(p, pos.z); *p++ = ' ';
         }
-      }
-      if (normal_enabled) {
-        glm::vec3 normal = v.normal();
-        if (ascii) {
-          p += snprintf(p, e - p, "%f %f %f ", normal.x, normal.y, normal.z);
-        } else {
-          wf32(normal.x); wf32(normal.y); wf32(normal.z);
+        if (l.normal) {
+          glm::vec3 normal = v.normal();
+          p = formatFloat(p, normal.x); *p++ = ' ';
+          p = formatFloat(p, normal.y); *p++ = ' ';
+          p = formatFloat(p, normal.z); *p++ = ' ';
         }
-      }
-      if (uv_enabled) {
-        glm::vec2 uv = v.uv();
-        if (ascii) {
-          p += snprintf(p, e - p, "%f %f ", uv.x, uv.y);
-        } else {
-          wf32(uv.x); wf32(uv.y);
+        if (l.uv) {
+          glm::vec2 uv = v.uv();
+          p = formatFloat(p, uv.x); *p++ = ' ';
+          p = formatFloat(p, uv.y); *p++ = ' ';
         }
-      }
-      if (color_enabled) {
-        glm::vec4 color = v.color();
-        int r = touchar(color.x);
-        int g = touchar(color.y);
-        int b = touchar(color.z);
-        if (ascii) {
-          p += snprintf(p, e - p, "%3d %3d %3d ", r, g, b);
-        } else {
-          wu8(r); wu8(g); wu8(b);
+        if (l.color) {
+          glm::vec4 color = v.color();
+          p = formatInt(p, touchar(color.x)); *p++ = ' ';
+          p = formatInt(p, touchar(color.y)); *p++ = ' ';
+          p = formatInt(p, touchar(color.z)); *p++ = ' ';
         }
+        *p++ = '\n';
+        out.commit(p);
       }
 
-      if (ascii && p != e) *p++ = '\n';
+      for (size_t i = 0; i + 3 <= indices.size(); i += 3) {
+        char *p = out.reserve(48);
+        *p++ = '3'; *p++ = ' ';
+        p = formatInt(p, (uint32_t)indices[i]); *p++ = ' ';
+        p = formatInt(p, (uint32_t)indices[i+1]); *p++ = ' ';
+        p = formatInt(p, (uint32_t)indices[i+2]); *p++ = '\n';
+        out.commit(p);
+      }
+      stats_count(stats_, "ply_encoder.bytes", out.bytes());
+      return;
+    }
 
-      writer.write(tmp, size_t(p - tmp));
+    if (l.matches<vertex_t>()) {
+      out.write((const char *)vertices.data(), vertices.size() * sizeof(vertex_t));
+    } else {
+      for (auto &v : vertices) {
+        out.commit(l.pack(out.reserve(l.size), v));
+      }
     }
 
-    auto &indices = mesh.indices();
-    for (size_t i = 0; i < indices.size(); i += 3) {
-      char *p = tmp;
-      char *e = tmp + sizeof(tmp);
-
-      auto wu32 = [&p, e](uint32_t v) {
-        *p++ = (char)v; *p++ = (char)(v >> 8); *p++ = (char)(v >> 16); *p++ = (char)(v >> 24);
-      };
-      if (ascii) {
-        p += snprintf(tmp, e - p, "3 %d %d %d\n", indices[i], indices[i+1], indices[i+2]);
-      } else {
-        *p++ = 3; wu32(indices[i]); wu32(indices[i+1]); wu32(indices[i+2]);
+    for (size_t i = 0; i + 3 <= indices.size(); i += 3) {
+      char *p = out.reserve(13);
+      *p++ = 3;
+      p = wu32(p, (uint32_t)indices[i]);
+      p = wu32(p, (uint32_t)indices[i+1]);
+      p = wu32(p, (uint32_t)indices[i+2]);
+      out.commit(p);
+    }
+    stats_count(stats_, "ply_encoder.bytes", out.bytes());
+  }
+
+  // Write the shortest decimal that reads back as the same float, eg. 0.1 rather than 0.100000.
+  // Needs at most 24 bytes.
+  static char *formatFloat(char *p, float f) {
+    if (f == 0) {
+      if (std::signbit(f)) *p++ = '-';
+      *p++ = '0';
+      return p;
+    }
+
+    double x = std::fabs((double)f);
+    if (std::isfinite(f) && x >= 1e-12 && x < 1e12) {
+      int e10 = (int)std::floor(std::log10(x));
+      for (int digits = 1; digits <= 9; ++digits) {
+        // |f| is close to m / 10^k, the powers of ten used here are exact doubles.
+        int k = digits - 1 - e10;
+        double m = std::floor((k >= 0 ? x * exact_pow10(k) : x / exact_pow10(-k)) + 0.5);
+        double c = k >= 0 ? m / exact_pow10(k) : m * exact_pow10(-k);
+        float fc = (float)c;
+        if (fc != (float)x) continue;
+
+        // c has been rounded once, so if it is very close to half way between two floats
+        // the decimal itself may round the other way.
+        double other = std::nextafter(fc, c < fc ? 0.0f : HUGE_VALF);
+        double mid = ((double)fc + other) * 0.5;
+        if (std::fabs(c - mid) <= c * 1e-15) break;
+
+        if (f < 0) *p++ = '-';
+        return formatDecimal(p, (uint64_t)m, k);
       }
-      writer.write(tmp, size_t(p - tmp));
     }
+    return p + snprintf(p, 24, "%.9g", f);
+  }
+
+  // Needs at most 10 bytes.
+  static char *formatInt(char *p, uint32_t value) {
+    char digits[10];
+    int n = 0;
+    do {
+      digits[n++] = (char)('0' + value % 10);
+      value /= 10;
+    } while (value);
+    while (n) *p++ = digits[--n];
+    return p;
   }
+
 private:
-  
+  enum { block_size = 0x10000, max_ascii_vertex = 12 * 24 };
+
+  // Collects writes into blocks of block_size bytes.
+  template <class Writer>
+  class block_writer {
+  public:
+    block_writer(Writer &writer) : writer_(writer), buffer_(block_size) {
+    }
+
+    ~block_writer() {
+      flush();
+    }
+
+    // Room for at least size bytes, size <= block_size.
+    char *reserve(size_t size) {
+      if (size_ + size > buffer_.size()) flush();
+      return buffer_.data() + size_;
+    }
+
+    // End of the bytes written after reserve().
+    void commit(char *p) {
+      size_ = (size_t)(p - buffer_.data());
+    }
+
+    void write(const char *data, size_t size) {
+      if (size_ + size <= buffer_.size()) {
+        memcpy(buffer_.data() + size_, data, size);
+        size_ += size;
+      } else {
+        // large writes go straight to the writer.
+        flush();
+        writer_.write(data, size);
+        written_ += size;
+      }
+    }
+
+    // Bytes written so far, including the buffer.
+    size_t bytes() const {
+      return written_ + size_;
+    }
+
+    void flush() {
+      if (size_) writer_.write(buffer_.data(), size_);
+      written_ += size_;
+      size_ = 0;
+    }
+
+  private:
+    Writer &writer_;
+    std::vector<char> buffer_;
+    size_t size_ = 0;
+    size_t written_ = 0;
+  };
+
+  // The vertex properties selected by the features string.
+  struct layout {
+    bool pos;
+    bool normal;
+    bool uv;
+    bool color;
+    size_t size;
+
+    layout(const char *features) {
+      pos = strchr(features, 'p') != nullptr;
+      normal = strchr(features, 'n') != nullptr;
+      uv = strchr(features, 'u') != nullptr;
+      color = strchr(features, 'c') != nullptr;
+      size = (pos ? 12 : 0) + (normal ? 12 : 0) + (uv ? 8 : 0) + (color ? 3 : 0);
+    }
+
+    // Write one binary vertex.
+    template <class VertexType>
+    char *pack(char *p, const VertexType &v) const {
+      if (pos) { glm::vec3 value = v.pos(); p = wf32(p, &value.x, 3); }
+      if (normal) { glm::vec3 value = v.normal(); p = wf32(p, &value.x, 3); }
+      if (uv) { glm::vec2 value = v.uv(); p = wf32(p, &value.x, 2); }
+      if (color) {
+        glm::vec4 value = v.color();
+        *p++ = (char)touchar(value.x);
+        *p++ = (char)touchar(value.y);
+        *p++ = (char)touchar(value.z);
+      }
+      return p;
+    }
+
+    // True if the bytes of a VertexType are the same as a packed vertex.
+    template <class VertexType>
+    bool matches() const {
+      if (color || !little_endian()) return false;
+      int slots[8];
+      size_t n = 0;
+      for (int i = 0; i != 3 && pos; ++i) slots[n++] = i;
+      for (int i = 3; i != 6 && normal; ++i) slots[n++] = i;
+      for (int i = 6; i != 8 && uv; ++i) slots[n++] = i;
+      return same_float_layout<VertexType>(slots, n);
+    }
+  };
+
+  static int touchar(float x) { return std::max(std::min(int(x*256), 255), 0); }
+
+  static char *wf32(char *p, const float *values, size_t n) {
+    if (little_endian()) {
+      memcpy(p, values, n * 4);
+      return p + n * 4;
+    }
+    for (size_t i = 0; i != n; ++i) {
+      uint32_t u;
+      memcpy(&u, values + i, 4);
+      p = wu32(p, u);
+    }
+    return p;
+  }
+
+  static char *wu32(char *p, uint32_t v) {
+    *p++ = (char)v; *p++ = (char)(v >> 8); *p++ = (char)(v >> 16); *p++ = (char)(v >> 24);
+    return p;
+  }
+
+  // Write m / 10^k without an exponent.
+  static char *formatDecimal(char *p, uint64_t m, int k) {
+    char digits[24];
+    int n = 0;
+    while (m) {
+      digits[n++] = (char)('0' + m % 10);
+      m /= 10;
+    }
+    // digits are in reverse order, drop the trailing zeros.
+    int lo = 0;
+    while (lo < n - 1 && digits[lo] == '0') {
+      ++lo;
+      --k;
+    }
+    int len = n - lo;
+    if (k <= 0) {
+      while (n != lo) *p++ = digits[--n];
+      while (k++) *p++ = '0';
+    } else if (len > k) {
+      while (n != lo + k) *p++ = digits[--n];
+      *p++ = '.';
+      while (n != lo) *p++ = digits[--n];
+    } else {
+      *p++ = '0';
+      *p++ = '.';
+      for (int i = len; i != k; ++i) *p++ = '0';
+      while (n != lo) *p++ = digits[--n];
+    }
+    return p;
+  }
+
+  stats_sink *stats_ = nullptr;
 };
 
 }
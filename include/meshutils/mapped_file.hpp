@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: read only memory mapped file
+//
+// Maps a whole file into memory without reading it. Pages are loaded by the OS
+// when they are first touched, so decoders can work on multi-GB files without a copy.
+
+#ifndef MESHUTILS_MAPPED_FILE_INCLUDED
+#define MESHUTILS_MAPPED_FILE_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace meshutils {
+
+class mapped_file {
+public:
+  mapped_file() {
+  }
+
+  mapped_file(const char *filename) {
+    open(filename);
+  }
+
+  ~mapped_file() {
+    close();
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  mapped_file(mapped_file &&rhs) {
+    *this = std::move(rhs);
+  }
+
+  mapped_file &operator=(mapped_file &&rhs) {
+    if (this != &rhs) {
+      close();
+      data_ = rhs.data_;
+      size_ = rhs.size_;
+      is_open_ = rhs.is_open_;
+      rhs.data_ = nullptr;
+      rhs.size_ = 0;
+      rhs.is_open_ = false;
+    }
+    return *this;
+  }
+
+  // Map a file, returns false if it could not be opened.
+  // An empty file opens successfully with size() == 0.
+  bool open(const char *filename) {
+    close();
+    #ifdef _WIN32
+      HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (file == INVALID_HANDLE_VALUE) return false;
+      LARGE_INTEGER size;
+      if (!GetFileSizeEx(file, &size)) { CloseHandle(file); return false; }
+      if (size.QuadPart != 0) {
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) { CloseHandle(file); return false; }
+        data_ = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        // the view keeps the mapping and file alive.
+        CloseHandle(mapping);
+        if (!data_) { CloseHandle(file); return false; }
+      }
+      CloseHandle(file);
+      size_ = (size_t)size.QuadPart;
+    #else
+      int fd = ::open(filename, O_RDONLY);
+      if (fd < 0) return false;
+      struct stat st;
+      if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+      if (st.st_size != 0) {
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) { ::close(fd); return false; }
+        data_ = (const uint8_t *)p;
+      }
+      // the mapping keeps the file alive.
+      ::close(fd);
+      size_ = (size_t)st.st_size;
+    #endif
+    is_open_ = true;
+    return true;
+  }
+
+  void close() {
+    if (data_) {
+      #ifdef _WIN32
+        UnmapViewOfFile(data_);
+      #else
+        munmap((void *)data_, size_);
+      #endif
+    }
+    data_ = nullptr;
+    size_ = 0;
+    is_open_ = false;
+  }
+
+  bool is_open() const { return is_open_; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  const uint8_t *begin() const { return data_; }
+  const uint8_t *end() const { return data_ + size_; }
+
+private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  bool is_open_ = false;
+};
+
+} // meshutils
+
+#endif
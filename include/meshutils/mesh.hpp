@@ -13,13 +13,399 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
 #include <ostream>
 #include <algorithm>
 #include <memory>
 #include <stdio.h>
+#include <thread>
+#include <unordered_map>
+#include <string>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
+
+#include <meshutils/arena.hpp>
+#include <meshutils/parallel.hpp>
+#include <meshutils/weld.hpp>
+#include <meshutils/vertex_cache.hpp>
 
 namespace meshutils {
 
+// Tag for the basic_mesh constructor that reads a function one z slice at a time.
+struct field_slices {};
+
+// A dense grid of floats for marching cubes where the value at (i, j, k) is
+// values[i + j * ystride + k * zstride]. If zring is non-zero, the z layers are
+// a ring buffer of zring slices.
+// Meshing a dense_field uses a fast path which classifies whole rows with SIMD compares.
+class dense_field {
+public:
+  dense_field(const float *values, size_t ystride, size_t zstride, int zring = 0) : values_(values), ystride_(ystride), zstride_(zstride), zring_(zring) {
+  }
+
+  float operator()(int i, int j, int k) const {
+    return row(j, k)[i];
+  }
+
+  const float *row(int j, int k) const {
+    return values_ + (zring_ ? k % zring_ : k) * zstride_ + j * ystride_;
+  }
+
+  // 1 if all n values are > 0, -1 if all are < 0, otherwise 0.
+  static int rowSign(const float *p, int n) {
+    int i = 0;
+    bool pos = true, neg = true;
+    #if defined(__SSE2__) || defined(_M_X64)
+      __m128 zero = _mm_setzero_ps();
+      int gt = 0xf, lt = 0xf;
+      for (; i + 4 <= n && (gt | lt); i += 4) {
+        __m128 v = _mm_loadu_ps(p + i);
+        gt &= _mm_movemask_ps(_mm_cmpgt_ps(v, zero));
+        lt &= _mm_movemask_ps(_mm_cmplt_ps(v, zero));
+      }
+      pos = gt == 0xf;
+      neg = lt == 0xf;
+    #endif
+    for (; i != n && (pos || neg); ++i) {
+      pos = pos && p[i] > 0;
+      neg = neg && p[i] < 0;
+    }
+    return pos ? 1 : neg ? -1 : 0;
+  }
+
+  // Or bit into dest[i] for each of the n values that are < 0.
+  // any and all accumulate the or and and of the results.
+  static void signBits(const float *p, int n, int bit, uint8_t *dest, int &any, int &all) {
+    int i = 0;
+    int rany = 0, rall = 1;
+    #if defined(__SSE2__) || defined(_M_X64)
+      // expand a four bit movemask to four bytes.
+      static const uint32_t expand[16] = {
+        0x00000000,0x00000001,0x00000100,0x00000101,0x00010000,0x00010001,0x00010100,0x00010101,
+        0x01000000,0x01000001,0x01000100,0x01000101,0x01010000,0x01010001,0x01010100,0x01010101,
+      };
+      __m128 zero = _mm_setzero_ps();
+      int sany = 0, sall = 0xf;
+      for (; i + 4 <= n; i += 4) {
+        int m = _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(p + i), zero));
+        sany |= m;
+        sall &= m;
+        if (m) {
+          uint32_t d;
+          memcpy(&d, dest + i, 4);
+          d |= expand[m] * (uint32_t)bit;
+          memcpy(dest + i, &d, 4);
+        }
+      }
+      rany = sany != 0;
+      rall = sall == 0xf;
+    #endif
+    for (; i != n; ++i) {
+      int s = p[i] < 0;
+      rany |= s;
+      rall &= s;
+      dest[i] |= (uint8_t)(s * bit);
+    }
+    if (rany) any |= bit;
+    if (!rall) all &= ~bit;
+  }
+
+private:
+  const float *values_;
+  size_t ystride_;
+  size_t zstride_;
+  int zring_;
+};
+
+// A sparse grid of floats for marching cubes made of 8x8x8 bricks.
+// Only bricks near the isosurface need to be stored, all other values are background.
+// The background should not be zero and should have the sign of the space away from the surface.
+class sparse_field {
+public:
+  enum { brick_bits = 3, brick_size = 1 << brick_bits, brick_volume = brick_size * brick_size * brick_size };
+
+  sparse_field(float background = 1e37f) : background_(background) {
+  }
+
+  float background() const { return background_; }
+
+  float operator()(int i, int j, int k) const {
+    const float *b = findBrick(i >> brick_bits, j >> brick_bits, k >> brick_bits);
+    return b ? b[offset(i, j, k)] : background_;
+  }
+
+  void set(int i, int j, int k, float value) {
+    brick(i >> brick_bits, j >> brick_bits, k >> brick_bits)[offset(i, j, k)] = value;
+  }
+
+  // Get the values for brick (bi, bj, bk), adding a brick full of background values if necessary.
+  // The value at (i, j, k) is at offset(i, j, k). The pointer remains valid until clear().
+  float *brick(int bi, int bj, int bk) {
+    uint64_t k = key(bi, bj, bk);
+    auto p = index_.find(k);
+    if (p != index_.end()) return bricks_[p->second]->values;
+    index_[k] = bricks_.size();
+    keys_.push_back(k);
+    bricks_.emplace_back(new brick_t);
+    float *result = bricks_.back()->values;
+    std::fill(result, result + brick_volume, background_);
+    return result;
+  }
+
+  // Get the values for brick (bi, bj, bk) or nullptr if it is not stored.
+  const float *findBrick(int bi, int bj, int bk) const {
+    auto p = index_.find(key(bi, bj, bk));
+    return p == index_.end() ? nullptr : bricks_[p->second]->values;
+  }
+
+  size_t numBricks() const { return bricks_.size(); }
+
+  // keys of the stored bricks, in the order they were added.
+  const std::vector<uint64_t> &keys() const { return keys_; }
+
+  void clear() {
+    index_.clear();
+    keys_.clear();
+    bricks_.clear();
+  }
+
+  // Copy the (brick_size+1)^3 values covering brick (bi, bj, bk) and one layer from the bricks above in x, y and z.
+  void gather(int bi, int bj, int bk, float *dest) const {
+    const int n = brick_size + 1;
+    for (int dk = 0; dk != 2; ++dk) {
+      for (int dj = 0; dj != 2; ++dj) {
+        for (int di = 0; di != 2; ++di) {
+          const float *b = findBrick(bi + di, bj + dj, bk + dk);
+          int imin = di * brick_size, imax = di ? n : brick_size;
+          int jmin = dj * brick_size, jmax = dj ? n : brick_size;
+          int kmin = dk * brick_size, kmax = dk ? n : brick_size;
+          for (int k = kmin; k != kmax; ++k) {
+            for (int j = jmin; j != jmax; ++j) {
+              float *d = dest + (k * n + j) * n;
+              for (int i = imin; i != imax; ++i) {
+                d[i] = b ? b[offset(i, j, k)] : background_;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // brick coordinates are packed into 21 bits each with z in the top bits, so keys sort in z, y, x order.
+  static uint64_t key(int bi, int bj, int bk) {
+    const uint64_t bias = 1 << 20, mask = (1 << 21) - 1;
+    return ((bk + bias) & mask) << 42 | ((bj + bias) & mask) << 21 | ((bi + bias) & mask);
+  }
+
+  static void unkey(uint64_t key, int &bi, int &bj, int &bk) {
+    const int bias = 1 << 20, mask = (1 << 21) - 1;
+    bi = (int)(key & mask) - bias;
+    bj = (int)((key >> 21) & mask) - bias;
+    bk = (int)((key >> 42) & mask) - bias;
+  }
+
+  static int offset(int i, int j, int k) {
+    const int m = brick_size - 1;
+    return (((k & m) << brick_bits | (j & m)) << brick_bits) | (i & m);
+  }
+
+private:
+  struct brick_t {
+    float values[brick_volume];
+  };
+
+  float background_;
+  std::unordered_map<uint64_t, size_t> index_;
+  std::vector<uint64_t> keys_;
+  std::vector<std::unique_ptr<brick_t>> bricks_;
+};
+
+// The central difference gradient of a marching cubes function fn at a vertex
+// position (x, y, z) given to the vertex generator, in grid units.
+// The gradient points towards larger values, so it is the outward normal
+// (after normalizing) for functions that are negative inside.
+// fn is sampled at the grid points next to the vertex, clamped to the xdim * ydim * zdim grid.
+template <class Function>
+glm::vec3 field_gradient(const Function &fn, int xdim, int ydim, int zdim, float x, float y, float z) {
+  int i = (int)x, j = (int)y, k = (int)z;
+  auto clamp = [](int v, int dim) { return std::max(0, std::min(v, dim - 1)); };
+  auto gradient = [&](int i, int j, int k) {
+    return glm::vec3(
+      fn(clamp(i + 1, xdim), j, k) - fn(clamp(i - 1, xdim), j, k),
+      fn(i, clamp(j + 1, ydim), k) - fn(i, clamp(j - 1, ydim), k),
+      fn(i, j, clamp(k + 1, zdim)) - fn(i, j, clamp(k - 1, zdim))
+    ) * 0.5f;
+  };
+
+  // vertices are on grid edges, so blend the gradients at the two ends of the edge.
+  glm::vec3 g0 = gradient(i, j, k);
+  float lambda = (x - i) + (y - j) + (z - k);
+  if (lambda == 0) return g0;
+  int di = x != i, dj = y != j, dk = z != k;
+  glm::vec3 g1 = gradient(clamp(i + di, xdim), clamp(j + dj, ydim), clamp(k + dk, zdim));
+  return glm::mix(g0, g1, lambda);
+}
+
+// One attribute of a vertex, eg. { "pos", 3, 'f', 0 }.
+struct attribute {
+  const char *name;
+  int number_of_channels;
+  char type; // see https://docs.python.org/2/library/struct.html
+  size_t offset;
+};
+
+// Bytes in one value of a struct style type code.
+constexpr size_t attribute_type_size(char type) {
+  return type == 'd' ? 8 : type == 'f' || type == 'i' || type == 'I' ? 4 : type == 'h' || type == 'H' ? 2 : 1;
+}
+
+// Names of the attributes used by vertex_layout.
+struct pos_attribute { static constexpr const char *name() { return "pos"; } };
+struct normal_attribute { static constexpr const char *name() { return "normal"; } };
+struct uv_attribute { static constexpr const char *name() { return "uv"; } };
+struct color_attribute { static constexpr const char *name() { return "color"; } };
+
+// An attribute of a vertex_layout, Channels values of a struct style Type.
+template <class Name, int Channels, char Type>
+struct attribute_def {
+  typedef Name name_t;
+  static constexpr int channels() { return Channels; }
+  static constexpr char type() { return Type; }
+  static constexpr size_t size() { return Channels * attribute_type_size(Type); }
+};
+
+// Compile time description of a vertex. The attributes are in memory order
+// with no padding, so vertex_layout<...>::size() is sizeof(vertex_t).
+template <class... Attributes>
+struct vertex_layout {
+  static constexpr size_t num_attributes() { return sizeof...(Attributes); }
+
+  static constexpr size_t size() {
+    const size_t sizes[] = { 0, Attributes::size()... };
+    size_t total = 0;
+    for (size_t s : sizes) total += s;
+    return total;
+  }
+
+  // Byte offset of the attribute called Name in a vertex, or -1 if there is none.
+  template <class Name>
+  static constexpr int offset() {
+    const bool match[] = { false, std::is_same<Name, typename Attributes::name_t>::value... };
+    const size_t sizes[] = { 0, Attributes::size()... };
+    int result = 0;
+    for (size_t i = 1; i != sizeof...(Attributes) + 1; ++i) {
+      if (match[i]) return result;
+      result += (int)sizes[i];
+    }
+    return -1;
+  }
+
+  template <class Name>
+  static constexpr bool has() { return offset<Name>() >= 0; }
+
+  template <class Name>
+  static constexpr int channels() {
+    const bool match[] = { false, std::is_same<Name, typename Attributes::name_t>::value... };
+    const int channels[] = { 0, Attributes::channels()... };
+    for (size_t i = 1; i != sizeof...(Attributes) + 1; ++i) {
+      if (match[i]) return channels[i];
+    }
+    return 0;
+  }
+
+  // The attributes in memory order, followed by { nullptr, 0, 0, 0 }.
+  static const attribute *attributes() {
+    static const attribute table[] = {
+      attribute{ Attributes::name_t::name(), Attributes::channels(), Attributes::type(), (size_t)offset<typename Attributes::name_t>() }...,
+      attribute{ nullptr, 0, 0, 0 }
+    };
+    return table;
+  }
+
+  // The layout as a string, eg. "pos:3f,normal:3f,uv:2f".
+  static const char *format() {
+    static const std::string result = makeFormat();
+    return result.c_str();
+  }
+
+private:
+  static std::string makeFormat() {
+    std::string result;
+    for (const attribute *a = attributes(); a->name; ++a) {
+      if (!result.empty()) result += ',';
+      result += a->name;
+      result += ':';
+      result += std::to_string(a->number_of_channels);
+      result += a->type;
+    }
+    return result;
+  }
+};
+
+// True if the low byte of an integer comes first in memory.
+inline bool little_endian() {
+  const uint32_t one = 1;
+  return *(const uint8_t *)&one == 1;
+}
+
+// 10^n for 0 <= n <= 22, the powers of ten that are exact doubles.
+inline double exact_pow10(int n) {
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+  return powers[n];
+}
+
+// True if the bytes of a VertexType are exactly num_slots floats, float i being the
+// vertex value numbered slots[i] in x, y, z, nx, ny, nz, u, v, r, g, b, a order.
+// A vertex with a different value in every float shows where each attribute lives.
+template <class VertexType>
+bool same_float_layout(const int *slots, size_t num_slots) {
+  if (sizeof(VertexType) != num_slots * sizeof(float)) return false;
+  VertexType v(glm::vec3(1, 2, 3), glm::vec3(4, 5, 6), glm::vec2(7, 8), glm::vec4(9, 10, 11, 12));
+  for (size_t i = 0; i != num_slots; ++i) {
+    float value = (float)(slots[i] + 1);
+    if (slots[i] < 0 || memcmp((const char *)&v + i * sizeof(float), &value, sizeof(float))) return false;
+  }
+  return true;
+}
+
+// Strided view of a vertex attribute or the indices of a mesh, without copying them.
+// Element i is components values of type at data + i * stride, where type is a
+// struct style code (see attribute), eg. 'f' for float and 'I' for uint32_t.
+// Attributes that a vertex does not store have a stride of zero and point at a default value.
+struct attribute_view {
+  const uint8_t *data = nullptr;
+  size_t stride = 0;
+  size_t count = 0;
+  int components = 0;
+  char type = 0;
+
+  size_t size() const { return count; }
+
+  // Element i as a T, eg. get<glm::vec3>(i) for a view with three floats.
+  template <class T>
+  const T &get(size_t i) const { return *(const T *)(data + i * stride); }
+
+  template <class T>
+  const T *ptr() const { return (const T *)data; }
+
+  // Element i of an integer view, eg. an index.
+  uint32_t u32(size_t i) const {
+    const uint8_t *p = data + i * stride;
+    switch (type) {
+      case 'B': return *p;
+      case 'H': return *(const uint16_t *)p;
+      default: return *(const uint32_t *)p;
+    }
+  }
+};
+
 // base class for all meshes.
 class mesh {
 public:
@@ -29,26 +415,46 @@ public:
   virtual ~mesh() {
   }
 
+  // copies of the attributes.
   virtual std::vector<glm::vec3> pos() const  = 0;
   virtual std::vector<glm::vec3> normal() const = 0;
   virtual std::vector<glm::vec2> uv(int index) const = 0;
   virtual std::vector<glm::vec4> color() const = 0;
   virtual std::vector<uint32_t> indices32() const = 0;
+
+  // views of the attributes in place, valid until the mesh is changed.
+  virtual attribute_view posView() const = 0;
+  virtual attribute_view normalView() const = 0;
+  virtual attribute_view uvView(int index) const = 0;
+  virtual attribute_view colorView() const = 0;
+  virtual attribute_view indexView() const = 0;
 };
 
 // Specialised mesh based on a template vertex type
 // The vertices are represented in Array of Structures form.
-template <class MeshTraits>
+// Allocator is used for the vertices and indices, eg. arena_allocator to build many
+// small meshes in a reusable arena. Temporary buffers use the default allocator.
+template <class MeshTraits, class Allocator = std::allocator<typename MeshTraits::vertex_t>>
 class basic_mesh : public mesh {
 public:
   typedef MeshTraits traits_t;
+  typedef Allocator allocator_t;
   typedef typename MeshTraits::vertex_t vertex_t;
   typedef typename MeshTraits::index_t index_t;
+  typedef std::vector<vertex_t, typename std::allocator_traits<Allocator>::template rebind_alloc<vertex_t>> vertex_vector;
+  typedef std::vector<index_t, typename std::allocator_traits<Allocator>::template rebind_alloc<index_t>> index_vector;
 
   // empty basic_mesh
   basic_mesh() {
   }
 
+  // empty basic_mesh using alloc, eg. arena_allocator<vertex_t>(worker_arena).
+  // The decoders load into the allocator of the mesh they are given.
+  explicit basic_mesh(const Allocator &alloc) : vertices_(alloc), indices_(alloc) {
+  }
+
+  Allocator get_allocator() const { return Allocator(vertices_.get_allocator()); }
+
   // mesh virtual methods
   std::vector<glm::vec3> pos() const override {
     std::vector<glm::vec3> result;
@@ -92,10 +498,40 @@ public:
     return std::move(result);
   }
 
-  const std::vector<vertex_t> &vertices() const { return vertices_; }
+  attribute_view posView() const override {
+    static const glm::vec3 value(0, 0, 0);
+    return view<pos_attribute>(&value, 3);
+  }
+
+  attribute_view normalView() const override {
+    static const glm::vec3 value(1, 0, 0);
+    return view<normal_attribute>(&value, 3);
+  }
+
+  attribute_view uvView(int index) const override {
+    static const glm::vec2 value(0, 0);
+    return index == 0 ? view<uv_attribute>(&value, 2) : view<void>(&value, 2);
+  }
+
+  attribute_view colorView() const override {
+    static const glm::vec4 value(1, 1, 1, 1);
+    return view<color_attribute>(&value, 4);
+  }
+
+  attribute_view indexView() const override {
+    attribute_view result;
+    result.data = (const uint8_t *)indices_.data();
+    result.stride = sizeof(index_t);
+    result.count = indices_.size();
+    result.components = 1;
+    result.type = sizeof(index_t) == 1 ? 'B' : sizeof(index_t) == 2 ? 'H' : 'I';
+    return result;
+  }
+
+  const vertex_vector &vertices() const { return vertices_; }
   size_t vertexSize() const { return sizeof(vertex_t); }
 
-  const std::vector<index_t> &indices() const { return indices_; }
+  const index_vector &indices() const { return indices_; }
   size_t indexSize() const { return sizeof(index_t); }
 
   basic_mesh &operator=(basic_mesh &&rhs) {
@@ -198,39 +634,110 @@ public:
     return MeshTraits::getFormat();
   }
 
-  void reindex(bool recalcNormals = false) {
-    std::vector<expandedVertex> expanded = expand();
+  // Weld identical vertices and remove unused ones.
+  // If recalcNormals is set, vertices at the same position get the normalized sum of their normals, once per use.
+  // If sorted is set the vertices are in memcmp order, otherwise they are in order of first use.
+  void reindex(bool recalcNormals = false, bool sorted = false, unsigned num_threads = 1) {
+    // the used vertices in order of first use.
+    const index_t unused = (index_t)-1;
+    std::vector<index_t> remap(vertices_.size(), unused);
+    std::vector<vertex_t> used;
+    std::vector<uint32_t> use_count;
+    used.reserve(vertices_.size());
+    use_count.reserve(vertices_.size());
+    for (auto &i : indices_) {
+      if (remap[i] == unused) {
+        remap[i] = (index_t)used.size();
+        used.push_back(vertices_[i]);
+        use_count.push_back(0);
+      }
+      i = remap[i];
+      use_count[i]++;
+    }
+
     if (recalcNormals) {
-      std::sort(
-        expanded.begin(), expanded.end(),
-        [](const expandedVertex &a, const expandedVertex &b) {
-          glm::vec3 apos = a.vtx.pos();
-          glm::vec3 bpos = b.vtx.pos();
-          return memcmp(&apos, &bpos, sizeof(apos)) < 0;
-        }
-      );
-
-      size_t imax = expanded.size();
-      for (size_t i = 0, idx = 0; i != imax; ) {
-        auto &v0 = expanded[i];
-        glm::vec3 normal = v0.vtx.normal();
-        glm::vec3 pos = v0.vtx.pos();
-        size_t j = i + 1;
-        for (; j < imax && pos == expanded[j].vtx.pos(); ++j) {
-          normal += expanded[j].vtx.normal();
-        }
+      std::vector<glm::vec3> pos(used.size());
+      for (size_t i = 0; i != used.size(); ++i) {
+        pos[i] = used[i].pos();
+      }
+      std::vector<glm::vec3> unique_pos;
+      std::vector<uint32_t> ipos;
+      weld(unique_pos, ipos, pos, num_threads);
 
-        normal = glm::normalize(normal);
+      std::vector<glm::vec3> normal(unique_pos.size(), glm::vec3(0.0f));
+      for (size_t i = 0; i != used.size(); ++i) {
+        normal[ipos[i]] += used[i].normal() * (float)use_count[i];
+      }
+      for (size_t i = 0; i != used.size(); ++i) {
+        used[i].normal(glm::normalize(normal[ipos[i]]));
+      }
+    }
 
-        while (i < j) {
-          expanded[i++].vtx.normal(normal);
+    // there are no more welded vertices than before, so an arena mesh reuses its buffer.
+    std::vector<vertex_t> welded;
+    std::vector<index_t> iused;
+    if (sorted) {
+      weld_sorted(welded, iused, used);
+    } else {
+      weld(welded, iused, used, num_threads);
+    }
+    replace_contents(vertices_, welded);
+    for (auto &i : indices_) {
+      i = iused[i];
+    }
+  }
+
+  // Set each normal to the area weighted average of the triangles using the vertex,
+  // facing the side from which the triangles are counter-clockwise. Marching cubes
+  // triangles are counter-clockwise seen from the negative side of the function.
+  // A table of the triangles of each vertex is built first so that vertices can be
+  // summed in parallel without atomics. Vertices with no area keep their normal.
+  void calcNormals(unsigned num_threads = 0) {
+    size_t nv = vertices_.size(), num_indices = indices_.size() / 3 * 3;
+    std::vector<uint32_t> first(nv + 1, 0);
+    for (size_t i = 0; i != num_indices; ++i) first[indices_[i] + 1]++;
+    for (size_t v = 0; v != nv; ++v) first[v + 1] += first[v];
+    std::vector<uint32_t> tris(num_indices);
+    std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+    for (size_t i = 0; i != num_indices; ++i) tris[fill[indices_[i]]++] = (uint32_t)(i / 3);
+
+    parallel_for_range(0, (int)nv, 0x1000, [&](int lo, int hi) {
+      for (int v = lo; v != hi; ++v) {
+        glm::vec3 sum(0.0f);
+        for (uint32_t k = first[v]; k != first[v + 1]; ++k) {
+          const index_t *t = indices_.data() + tris[k] * 3;
+          glm::vec3 p0 = vertices_[t[0]].pos();
+          // the cross product is twice the area times the normal.
+          sum += glm::cross(vertices_[t[1]].pos() - p0, vertices_[t[2]].pos() - p0);
         }
+        float len2 = glm::dot(sum, sum);
+        if (len2 > 0) vertices_[v].normal(sum * (1.0f / std::sqrt(len2)));
       }
+    }, num_threads);
+  }
+
+  // Average vertex shader runs per triangle with a FIFO cache of cache_size vertices.
+  float acmr(unsigned cache_size = 16) const {
+    return meshutils::acmr(indices_.data(), indices_.size(), vertices_.size(), cache_size);
+  }
+
+  // Reorder the triangles for the vertex cache, optionally sort them to reduce overdraw,
+  // then put the vertices in order of first use. Returns the ACMR before and after.
+  // Use before saving a mesh that will be drawn as it is.
+  std::pair<float, float> optimizeVertexCache(unsigned cache_size = 16, bool overdraw = false) {
+    float before = acmr(cache_size);
+    std::vector<uint32_t> clusters;
+    optimize_vertex_cache(indices_.data(), indices_.size(), vertices_.size(), cache_size, overdraw ? &clusters : nullptr);
+    if (overdraw) {
+      optimize_overdraw(indices_.data(), indices_.size(), clusters, [this](index_t i) { return vertices_[i].pos(); });
     }
-    compact(expanded);
+    optimize_vertex_fetch(vertices_, indices_);
+    return std::make_pair(before, acmr(cache_size));
   }
 
   basic_mesh(std::vector<glm::vec3> &pos, std::vector<glm::vec3> &normal, std::vector<glm::vec2> &uv, std::vector<glm::vec4> &color, std::vector<uint32_t> &indices) {
+    vertices_.reserve(pos.size());
+    indices_.reserve(indices.size());
     for (size_t i = 0; i != pos.size(); ++i) {
       glm::vec3 vnormal = normal.empty() ? glm::vec3(1, 0, 0) : normal[i];
       glm::vec2 vuv = uv.empty() ? glm::vec2(0, 0) : uv[i];
@@ -242,148 +749,301 @@ public:
     }
   }
 
+  // Take the vertices and indices of a mesh built elsewhere without copying them.
+  basic_mesh(vertex_vector &&vertices, index_vector &&indices) : vertices_(std::move(vertices)), indices_(std::move(indices)) {
+  }
+
   // Generate an implicit basic_mesh from a function (ie. marching cubes).
   // Vertices will be generated where the function changes sign.
+  // Edge indices are only kept for two z layers at a time.
   template<class Function, class Generator>
   basic_mesh(int xdim, int ydim, int zdim, Function fn, Generator vertex_generator) {
-    // Now build the marching cubes triangles.
-    // Each cube owns three edges 0->1 0->3 0->4
-    std::vector<int> edge_indices(xdim*ydim*zdim*3);
-
-    for (size_t i = 0; i != edge_indices.size(); ++i) {
-      edge_indices [i] = -1;
-    }
-
-    // Build the vertices first. One for each edge that changes sign.
-    for (int k = 0; k != zdim; ++k) {
-      for (int j = 0; j != ydim; ++j) {
-        for (int i = 0; i != xdim; ++i) {
-          int idx = (k * ydim + j) * xdim + i;
-          float v0 = fn(i, j, k);
-          float fi = (float)i;
-          float fj = (float)j;
-          float fk = (float)k;
-
-          // x edges
-          if (i != xdim-1) {
-            float v1 = fn(i+1, j, k);
-            if (v0 * v1 <= 0) {
-              float lambda = v0 / (v0 - v1);
-              edge_indices[idx*3+0] = (int)vertices_.size();
-              vertices_.push_back(vertex_generator(fi + lambda, fj, fk));
-            }
-          }
+    if (xdim <= 0 || ydim <= 0 || zdim <= 0) return;
+    mcStream(xdim, ydim, zdim, fn, vertex_generator, [](int) {});
+  }
 
-          // y edges
-          if (j != ydim-1) {
-            float v1 = fn(i, j+1, k);
-            if (v0 * v1 <= 0) {
-              float lambda = v0 / (v0 - v1);
-              edge_indices[idx*3+1] = (int)vertices_.size();
-              vertices_.push_back(vertex_generator(fi, fj + lambda, fk));
-            }
-          }
+  // Streaming marching cubes which reads the function one z slice at a time.
+  // slice_fn(k, values) is called for k = 0, 1, ... zdim-1 in order and must fill values[j*xdim+i]
+  // with the function at (i, j, k). Only three slices of values and two layers of edges
+  // are kept, so memory use scales with xdim*ydim and not with the volume.
+  template<class SliceFunction, class Generator>
+  basic_mesh(int xdim, int ydim, int zdim, field_slices, SliceFunction slice_fn, Generator vertex_generator, const Allocator &alloc = Allocator()) :
+    vertices_(alloc), indices_(alloc)
+  {
+    if (xdim <= 0 || ydim <= 0 || zdim <= 0) return;
+    size_t slice_size = (size_t)xdim * ydim;
+    std::vector<float> slices(slice_size * 3);
+
+    dense_field fn(slices.data(), xdim, slice_size, 3);
+
+    // layer k needs slices k and k+1.
+    int num_loaded = 0;
+    auto prepare = [&](int k) {
+      while (num_loaded <= k + 1 && num_loaded < zdim) {
+        slice_fn(num_loaded, slices.data() + slice_size * (num_loaded % 3));
+        ++num_loaded;
+      }
+    };
+
+    mcStream(xdim, ydim, zdim, fn, vertex_generator, prepare);
+  }
+
+  // Multi-threaded marching cubes.
+  // The volume is split into z slabs which generate vertices and triangles in parallel.
+  // The slabs are then stitched together in z order so the result is exactly
+  // the same as the single threaded version.
+  // fn and vertex_generator will be called from several threads at once.
+  // num_threads == 0 uses thread_pool::globalThreads().
+  // The vertices and indices are sized once, so an arena holds only the final arrays.
+  template<class Function, class Generator>
+  basic_mesh(int xdim, int ydim, int zdim, Function fn, Generator vertex_generator, unsigned num_threads, const Allocator &alloc = Allocator()) :
+    vertices_(alloc), indices_(alloc)
+  {
+    if (xdim <= 0 || ydim <= 0 || zdim <= 0) return;
+    if (num_threads == 0) num_threads = thread_pool::globalThreads();
+    if (num_threads == 1) {
+      mcStream(xdim, ydim, zdim, fn, vertex_generator, [](int) {});
+      return;
+    }
+
+    // Each slab keeps the edge indices of its first and last layers for stitching.
+    // The vertex indices in each slab start at zero, slab_t::base converts them to mesh indices.
+    size_t layer_size = (size_t)xdim * ydim * 3;
+    struct slab_t {
+      int kmin, kmax;
+      size_t base;
+      std::vector<int> first_edges;
+      std::vector<int> last_edges;
+      std::vector<vertex_t> vertices;
+      std::vector<index_t> indices;
+    };
+
+    // Use a few slabs per thread to even out the load.
+    int num_slabs = std::min(zdim, (int)num_threads * 4);
+    std::vector<slab_t> slabs(num_slabs);
+    for (int s = 0; s != num_slabs; ++s) {
+      slabs[s].kmin = (int)((int64_t)zdim * s / num_slabs);
+      slabs[s].kmax = (int)((int64_t)zdim * (s+1) / num_slabs);
+    }
+
+    // Build the vertices and all the triangles inside each slab.
+    parallel_for(0, num_slabs, [&](int s) {
+      slab_t &slab = slabs[s];
+      slab.first_edges.resize(layer_size);
+      slab.last_edges.resize(layer_size);
+      mcStream(xdim, ydim, zdim, slab.kmin, slab.kmax, fn, vertex_generator, [](int) {}, slab.first_edges.data(), slab.last_edges.data(), slab.vertices, slab.indices);
+    }, num_threads);
+
+    size_t num_vertices = 0;
+    for (auto &slab : slabs) {
+      slab.base = num_vertices;
+      num_vertices += slab.vertices.size();
+    }
+    vertices_.resize(num_vertices);
+
+    // Stitch the top layer of each slab to the bottom layer of the next.
+    parallel_for(0, num_slabs, [&](int s) {
+      slab_t &slab = slabs[s];
+      for (auto &i : slab.indices) {
+        i = (index_t)(i + slab.base);
+      }
+      if (slab.kmax != zdim) {
+        mcTriangles(
+          xdim, ydim, slab.kmax-1, fn,
+          slab.last_edges.data(), slab.base,
+          slabs[s+1].first_edges.data(), slabs[s+1].base,
+          slab.indices
+        );
+      }
+      std::copy(slab.vertices.begin(), slab.vertices.end(), vertices_.begin() + slab.base);
+      slab.vertices = std::vector<vertex_t>();
+    }, num_threads);
 
-          // z edges
-          if (k != zdim-1) {
-            float v1 = fn(i, j, k+1);
-            if (v0 * v1 <= 0) {
-              float lambda = v0 / (v0 - v1);
-              edge_indices[idx*3+2] = (int)vertices_.size();
-              vertices_.push_back(vertex_generator(fi, fj, fk + lambda));
+    std::vector<size_t> index_base(num_slabs);
+    for (int s = 1; s != num_slabs; ++s) {
+      index_base[s] = index_base[s-1] + slabs[s-1].indices.size();
+    }
+    indices_.resize(index_base[num_slabs-1] + slabs[num_slabs-1].indices.size());
+    parallel_for(0, num_slabs, [&](int s) {
+      std::copy(slabs[s].indices.begin(), slabs[s].indices.end(), indices_.begin() + index_base[s]);
+    }, num_threads);
+  }
+
+  // Marching cubes on a sparse_field.
+  // Only the stored bricks and their neighbours are visited as all other cubes have
+  // the background value at every corner. The bricks are processed in parallel.
+  // Vertices and triangles are ordered by brick in z, y, x order.
+  // vertex_generator will be called from several threads at once.
+  template<class Generator>
+  basic_mesh(int xdim, int ydim, int zdim, const sparse_field &field, Generator vertex_generator, unsigned num_threads = 1, const Allocator &alloc = Allocator()) :
+    vertices_(alloc), indices_(alloc)
+  {
+    if (xdim <= 0 || ydim <= 0 || zdim <= 0) return;
+    const int bs = sparse_field::brick_size;
+    const int n = bs + 1;
+
+    // Cubes in a brick touch the bricks above it, so visit the bricks below each stored brick too.
+    std::vector<uint64_t> keys;
+    keys.reserve(field.numBricks() * 8);
+    for (uint64_t key : field.keys()) {
+      int bi, bj, bk;
+      sparse_field::unkey(key, bi, bj, bk);
+      for (int d = 0; d != 8; ++d) {
+        int ci = bi - (d & 1), cj = bj - (d >> 1 & 1), ck = bk - (d >> 2);
+        if (ci >= 0 && cj >= 0 && ck >= 0 && ci * bs < xdim && cj * bs < ydim && ck * bs < zdim) {
+          keys.push_back(sparse_field::key(ci, cj, ck));
+        }
+      }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    struct brick_t {
+      int bi, bj, bk;
+      size_t base;
+      std::vector<float> values;
+      std::vector<int> edges;
+      std::vector<vertex_t> vertices;
+      std::vector<index_t> indices;
+    };
+
+    std::vector<brick_t> bricks(keys.size());
+    int chunk = 64;
+    int num_chunks = (int)((keys.size() + chunk - 1) / chunk);
+
+    // Build the vertices, three edges per cube as for the dense case.
+    parallel_for(0, num_chunks, [&](int c) {
+      size_t bmax = std::min(keys.size(), (size_t)(c + 1) * chunk);
+      for (size_t b = (size_t)c * chunk; b != bmax; ++b) {
+        brick_t &brick = bricks[b];
+        sparse_field::unkey(keys[b], brick.bi, brick.bj, brick.bk);
+        brick.values.resize(n * n * n);
+        brick.edges.assign(sparse_field::brick_volume * 3, -1);
+        field.gather(brick.bi, brick.bj, brick.bk, brick.values.data());
+
+        const float *v = brick.values.data();
+        for (int lk = 0; lk != bs; ++lk) {
+          int k = brick.bk * bs + lk;
+          for (int lj = 0; lj != bs; ++lj) {
+            int j = brick.bj * bs + lj;
+            for (int li = 0; li != bs; ++li) {
+              int i = brick.bi * bs + li;
+              if (i >= xdim || j >= ydim || k >= zdim) continue;
+              int *edge = brick.edges.data() + sparse_field::offset(li, lj, lk) * 3;
+              int s = (lk * n + lj) * n + li;
+              float v0 = v[s];
+              float fi = (float)i;
+              float fj = (float)j;
+              float fk = (float)k;
+
+              // x edges
+              if (i != xdim-1) {
+                float v1 = v[s + 1];
+                if (v0 * v1 <= 0) {
+                  float lambda = v0 / (v0 - v1);
+                  edge[0] = (int)brick.vertices.size();
+                  brick.vertices.push_back(vertex_generator(fi + lambda, fj, fk));
+                }
+              }
+
+              // y edges
+              if (j != ydim-1) {
+                float v1 = v[s + n];
+                if (v0 * v1 <= 0) {
+                  float lambda = v0 / (v0 - v1);
+                  edge[1] = (int)brick.vertices.size();
+                  brick.vertices.push_back(vertex_generator(fi, fj + lambda, fk));
+                }
+              }
+
+              // z edges
+              if (k != zdim-1) {
+                float v1 = v[s + n * n];
+                if (v0 * v1 <= 0) {
+                  float lambda = v0 / (v0 - v1);
+                  edge[2] = (int)brick.vertices.size();
+                  brick.vertices.push_back(vertex_generator(fi, fj, fk + lambda));
+                }
+              }
             }
           }
         }
       }
-    }
+    }, num_threads);
 
-    // This reproduced the vertex order of Paul Bourke's (borrowed) table.
-    // The indices in edge_indices have the following offsets.
-    //
-    //     7 6   y   z
-    // 3 2 4 5   | /
-    // 0 1       0 - x
-    //
+    size_t num_vertices = 0;
+    for (auto &brick : bricks) {
+      brick.base = num_vertices;
+      num_vertices += brick.vertices.size();
+    }
+    vertices_.resize(num_vertices);
 
-    // We store three indices per cube for the edges closest to vertex 0
-    // All other indices can be derived from adjacent cubes.
-    // This gives a single index offset value for each edge.
-    // There are twelve edges here because we consider adjacent cubes also.
-    int dx = 3;
-    int dy = xdim * 3;
-    int dz = xdim * ydim * 3;
-    int edge_offsets[] = {
-      0 * dx + 0 * dy + 0 * dz + 0,  // 0,1, (this cube, x component)
-      1 * dx + 0 * dy + 0 * dz + 1,  // 1,2,
-      0 * dx + 1 * dy + 0 * dz + 0,  // 2,3,
-      0 * dx + 0 * dy + 0 * dz + 1,  // 3,0, (this cube, y component)
-      0 * dx + 0 * dy + 1 * dz + 0,  // 4,5,
-      1 * dx + 0 * dy + 1 * dz + 1,  // 5,6,
-      0 * dx + 1 * dy + 1 * dz + 0,  // 6,7,
-      0 * dx + 0 * dy + 1 * dz + 1,  // 7,4,
-      0 * dx + 0 * dy + 0 * dz + 2,  // 0,4, (this cube, z component)
-      1 * dx + 0 * dy + 0 * dz + 2,  // 1,5,
-      1 * dx + 1 * dy + 0 * dz + 2,  // 2,6,
-      0 * dx + 1 * dy + 0 * dz + 2,  // 3,7
+    // Cube edge t is edge axis of the corner at (di, dj, dk), see mcEdgeOffsets.
+    static const uint8_t edge_corners[12][4] = {
+      {0,0,0,0}, {1,0,0,1}, {0,1,0,0}, {0,0,0,1},
+      {0,0,1,0}, {1,0,1,1}, {0,1,1,0}, {0,0,1,1},
+      {0,0,0,2}, {1,0,0,2}, {1,1,0,2}, {0,1,0,2},
     };
-        
-    // Build the indices. Use the mc_triangles table to choose triangles depending on sign.
-    for (int k = 0; k != zdim-1; ++k) {
-      for (int j = 0; j != ydim-1; ++j) {
-        for (int i = 0; i != xdim-1; ++i) {
-          int idx = (k * ydim + j) * xdim + i;
-          float fi = (float)i;
-          float fj = (float)j;
-          float fk = (float)k;
-
-          // Mask of vertices outside the isosurface (values are negative)
-          // Example:
-          //   00000001 means only vertex 0 is outside the surface.
-          //   10000000 means only vertex 7 is outside the surface.
-          //   11111111 all vertices are outside the surface.
-          // todo: the mask can be built incrementally.
-          float v000 = fn(i, j, k);
-          float v100 = fn(i+1, j, k);
-          float v010 = fn(i, j+1, k);
-          float v110 = fn(i+1, j+1, k);
-          float v001 = fn(i, j, k+1);
-          float v101 = fn(i+1, j, k+1);
-          float v011 = fn(i, j+1, k+1);
-          float v111 = fn(i+1, j+1, k+1);
-
-          int mask = (
-            (v000 < 0 ? 1 << 0 : 0) |
-            (v100 < 0 ? 1 << 1 : 0) |
-            (v110 < 0 ? 1 << 2 : 0) |
-            (v010 < 0 ? 1 << 3 : 0) |
-          
-            (v001 < 0 ? 1 << 4 : 0) |
-            (v101 < 0 ? 1 << 5 : 0) |
-            (v111 < 0 ? 1 << 6 : 0) |
-            (v011 < 0 ? 1 << 7 : 0)
-          );
-
-          uint64_t triangles = mc_triangles()[mask];
-          while ((triangles >> 60) != 0xc) {
-            // t0, t1, t2 choose one of twelve cube edges.
-            int t0 = triangles >> 60;
-            triangles <<= 4;
-            int t1 = triangles >> 60;
-            triangles <<= 4;
-            int t2 = triangles >> 60;
-            triangles <<= 4;
-            int i0 = edge_indices [idx*3 + edge_offsets [t0]];
-            int i1 = edge_indices [idx*3 + edge_offsets [t1]];
-            int i2 = edge_indices [idx*3 + edge_offsets [t2]];
-            if (i0 >= 0 && i1 >= 0 && i2 >= 0) {
-              indices_.push_back((index_t)i0);
-              indices_.push_back((index_t)i1);
-              indices_.push_back((index_t)i2);
+
+    // Build the triangles using the edges of this brick and the seven above it.
+    parallel_for(0, num_chunks, [&](int c) {
+      size_t bmax = std::min(keys.size(), (size_t)(c + 1) * chunk);
+      for (size_t b = (size_t)c * chunk; b != bmax; ++b) {
+        brick_t &brick = bricks[b];
+        const brick_t *neighbours[8];
+        for (int d = 0; d != 8; ++d) {
+          uint64_t key = sparse_field::key(brick.bi + (d & 1), brick.bj + (d >> 1 & 1), brick.bk + (d >> 2));
+          auto p = std::lower_bound(keys.begin(), keys.end(), key);
+          neighbours[d] = p != keys.end() && *p == key ? &bricks[p - keys.begin()] : nullptr;
+        }
+
+        const float *v = brick.values.data();
+        for (int lk = 0; lk != bs && brick.bk * bs + lk < zdim-1; ++lk) {
+          for (int lj = 0; lj != bs && brick.bj * bs + lj < ydim-1; ++lj) {
+            for (int li = 0; li != bs && brick.bi * bs + li < xdim-1; ++li) {
+              int s = (lk * n + lj) * n + li;
+              int mask = (
+                (v[s] < 0 ? 1 << 0 : 0) |
+                (v[s + 1] < 0 ? 1 << 1 : 0) |
+                (v[s + n + 1] < 0 ? 1 << 2 : 0) |
+                (v[s + n] < 0 ? 1 << 3 : 0) |
+
+                (v[s + n*n] < 0 ? 1 << 4 : 0) |
+                (v[s + n*n + 1] < 0 ? 1 << 5 : 0) |
+                (v[s + n*n + n + 1] < 0 ? 1 << 6 : 0) |
+                (v[s + n*n + n] < 0 ? 1 << 7 : 0)
+              );
+              if (mask == 0 || mask == 0xff) continue;
+
+              mcCube(mask, brick.indices, [&](int t) {
+                const uint8_t *ec = edge_corners[t];
+                int ci = li + ec[0], cj = lj + ec[1], ck = lk + ec[2];
+                int d = (ci >> sparse_field::brick_bits) | (cj >> sparse_field::brick_bits) << 1 | (ck >> sparse_field::brick_bits) << 2;
+                const brick_t *nb = neighbours[d];
+                if (!nb) return -1;
+                int e = nb->edges[sparse_field::offset(ci, cj, ck) * 3 + ec[3]];
+                return e < 0 ? -1 : e + (int)nb->base;
+              });
             }
           }
         }
       }
+    }, num_threads);
+
+    std::vector<size_t> index_base(bricks.size() + 1);
+    for (size_t b = 0; b != bricks.size(); ++b) {
+      index_base[b+1] = index_base[b] + bricks[b].indices.size();
     }
+    indices_.resize(index_base.back());
+
+    parallel_for(0, num_chunks, [&](int c) {
+      size_t bmax = std::min(keys.size(), (size_t)(c + 1) * chunk);
+      for (size_t b = (size_t)c * chunk; b != bmax; ++b) {
+        brick_t &brick = bricks[b];
+        std::copy(brick.vertices.begin(), brick.vertices.end(), vertices_.begin() + brick.base);
+        std::copy(brick.indices.begin(), brick.indices.end(), indices_.begin() + index_base[b]);
+      }
+    }, num_threads);
   }
 
   // write the mesh as a CSV file
@@ -438,43 +1098,299 @@ public:
   }
 
 private:
-  struct expandedVertex {
-    vertex_t vtx;
-    size_t order;
-  };
+  // Marching cubes into the mesh. The arrays grow in scratch vectors and are copied
+  // once, so an arena is not left holding every smaller buffer.
+  template<class Function, class Generator, class Prepare>
+  void mcStream(int xdim, int ydim, int zdim, Function &fn, Generator &vertex_generator, Prepare prepare) {
+    std::vector<vertex_t> vertices;
+    std::vector<index_t> indices;
+    mcStream(xdim, ydim, zdim, 0, zdim, fn, vertex_generator, prepare, nullptr, nullptr, vertices, indices);
+    replace_contents(vertices_, vertices);
+    replace_contents(indices_, indices);
+  }
 
-  // convert the indexed form to the expanded form.
-  std::vector<expandedVertex> expand() const {
-    std::vector<expandedVertex> result;
-    result.reserve(indices_.size());
-    for (size_t i = 0; i != indices_.size(); ++i) {
-      result.push_back(expandedVertex{vertices_[indices_[i]], i});
+  // Marching cubes: generate vertices for layers [kmin, kmax) and triangles for the cubes between them.
+  // Only two layers of edge indices are kept. prepare(k) is called before layer k is used.
+  // If first_edges and last_edges are given, they receive the edges of layers kmin and kmax-1.
+  template<class Function, class Generator, class Prepare>
+  static void mcStream(int xdim, int ydim, int zdim, int kmin, int kmax, Function &fn, Generator &vertex_generator, Prepare prepare, int *first_edges, int *last_edges, std::vector<vertex_t> &vertices, std::vector<index_t> &indices) {
+    size_t layer_size = (size_t)xdim * ydim * 3;
+    std::vector<int> edges(layer_size * 2);
+    int *cur = edges.data();
+    int *prev = edges.data() + layer_size;
+    for (int k = kmin; k != kmax; ++k) {
+      prepare(k);
+      std::swap(cur, prev);
+      mcVertices(xdim, ydim, zdim, k, fn, vertex_generator, cur, vertices);
+
+      // A closed surface has about two triangles per vertex, so keep room for six indices
+      // per vertex rather than growing the indices a triangle at a time.
+      size_t estimate = vertices.size() * 6;
+      if (indices.capacity() < estimate) {
+        indices.reserve(std::max(estimate, indices.capacity() * 2));
+      }
+      if (k == kmin && first_edges) {
+        std::copy(cur, cur + layer_size, first_edges);
+      }
+      if (k != kmin) {
+        mcTriangles(xdim, ydim, k-1, fn, prev, 0, cur, 0, indices);
+      }
+    }
+    if (last_edges) {
+      std::copy(cur, cur + layer_size, last_edges);
+    }
+  }
+
+  // Marching cubes: generate the vertices for the edges owned by z layer k.
+  // edges receives xdim*ydim*3 vertex indices relative to the start of vertices or -1 for no vertex.
+  template<class Function, class Generator>
+  static void mcVertices(int xdim, int ydim, int zdim, int k, Function &fn, Generator &vertex_generator, int *edges, std::vector<vertex_t> &vertices) {
+    for (int j = 0; j != ydim; ++j) {
+      for (int i = 0; i != xdim; ++i) {
+        int *edge = edges + ((size_t)j * xdim + i) * 3;
+        edge[0] = edge[1] = edge[2] = -1;
+        float v0 = fn(i, j, k);
+        float fi = (float)i;
+        float fj = (float)j;
+        float fk = (float)k;
+
+        // x edges
+        if (i != xdim-1) {
+          float v1 = fn(i+1, j, k);
+          if (v0 * v1 <= 0) {
+            float lambda = v0 / (v0 - v1);
+            edge[0] = (int)vertices.size();
+            vertices.push_back(vertex_generator(fi + lambda, fj, fk));
+          }
+        }
+
+        // y edges
+        if (j != ydim-1) {
+          float v1 = fn(i, j+1, k);
+          if (v0 * v1 <= 0) {
+            float lambda = v0 / (v0 - v1);
+            edge[1] = (int)vertices.size();
+            vertices.push_back(vertex_generator(fi, fj + lambda, fk));
+          }
+        }
+
+        // z edges
+        if (k != zdim-1) {
+          float v1 = fn(i, j, k+1);
+          if (v0 * v1 <= 0) {
+            float lambda = v0 / (v0 - v1);
+            edge[2] = (int)vertices.size();
+            vertices.push_back(vertex_generator(fi, fj, fk + lambda));
+          }
+        }
+      }
+    }
+  }
+
+  // Marching cubes on a dense grid: rows with no sign changes (including their
+  // y and z neighbours) are skipped without looking at individual edges.
+  template<class Generator>
+  static void mcVertices(int xdim, int ydim, int zdim, int k, dense_field &fn, Generator &vertex_generator, int *edges, std::vector<vertex_t> &vertices) {
+    std::fill(edges, edges + (size_t)xdim * ydim * 3, -1);
+    std::vector<int8_t> signs(ydim * 2);
+    for (int j = 0; j != ydim; ++j) {
+      signs[j] = (int8_t)dense_field::rowSign(fn.row(j, k), xdim);
+      signs[ydim + j] = k != zdim-1 ? (int8_t)dense_field::rowSign(fn.row(j, k+1), xdim) : signs[j];
+    }
+
+    for (int j = 0; j != ydim; ++j) {
+      int sign = signs[j];
+      if (sign != 0 && signs[ydim + j] == sign && (j == ydim-1 || signs[j+1] == sign)) continue;
+
+      const float *row = fn.row(j, k);
+      const float *yrow = j != ydim-1 ? fn.row(j+1, k) : nullptr;
+      const float *zrow = k != zdim-1 ? fn.row(j, k+1) : nullptr;
+      float fj = (float)j;
+      float fk = (float)k;
+      for (int i = 0; i != xdim; ++i) {
+        int *edge = edges + ((size_t)j * xdim + i) * 3;
+        float v0 = row[i];
+        float fi = (float)i;
+
+        // x edges
+        if (i != xdim-1) {
+          float v1 = row[i+1];
+          if (v0 * v1 <= 0) {
+            float lambda = v0 / (v0 - v1);
+            edge[0] = (int)vertices.size();
+            vertices.push_back(vertex_generator(fi + lambda, fj, fk));
+          }
+        }
+
+        // y edges
+        if (yrow) {
+          float v1 = yrow[i];
+          if (v0 * v1 <= 0) {
+            float lambda = v0 / (v0 - v1);
+            edge[1] = (int)vertices.size();
+            vertices.push_back(vertex_generator(fi, fj + lambda, fk));
+          }
+        }
+
+        // z edges
+        if (zrow) {
+          float v1 = zrow[i];
+          if (v0 * v1 <= 0) {
+            float lambda = v0 / (v0 - v1);
+            edge[2] = (int)vertices.size();
+            vertices.push_back(vertex_generator(fi, fj, fk + lambda));
+          }
+        }
+      }
     }
-    return std::move(result);
   }
 
-  // convert the expanded form to the indexed form.
-  void compact(std::vector<expandedVertex> &expanded) {
-    std::sort(
-      expanded.begin(), expanded.end(),
-      [](const expandedVertex &a, const expandedVertex &b) {
-        return memcmp(&a.vtx, &b.vtx, sizeof(a.vtx)) < 0;
+  // Marching cubes: generate the triangles for the cubes between z layers k and k+1.
+  // edges and next_edges are the edge indices of layers k and k+1 which are offset by base and next_base.
+  template<class Function>
+  static void mcTriangles(int xdim, int ydim, int k, Function &fn, const int *edges, size_t base, const int *next_edges, size_t next_base, std::vector<index_t> &indices) {
+    int edge_offsets[12];
+    mcEdgeOffsets(xdim, edge_offsets);
+
+    for (int j = 0; j != ydim-1; ++j) {
+      for (int i = 0; i != xdim-1; ++i) {
+        size_t idx = ((size_t)j * xdim + i) * 3;
+
+        // Mask of vertices outside the isosurface (values are negative)
+        // Example:
+        //   00000001 means only vertex 0 is outside the surface.
+        //   10000000 means only vertex 7 is outside the surface.
+        //   11111111 all vertices are outside the surface.
+        float v000 = fn(i, j, k);
+        float v100 = fn(i+1, j, k);
+        float v010 = fn(i, j+1, k);
+        float v110 = fn(i+1, j+1, k);
+        float v001 = fn(i, j, k+1);
+        float v101 = fn(i+1, j, k+1);
+        float v011 = fn(i, j+1, k+1);
+        float v111 = fn(i+1, j+1, k+1);
+
+        int mask = (
+          (v000 < 0 ? 1 << 0 : 0) |
+          (v100 < 0 ? 1 << 1 : 0) |
+          (v110 < 0 ? 1 << 2 : 0) |
+          (v010 < 0 ? 1 << 3 : 0) |
+        
+          (v001 < 0 ? 1 << 4 : 0) |
+          (v101 < 0 ? 1 << 5 : 0) |
+          (v111 < 0 ? 1 << 6 : 0) |
+          (v011 < 0 ? 1 << 7 : 0)
+        );
+
+        mcCube(mask, indices, [&](int t) {
+          return mcEdge(edges, base, next_edges, next_base, idx, edge_offsets, t);
+        });
+      }
+    }
+  }
+
+  // Marching cubes on a dense grid.
+  // Rows of four values (j, j+1) x (k, k+1) are classified with SIMD compares
+  // and the mask is built incrementally from one column of four signs at a time.
+  // Rows of cubes which are entirely inside or outside are skipped.
+  static void mcTriangles(int xdim, int ydim, int k, dense_field &fn, const int *edges, size_t base, const int *next_edges, size_t next_base, std::vector<index_t> &indices) {
+    int edge_offsets[12];
+    mcEdgeOffsets(xdim, edge_offsets);
+
+    // column sign bits: 1 = (j, k)  2 = (j+1, k)  4 = (j, k+1)  8 = (j+1, k+1)
+    // mask bits contributed by the low x and high x column of a cube.
+    static const uint8_t low_bits[16] = {
+      0x00,0x01,0x08,0x09,0x10,0x11,0x18,0x19,0x80,0x81,0x88,0x89,0x90,0x91,0x98,0x99,
+    };
+    static const uint8_t high_bits[16] = {
+      0x00,0x02,0x04,0x06,0x20,0x22,0x24,0x26,0x40,0x42,0x44,0x46,0x60,0x62,0x64,0x66,
+    };
+
+    std::vector<uint8_t> columns(xdim);
+    for (int j = 0; j != ydim-1; ++j) {
+      std::fill(columns.begin(), columns.end(), 0);
+      int any = 0, all = 0xf;
+      dense_field::signBits(fn.row(j, k), xdim, 1, columns.data(), any, all);
+      dense_field::signBits(fn.row(j+1, k), xdim, 2, columns.data(), any, all);
+      dense_field::signBits(fn.row(j, k+1), xdim, 4, columns.data(), any, all);
+      dense_field::signBits(fn.row(j+1, k+1), xdim, 8, columns.data(), any, all);
+      if (any == 0 || all == 0xf) continue;
+
+      for (int i = 0; i != xdim-1; ++i) {
+        int mask = low_bits[columns[i]] | high_bits[columns[i+1]];
+        if (mask == 0 || mask == 0xff) continue;
+        size_t idx = ((size_t)j * xdim + i) * 3;
+        mcCube(mask, indices, [&](int t) {
+          return mcEdge(edges, base, next_edges, next_base, idx, edge_offsets, t);
+        });
       }
-    );
-
-    vertices_.resize(0);
-    size_t imax = expanded.size();
-    for (size_t i = 0; i != imax; ) {
-      auto &v0 = expanded[i];
-      size_t idx = vertices_.size();
-      vertices_.emplace_back(expanded[i].vtx);
-      indices_[expanded[i].order] = (index_t)idx;
-      for (++i; i < imax && !memcmp(&v0.vtx, &expanded[i].vtx, sizeof(v0.vtx)); ++i) {
-        indices_[expanded[i].order] = (index_t)idx;
+    }
+  }
+
+  // This reproduced the vertex order of Paul Bourke's (borrowed) table.
+  // The indices in edge_indices have the following offsets.
+  //
+  //     7 6   y   z
+  // 3 2 4 5   | /
+  // 0 1       0 - x
+  //
+
+  // We store three indices per cube for the edges closest to vertex 0
+  // All other indices can be derived from adjacent cubes.
+  // This gives a single index offset value for each edge.
+  // There are twelve edges here because we consider adjacent cubes also.
+  // Edges 4-7 come from the next layer up.
+  static void mcEdgeOffsets(int xdim, int *edge_offsets) {
+    int dx = 3;
+    int dy = xdim * 3;
+    const int offsets[] = {
+      0 * dx + 0 * dy + 0,  // 0,1, (this cube, x component)
+      1 * dx + 0 * dy + 1,  // 1,2,
+      0 * dx + 1 * dy + 0,  // 2,3,
+      0 * dx + 0 * dy + 1,  // 3,0, (this cube, y component)
+      0 * dx + 0 * dy + 0,  // 4,5,
+      1 * dx + 0 * dy + 1,  // 5,6,
+      0 * dx + 1 * dy + 0,  // 6,7,
+      0 * dx + 0 * dy + 1,  // 7,4,
+      0 * dx + 0 * dy + 2,  // 0,4, (this cube, z component)
+      1 * dx + 0 * dy + 2,  // 1,5,
+      1 * dx + 1 * dy + 2,  // 2,6,
+      0 * dx + 1 * dy + 2,  // 3,7
+    };
+    std::copy(offsets, offsets + 12, edge_offsets);
+  }
+
+  // Use the mc_triangles table to choose triangles depending on sign.
+  // edge(t) returns the vertex index for cube edge t or -1.
+  template<class EdgeLookup>
+  static void mcCube(int mask, std::vector<index_t> &indices, EdgeLookup edge) {
+    uint64_t triangles = mc_triangles()[mask];
+    while ((triangles >> 60) != 0xc) {
+      // t0, t1, t2 choose one of twelve cube edges.
+      int t0 = triangles >> 60;
+      triangles <<= 4;
+      int t1 = triangles >> 60;
+      triangles <<= 4;
+      int t2 = triangles >> 60;
+      triangles <<= 4;
+      int i0 = edge(t0);
+      int i1 = edge(t1);
+      int i2 = edge(t2);
+      if (i0 >= 0 && i1 >= 0 && i2 >= 0) {
+        indices.push_back((index_t)i0);
+        indices.push_back((index_t)i1);
+        indices.push_back((index_t)i2);
       }
     }
   }
 
+  // Look up one of the twelve cube edges.
+  static int mcEdge(const int *edges, size_t base, const int *next_edges, size_t next_base, size_t idx, const int *edge_offsets, int t) {
+    int e = t >= 4 && t < 8 ? next_edges[idx + edge_offsets[t]] : edges[idx + edge_offsets[t]];
+    if (e < 0) return -1;
+    return e + (int)(t >= 4 && t < 8 ? next_base : base);
+  }
+
   static const uint64_t *mc_triangles() {
     // marching cubes edge lists
     // see http://paulbourke.net/geometry/polygonise/marchingsource.cpp for original.
@@ -516,14 +1432,28 @@ private:
     return values;
   }
 
-  std::vector<vertex_t> vertices_;
-  std::vector<index_t> indices_;
-};
+  // View of the attribute called Name, found in the layout of vertex_t.
+  // Attributes that the vertex does not have view default_value.
+  template <class Name>
+  attribute_view view(const void *default_value, int components) const {
+    typedef typename MeshTraits::layout_t layout_t;
+    const int offset = layout_t::template offset<Name>();
+    attribute_view result;
+    result.count = vertices_.size();
+    result.type = 'f';
+    if (offset < 0) {
+      result.data = (const uint8_t *)default_value;
+      result.components = components;
+    } else {
+      result.data = (const uint8_t *)vertices_.data() + offset;
+      result.stride = sizeof(vertex_t);
+      result.components = layout_t::template channels<Name>();
+    }
+    return result;
+  }
 
-struct attribute {
-  const char *name;
-  int number_of_channels;
-  char type; // see https://docs.python.org/2/library/struct.html
+  vertex_vector vertices_;
+  index_vector indices_;
 };
 
 // position only mesh
@@ -550,17 +1480,23 @@ struct pos_mesh_traits {
     glm::vec2 uv() const { return glm::vec2(0, 0); }
     glm::vec4 color() const { return glm::vec4(1.0f); }
 
+    // attributes which are not stored are ignored.
     vertex_t &pos(const glm::vec3 &value) { pos_ = value; return *this; }
-    vertex_t &normal(const glm::vec3 &value) {}
-    vertex_t &uv(const glm::vec2 &value) {}
-    vertex_t &color(const glm::vec4 &value) {}
+    vertex_t &normal(const glm::vec3 &value) { return *this; }
+    vertex_t &uv(const glm::vec2 &value) { return *this; }
+    vertex_t &color(const glm::vec4 &value) { return *this; }
   private:
-    // The physical layout of these data are reflected in the result of getFormat()
+    // The physical layout of these data are reflected in layout_t
     glm::vec3 pos_;
   };
 
+  typedef vertex_layout<
+    attribute_def<pos_attribute, 3, 'f'>
+  > layout_t;
+  static_assert(sizeof(vertex_t) == layout_t::size(), "vertex_t does not match layout_t");
+
   static const char *getFormat() {
-    return "pos:3f";
+    return layout_t::format();
   }
 
   typedef uint32_t index_t;
@@ -593,21 +1529,23 @@ struct simple_mesh_traits {
     vertex_t &pos(const glm::vec3 &value) { pos_ = value; return *this; }
     vertex_t &normal(const glm::vec3 &value) { normal_ = value; return *this; }
     vertex_t &uv(const glm::vec2 &value) { uv_ = value; return *this; }
-    vertex_t &color(const glm::vec4 &value) {}
+    vertex_t &color(const glm::vec4 &value) { return *this; }
   private:
-    // The physical layout of these data are reflected in the result of getFormat()
+    // The physical layout of these data are reflected in layout_t
     glm::vec3 pos_;
     glm::vec3 normal_;
     glm::vec2 uv_;
   };
 
-  const attribute *getFormat() {
-    static const attribute format[] = {
-      "pos", 3, 'f',
-      "normal", 3, 'f',
-      "uv", 2, 'f',
-      nullptr, 0, '\0'
-    };
+  typedef vertex_layout<
+    attribute_def<pos_attribute, 3, 'f'>,
+    attribute_def<normal_attribute, 3, 'f'>,
+    attribute_def<uv_attribute, 2, 'f'>
+  > layout_t;
+  static_assert(sizeof(vertex_t) == layout_t::size(), "vertex_t does not match layout_t");
+
+  static const char *getFormat() {
+    return layout_t::format();
   }
 
   typedef uint32_t index_t;
@@ -644,21 +1582,23 @@ struct color_mesh_traits {
     vertex_t &uv(const glm::vec2 &value) { uv_ = value; return *this; }
     vertex_t &color(const glm::vec4 &value) { color_ = value; return *this; }
   private:
-    // The physical layout of these data are reflected in the result of getFormat()
+    // The physical layout of these data are reflected in layout_t
     glm::vec3 pos_;
     glm::vec3 normal_;
     glm::vec2 uv_;
     glm::vec4 color_;
   };
 
-  const attribute *getFormat() {
-    static const attribute format[] = {
-      "pos", 3, 'f',
-      "normal", 3, 'f',
-      "uv", 2, 'f',
-      "color", 4, 'f',
-      nullptr, 0, '\0'
-    };
+  typedef vertex_layout<
+    attribute_def<pos_attribute, 3, 'f'>,
+    attribute_def<normal_attribute, 3, 'f'>,
+    attribute_def<uv_attribute, 2, 'f'>,
+    attribute_def<color_attribute, 4, 'f'>
+  > layout_t;
+  static_assert(sizeof(vertex_t) == layout_t::size(), "vertex_t does not match layout_t");
+
+  static const char *getFormat() {
+    return layout_t::format();
   }
 
   typedef uint32_t index_t;
@@ -668,6 +1608,11 @@ typedef basic_mesh<pos_mesh_traits> pos_mesh;
 typedef basic_mesh<simple_mesh_traits> simple_mesh;
 typedef basic_mesh<color_mesh_traits> color_mesh;
 
+// Meshes allocated from the arena of the thread that makes them.
+typedef basic_mesh<pos_mesh_traits, arena_allocator<pos_mesh_traits::vertex_t>> arena_pos_mesh;
+typedef basic_mesh<simple_mesh_traits, arena_allocator<simple_mesh_traits::vertex_t>> arena_simple_mesh;
+typedef basic_mesh<color_mesh_traits, arena_allocator<color_mesh_traits::vertex_t>> arena_color_mesh;
+
 } // vku
 
 #endif
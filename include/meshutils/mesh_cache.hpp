@@ -0,0 +1,340 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: binary mesh cache
+//
+// Stores a basic_mesh in its in-memory layout so that it can be mapped and
+// used without decoding. All values are little endian.
+//
+//   offset  type      name
+//    0      char[8]   magic        "meshutil"
+//    8      uint32    version      1
+//   12      uint32    header_size  offset of the first block, a multiple of 64
+//   16      uint32    vertex_size  sizeof(vertex_t)
+//   20      uint32    index_size   sizeof(index_t)
+//   24      uint64    num_vertices
+//   32      uint64    num_indices
+//   40      block[2]  blocks       vertices then indices
+//  104      uint32    format_size
+//  108      char[]    format       MeshTraits::getFormat(), eg. "pos:3f,normal:3f,uv:2f"
+//
+// A block is { uint64 offset, uint64 stored_size, uint32 encoding (0 = raw, 1 = zlib),
+// uint32 flags (1 = has checksum), uint32 checksum (adler32 of the raw bytes), uint32 0 }.
+// Blocks start on 64 byte boundaries.
+
+#ifndef MESHUTILS_MESH_CACHE_INCLUDED
+#define MESHUTILS_MESH_CACHE_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+#include <meshutils/mesh.hpp>
+#include <meshutils/span.hpp>
+#include <meshutils/byte_sink.hpp>
+#include <meshutils/mapped_file.hpp>
+#include <meshutils/encoders/deflate_encoder.hpp>
+#include <minizip/deflate_decoder.hpp>
+
+namespace meshutils {
+
+class mesh_cache_encoder {
+public:
+  mesh_cache_encoder() {
+  }
+
+  // Deflate blocks of at least min_bytes with zlib level 1-9, 0 stores them raw.
+  // Compressed caches can be loaded but not viewed in place.
+  void setCompression(int level, size_t min_bytes = 0x10000, unsigned num_threads = 0) {
+    compression_level_ = level;
+    compression_min_bytes_ = min_bytes;
+    compression_threads_ = num_threads;
+  }
+
+  // Store an adler32 of each block, checked by mesh_cache_decoder::load() and verify().
+  void setChecksums(bool enabled) {
+    checksums_ = enabled;
+  }
+
+  template <class MeshTraits, class Allocator>
+  bool save(const basic_mesh<MeshTraits, Allocator> &mesh, byte_sink &sink) const {
+    typedef typename MeshTraits::vertex_t vertex_t;
+    typedef typename MeshTraits::index_t index_t;
+
+    const char *format = MeshTraits::getFormat();
+    uint32_t format_size = (uint32_t)strlen(format);
+    uint32_t header_size = align(108 + format_size);
+
+    size_t base = sink.size();
+    std::vector<uint8_t> header(header_size);
+    memcpy(header.data(), "meshutil", 8);
+    u4(header.data() + 8, 1);
+    u4(header.data() + 12, header_size);
+    u4(header.data() + 16, (uint32_t)sizeof(vertex_t));
+    u4(header.data() + 20, (uint32_t)sizeof(index_t));
+    u8(header.data() + 24, mesh.vertices().size());
+    u8(header.data() + 32, mesh.indices().size());
+    u4(header.data() + 104, format_size);
+    memcpy(header.data() + 108, format, format_size);
+    sink.write(header.data(), header.size());
+
+    // the block table is patched once the stored sizes are known.
+    writeBlock(sink, base, 0, (const uint8_t *)mesh.vertices().data(), mesh.vertices().size() * sizeof(vertex_t));
+    writeBlock(sink, base, 1, (const uint8_t *)mesh.indices().data(), mesh.indices().size() * sizeof(index_t));
+    return sink.good();
+  }
+
+  template <class MeshTraits, class Allocator>
+  std::vector<uint8_t> save(const basic_mesh<MeshTraits, Allocator> &mesh) const {
+    std::vector<uint8_t> bytes;
+    vector_sink sink(bytes);
+    save(mesh, sink);
+    return bytes;
+  }
+
+private:
+  static uint32_t align(size_t size) { return (uint32_t)((size + 63) & ~(size_t)63); }
+
+  void writeBlock(byte_sink &sink, size_t base, int index, const uint8_t *data, size_t size) const {
+    size_t offset = sink.size() - base;
+    uint8_t entry[32] = {};
+    std::vector<uint8_t> deflated;
+    if (compression_level_ > 0 && size >= compression_min_bytes_) {
+      deflate_encoder(compression_level_).encode(deflated, data, size, compression_threads_);
+      u4(entry + 16, 1);
+    }
+    const uint8_t *stored = deflated.empty() ? data : deflated.data();
+    size_t stored_size = deflated.empty() ? size : deflated.size();
+
+    u8(entry + 0, offset);
+    u8(entry + 8, stored_size);
+    if (checksums_) {
+      u4(entry + 20, 1);
+      u4(entry + 24, deflate_encoder::adler32(data, size));
+    }
+    sink.write(stored, stored_size);
+
+    static const uint8_t zeros[64] = {};
+    sink.write(zeros, align(stored_size) - stored_size);
+    sink.patch(base + 40 + index * 32, entry, sizeof(entry));
+  }
+
+  static void u4(uint8_t *p, uint32_t value) {
+    for (int i = 0; i != 4; ++i) p[i] = (uint8_t)(value >> (i * 8));
+  }
+
+  static void u8(uint8_t *p, uint64_t value) {
+    for (int i = 0; i != 8; ++i) p[i] = (uint8_t)(value >> (i * 8));
+  }
+
+  int compression_level_ = 0;
+  size_t compression_min_bytes_ = 0x10000;
+  unsigned compression_threads_ = 0;
+  bool checksums_ = true;
+};
+
+// Read only view of a mesh in a mapped cache file.
+template <class MeshTraits>
+class mesh_view {
+public:
+  typedef typename MeshTraits::vertex_t vertex_t;
+  typedef typename MeshTraits::index_t index_t;
+
+  mesh_view() {
+  }
+
+  mesh_view(std::shared_ptr<mapped_file> file, span<const vertex_t> vertices, span<const index_t> indices) :
+    file_(file), vertices_(vertices), indices_(indices) {
+  }
+
+  span<const vertex_t> vertices() const { return vertices_; }
+  span<const index_t> indices() const { return indices_; }
+
+private:
+  // keeps the mapping open while the view exists.
+  std::shared_ptr<mapped_file> file_;
+  span<const vertex_t> vertices_;
+  span<const index_t> indices_;
+};
+
+class mesh_cache_decoder {
+public:
+  mesh_cache_decoder() {
+  }
+
+  // Decode the header of a cache in memory, throws if it is not a mesh cache.
+  mesh_cache_decoder(const uint8_t *begin, const uint8_t *end) {
+    init(begin, end);
+  }
+
+  // Map a file and decode its header.
+  // Returns false if the file can not be opened and throws if it is not a mesh cache.
+  bool open(const char *filename) {
+    auto file = std::make_shared<mapped_file>();
+    if (!file->open(filename)) return false;
+    file_ = file;
+    init(file_->begin(), file_->end());
+    return true;
+  }
+
+  const std::string &format() const { return format_; }
+  size_t numVertices() const { return num_vertices_; }
+  size_t numIndices() const { return num_indices_; }
+
+  // True if the cache holds a basic_mesh<MeshTraits>.
+  template <class MeshTraits>
+  bool compatible() const {
+    return format_ == MeshTraits::getFormat() &&
+      vertex_size_ == sizeof(typename MeshTraits::vertex_t) &&
+      index_size_ == sizeof(typename MeshTraits::index_t);
+  }
+
+  // True if view() can be used: the mesh is compatible, the blocks are not
+  // compressed and the data is aligned for vertex_t and index_t.
+  template <class MeshTraits>
+  bool viewable() const {
+    typedef typename MeshTraits::vertex_t vertex_t;
+    typedef typename MeshTraits::index_t index_t;
+    return compatible<MeshTraits>() && little_endian() &&
+      !blocks_[0].encoding && !blocks_[1].encoding &&
+      (uintptr_t)(begin_ + blocks_[0].offset) % alignof(vertex_t) == 0 &&
+      (uintptr_t)(begin_ + blocks_[1].offset) % alignof(index_t) == 0;
+  }
+
+  // The mesh in place in the file, without copying.
+  // Checksums are only checked if verify_checksums is set.
+  template <class MeshTraits>
+  mesh_view<MeshTraits> view(bool verify_checksums = false) const {
+    typedef typename MeshTraits::vertex_t vertex_t;
+    typedef typename MeshTraits::index_t index_t;
+    if (!viewable<MeshTraits>()) throw std::runtime_error("mesh cache can not be viewed as this mesh type");
+    if (verify_checksums && !verify()) bad_cache();
+    return mesh_view<MeshTraits>(
+      file_,
+      span<const vertex_t>((const vertex_t *)(begin_ + blocks_[0].offset), num_vertices_),
+      span<const index_t>((const index_t *)(begin_ + blocks_[1].offset), num_indices_)
+    );
+  }
+
+  // Copy or inflate the cache into a mesh, checking the checksums.
+  // The mesh keeps its allocator, eg. an arena.
+  template <class MeshTraits, class Allocator>
+  void load(basic_mesh<MeshTraits, Allocator> &mesh) const {
+    typedef basic_mesh<MeshTraits, Allocator> mesh_t;
+    typedef typename MeshTraits::vertex_t vertex_t;
+    typedef typename MeshTraits::index_t index_t;
+    if (!compatible<MeshTraits>() || !little_endian()) throw std::runtime_error("mesh cache has a different mesh type");
+    typename mesh_t::vertex_vector vertices(num_vertices_, mesh.get_allocator());
+    typename mesh_t::index_vector indices(num_indices_, mesh.get_allocator());
+    readBlock(blocks_[0], (uint8_t *)vertices.data(), vertices.size() * sizeof(vertex_t));
+    readBlock(blocks_[1], (uint8_t *)indices.data(), indices.size() * sizeof(index_t));
+    mesh = mesh_t(std::move(vertices), std::move(indices));
+  }
+
+  // Check the checksums of both blocks, compressed blocks are inflated to do this.
+  bool verify() const {
+    for (int i = 0; i != 2; ++i) {
+      const block &b = blocks_[i];
+      if (!(b.flags & 1)) continue;
+      size_t size = i == 0 ? num_vertices_ * vertex_size_ : num_indices_ * index_size_;
+      if (b.encoding) {
+        std::vector<uint8_t> raw(size);
+        if (!inflate(b, raw.data(), size)) return false;
+        if (deflate_encoder::adler32(raw.data(), size) != b.checksum) return false;
+      } else if (deflate_encoder::adler32(begin_ + b.offset, size) != b.checksum) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  struct block {
+    uint64_t offset;
+    uint64_t stored_size;
+    uint32_t encoding;
+    uint32_t flags;
+    uint32_t checksum;
+  };
+
+  void readBlock(const block &b, uint8_t *dest, size_t size) const {
+    if (b.encoding) {
+      if (!inflate(b, dest, size)) bad_cache();
+    } else {
+      memcpy(dest, begin_ + b.offset, size);
+    }
+    if ((b.flags & 1) && deflate_encoder::adler32(dest, size) != b.checksum) bad_cache();
+  }
+
+  bool inflate(const block &b, uint8_t *dest, size_t size) const {
+    const uint8_t *src = begin_ + b.offset;
+    // bytes 0 and 1 are the zlib header.
+    if (b.stored_size < 2 || (src[0] & 0x0f) != 0x08) return false;
+    return decoder_.decode(dest, dest + size, src + 2, src + b.stored_size);
+  }
+
+  void init(const uint8_t *begin, const uint8_t *end) {
+    begin_ = begin;
+    end_ = end;
+    size_t file_size = (size_t)(end - begin);
+    if (file_size < 108 || memcmp(begin, "meshutil", 8) || u4(begin + 8) != 1) bad_cache();
+
+    uint32_t header_size = u4(begin + 12);
+    vertex_size_ = u4(begin + 16);
+    index_size_ = u4(begin + 20);
+    num_vertices_ = (size_t)u8(begin + 24);
+    num_indices_ = (size_t)u8(begin + 32);
+    uint32_t format_size = u4(begin + 104);
+    if (header_size < 108 || header_size > file_size || format_size > header_size - 108) bad_cache();
+    format_.assign((const char *)begin + 108, format_size);
+
+    for (int i = 0; i != 2; ++i) {
+      const uint8_t *p = begin + 40 + i * 32;
+      block &b = blocks_[i];
+      b.offset = u8(p);
+      b.stored_size = u8(p + 8);
+      b.encoding = u4(p + 16);
+      b.flags = u4(p + 20);
+      b.checksum = u4(p + 24);
+      uint64_t count = i == 0 ? num_vertices_ : num_indices_;
+      uint64_t elem_size = i == 0 ? vertex_size_ : index_size_;
+      if (b.offset < header_size || b.offset > file_size || b.stored_size > file_size - b.offset) bad_cache();
+      if (b.encoding > 1 || (elem_size && count > ~(uint64_t)0 / elem_size)) bad_cache();
+      if (!b.encoding && b.stored_size != count * elem_size) bad_cache();
+      if (b.encoding && count * elem_size / max_deflate_ratio > b.stored_size) bad_cache();
+    }
+  }
+
+  static uint32_t u4(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  static uint64_t u8(const uint8_t *p) {
+    return u4(p) | ((uint64_t)u4(p + 4) << 32);
+  }
+
+  // Deflate stores at most 258 bytes in a length and distance code of at least two bits,
+  // so a zlib block can not expand by more than this. Larger sizes are corrupt.
+  static const uint64_t max_deflate_ratio = 1032;
+
+  static void bad_cache() { throw std::runtime_error("bad mesh cache"); }
+
+  std::shared_ptr<mapped_file> file_;
+  minizip::deflate_decoder decoder_;
+  block blocks_[2] = {};
+  std::string format_;
+  uint32_t vertex_size_ = 0;
+  uint32_t index_size_ = 0;
+  size_t num_vertices_ = 0;
+  size_t num_indices_ = 0;
+  const uint8_t *begin_ = nullptr;
+  const uint8_t *end_ = nullptr;
+};
+
+} // meshutils
+
+#endif
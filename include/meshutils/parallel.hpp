@@ -0,0 +1,390 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: thread pool, parallel loops and task graphs
+//
+// All the parallel code in meshutils runs on one process wide thread_pool,
+// so threads are created once and the total can be capped with
+// thread_pool::setGlobalThreads() before the first parallel call.
+//
+
+#ifndef MESHUTILS_PARALLEL_INCLUDED
+#define MESHUTILS_PARALLEL_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace meshutils {
+
+// A fixed set of worker threads, each with its own deque of tasks.
+// Workers run their own tasks newest first and steal the oldest tasks
+// of other workers when they run out.
+class thread_pool {
+public:
+  typedef std::function<void()> task_t;
+
+  // num_workers threads, not counting the threads that submit work.
+  explicit thread_pool(unsigned num_workers) : queues_(std::max(num_workers, 1u)) {
+    for (unsigned i = 0; i != num_workers; ++i) {
+      workers_.emplace_back([this, i]() { work(i); });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &t : workers_) t.join();
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  // The pool used by meshutils. Created on first use with
+  // setGlobalThreads() - 1 workers, the calling thread being the other one.
+  static thread_pool &global() {
+    static thread_pool pool(globalThreads() - 1);
+    return pool;
+  }
+
+  // Limit the threads used by meshutils. Has no effect after the first call of global().
+  // 0 means one thread per core.
+  static void setGlobalThreads(unsigned num_threads) {
+    requestedThreads() = num_threads;
+  }
+
+  // Total threads available to a parallel loop, including the caller.
+  static unsigned globalThreads() {
+    unsigned n = requestedThreads();
+    return n ? n : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  unsigned numWorkers() const { return (unsigned)workers_.size(); }
+
+  // Queue a task. Tasks from a worker go on its own deque.
+  void submit(task_t task) {
+    int self = index();
+    size_t q = self >= 0 ? (size_t)self : next_queue_++ % queues_.size();
+    {
+      std::lock_guard<std::mutex> lock(queues_[q].mutex);
+      queues_[q].tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++pending_;
+    }
+    wake_.notify_one();
+  }
+
+  // Run one queued task on the calling thread. false if there were none.
+  // Threads waiting for other tasks call this to help out.
+  bool runOne() {
+    task_t task;
+    if (!pop(index(), task)) return false;
+    task();
+    return true;
+  }
+
+private:
+  struct queue {
+    std::mutex mutex;
+    std::deque<task_t> tasks;
+  };
+
+  static unsigned &requestedThreads() {
+    static unsigned n = 0;
+    return n;
+  }
+
+  struct worker_id {
+    thread_pool *pool;
+    int index;
+  };
+
+  static worker_id &current() {
+    static thread_local worker_id id = { nullptr, -1 };
+    return id;
+  }
+
+  // Worker index of the calling thread in this pool, or -1.
+  int index() const {
+    return current().pool == this ? current().index : -1;
+  }
+
+  // Take our newest task, or steal the oldest one from another queue.
+  bool pop(int self, task_t &task) {
+    size_t n = queues_.size();
+    size_t start = self >= 0 ? (size_t)self : 0;
+    for (size_t i = 0; i != n; ++i) {
+      queue &q = queues_[(start + i) % n];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (q.tasks.empty()) continue;
+      if (i == 0 && self >= 0) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+      std::lock_guard<std::mutex> count_lock(mutex_);
+      --pending_;
+      return true;
+    }
+    return false;
+  }
+
+  void work(int index) {
+    current() = worker_id{ this, index };
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return pending_ != 0 || stop_; });
+        if (stop_) return;
+      }
+      runOne();
+    }
+  }
+
+  std::vector<queue> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> next_queue_{0};
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  size_t pending_ = 0;
+  bool stop_ = false;
+};
+
+namespace detail {
+  // Shared by the threads running one parallel loop. Each thread owns a range
+  // packed into 64 bits (start << 32 | end) so that the owner can take a chunk
+  // from the front and a thief can take half from the back with one CAS.
+  struct parallel_loop {
+    struct alignas(64) range {
+      std::atomic<uint64_t> value;
+    };
+
+    std::vector<range> ranges;
+    std::function<void(int, int)> fn;
+    int begin = 0;
+    int grain = 1;
+    std::atomic<int> active{0};
+    std::atomic<bool> failed{false};
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+
+    parallel_loop(int begin_, int end_, int grain_, unsigned num_threads) : ranges(num_threads), begin(begin_), grain(grain_) {
+      uint64_t n = (uint64_t)(end_ - begin_);
+      for (unsigned i = 0; i != num_threads; ++i) {
+        uint64_t lo = n * i / num_threads, hi = n * (i + 1) / num_threads;
+        ranges[i].value = lo << 32 | hi;
+      }
+    }
+
+    // Take up to grain items from the front of range r.
+    bool take(size_t r, uint32_t &lo, uint32_t &hi) {
+      uint64_t v = ranges[r].value.load();
+      for (;;) {
+        lo = (uint32_t)(v >> 32);
+        uint32_t end = (uint32_t)v;
+        if (lo >= end) return false;
+        hi = std::min(end, lo + (uint32_t)grain);
+        if (ranges[r].value.compare_exchange_weak(v, (uint64_t)hi << 32 | end)) return true;
+      }
+    }
+
+    // Move the back half of another range into range r.
+    bool steal(size_t r) {
+      for (size_t i = 1; i != ranges.size(); ++i) {
+        size_t victim = (r + i) % ranges.size();
+        uint64_t v = ranges[victim].value.load();
+        for (;;) {
+          uint32_t lo = (uint32_t)(v >> 32), hi = (uint32_t)v;
+          if (lo >= hi) break;
+          uint32_t mid = lo + (hi - lo) / 2;
+          if (ranges[victim].value.compare_exchange_weak(v, (uint64_t)lo << 32 | mid)) {
+            ranges[r].value = (uint64_t)mid << 32 | hi;
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    // Run chunks until there is nothing left to take or steal.
+    void run(size_t r) {
+      uint32_t lo, hi;
+      for (;;) {
+        while (take(r, lo, hi)) {
+          if (failed) continue;
+          try {
+            fn(begin + (int)lo, begin + (int)hi);
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = std::current_exception();
+            failed = true;
+          }
+        }
+        if (!steal(r)) return;
+      }
+    }
+  };
+}
+
+// Call fn(lo, hi) on chunks of at most grain items covering [begin, end)
+// using up to num_threads threads of the global pool, including the caller.
+// num_threads == 0 uses all of them. Each thread starts with an equal share
+// of the range and steals half of another share when it runs out.
+// Exceptions are passed on to the caller.
+template <class F>
+void parallel_for_range(int begin, int end, int grain, F fn, unsigned num_threads = 0) {
+  if (grain < 1) grain = 1;
+  thread_pool &pool = thread_pool::global();
+  unsigned max_threads = pool.numWorkers() + 1;
+  if (num_threads == 0 || num_threads > max_threads) num_threads = max_threads;
+  int num_chunks = end > begin ? (end - begin + grain - 1) / grain : 0;
+  if (num_chunks < (int)num_threads) num_threads = (unsigned)std::max(num_chunks, 1);
+
+  if (num_threads <= 1) {
+    for (int i = begin; i < end; i += grain) fn(i, std::min(i + grain, end));
+    return;
+  }
+
+  // Helpers that start after the loop has finished find nothing to do,
+  // so the loop state is shared with them.
+  auto loop = std::make_shared<detail::parallel_loop>(begin, end, grain, num_threads);
+  loop->fn = std::ref(fn);
+  for (unsigned r = 1; r != num_threads; ++r) {
+    pool.submit([loop, r]() {
+      ++loop->active;
+      loop->run(r);
+      if (--loop->active == 0) {
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        loop->done.notify_all();
+      }
+    });
+  }
+
+  loop->run(0);
+  {
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->done.wait(lock, [&loop]() { return loop->active == 0; });
+  }
+  if (loop->error) std::rethrow_exception(loop->error);
+}
+
+// Call fn(i) for every i in [begin, end) using up to num_threads threads.
+// num_threads == 0 uses one thread per core. Items are handed out one at a time
+// so each call of fn should do a reasonable amount of work (eg. a slice of a volume).
+// The calling thread also does work and exceptions are passed on to the caller.
+template <class F>
+void parallel_for(int begin, int end, F fn, unsigned num_threads = 0) {
+  parallel_for_range(begin, end, 1, [&fn](int lo, int hi) {
+    for (int i = lo; i != hi; ++i) fn(i);
+  }, num_threads);
+}
+
+// Call fn(x, y, z) for every point of an xdim * ydim * zdim grid.
+// Rows of x are handed out in chunks of about grain points.
+template <class F>
+void parallel_for_3d(int xdim, int ydim, int zdim, F fn, unsigned num_threads = 0, int grain = 4096) {
+  if (xdim <= 0) return;
+  int rows = std::max(1, grain / xdim);
+  parallel_for_range(0, ydim * zdim, rows, [&fn, xdim, ydim](int lo, int hi) {
+    for (int row = lo; row != hi; ++row) {
+      int y = row % ydim, z = row / ydim;
+      for (int x = 0; x != xdim; ++x) fn(x, y, z);
+    }
+  }, num_threads);
+}
+
+// A set of tasks with dependencies, run on the global pool.
+// A task starts when all the tasks it depends on have finished.
+class task_graph {
+public:
+  // Add a task that runs after the tasks in deps, which must already be in the graph.
+  // Returns the id to use in the deps of later tasks.
+  int add(std::function<void()> fn, std::initializer_list<int> deps = {}) {
+    int id = (int)tasks_.size();
+    tasks_.emplace_back();
+    tasks_.back().fn = std::move(fn);
+    for (int d : deps) {
+      tasks_[d].successors.push_back(id);
+      tasks_.back().num_deps++;
+    }
+    return id;
+  }
+
+  size_t size() const { return tasks_.size(); }
+
+  // Run every task and wait for them to finish. The calling thread also runs tasks.
+  // If a task throws, the tasks that have not started are skipped and the
+  // first exception is passed on to the caller.
+  void run() {
+    thread_pool &pool = thread_pool::global();
+    state s;
+    s.remaining = (int)tasks_.size();
+    s.pending.reset(new std::atomic<int>[tasks_.size()]);
+    for (size_t i = 0; i != tasks_.size(); ++i) {
+      s.pending[i] = tasks_[i].num_deps;
+    }
+    for (size_t i = 0; i != tasks_.size(); ++i) {
+      if (tasks_[i].num_deps == 0) start(pool, s, (int)i);
+    }
+    while (s.remaining != 0) {
+      if (!pool.runOne()) std::this_thread::yield();
+    }
+    if (s.error) std::rethrow_exception(s.error);
+  }
+
+private:
+  struct node {
+    std::function<void()> fn;
+    std::vector<int> successors;
+    int num_deps = 0;
+  };
+
+  struct state {
+    std::unique_ptr<std::atomic<int>[]> pending;
+    std::atomic<int> remaining{0};
+    std::atomic<bool> failed{false};
+    std::mutex mutex;
+    std::exception_ptr error;
+  };
+
+  void start(thread_pool &pool, state &s, int id) {
+    pool.submit([this, &pool, &s, id]() {
+      if (!s.failed) {
+        try {
+          tasks_[id].fn();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(s.mutex);
+          if (!s.error) s.error = std::current_exception();
+          s.failed = true;
+        }
+      }
+      for (int next : tasks_[id].successors) {
+        if (--s.pending[next] == 0) start(pool, s, next);
+      }
+      --s.remaining;
+    });
+  }
+
+  std::vector<node> tasks_;
+};
+
+} // meshutils
+
+#endif
@@ -3,14 +3,21 @@
 // (C) Andy Thomason 2016
 //
 // meshutils: scene class: collection of meshes with a matrix heirachy
-// 
+//
 
 #ifndef MESHUTILS_SCENE_INCLUDED
 #define MESHUTILS_SCENE_INCLUDED
 
 #include <meshutils/mesh.hpp>
+#include <meshutils/parallel.hpp>
 #include <vector>
 #include <memory>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+#endif
 
 // Scene class. Note that the scene does not own its components.
 namespace meshutils {
@@ -31,6 +38,8 @@ namespace meshutils {
       return (int)result;
     }
 
+    // A node whose parent is negative or itself is a root.
+    // A mesh index of -1 is a node with no mesh.
     int addNode(const glm::mat4 &mat, int parent, int mesh) {
       size_t result = transforms_.size();
       transforms_.emplace_back(mat);
@@ -39,6 +48,154 @@ namespace meshutils {
       return (int)result;
     }
 
+    // Parent of a node, or -1 for a root.
+    int parent(int node) const {
+      int p = parent_transforms_[node];
+      return p == node ? -1 : p;
+    }
+
+    // The nodes with every parent before its children.
+    // Nodes are sorted by depth, keeping the order of nodes at the same depth.
+    std::vector<int> topologicalOrder() const {
+      int n = (int)parent_transforms_.size();
+      enum { unknown = -1, visiting = -2 };
+      std::vector<int> depth(n, unknown);
+      std::vector<int> stack;
+      int max_depth = 0;
+      for (int i = 0; i != n; ++i) {
+        // walk up to a root or a node of known depth, then fill in the depths on the way down.
+        int d = 0;
+        for (int j = i; depth[j] == unknown; ) {
+          depth[j] = visiting;
+          stack.push_back(j);
+          int p = parent(j);
+          if (p >= n) throw std::runtime_error("bad scene parent");
+          if (p < 0) { d = -1; break; }
+          if (depth[p] == visiting) throw std::runtime_error("cycle in scene hierarchy");
+          d = depth[p];
+          j = p;
+        }
+        if (depth[i] >= 0) continue;
+        while (!stack.empty()) {
+          depth[stack.back()] = ++d;
+          stack.pop_back();
+        }
+        max_depth = std::max(max_depth, d);
+      }
+
+      std::vector<int> first(max_depth + 2);
+      for (int i = 0; i != n; ++i) first[depth[i] + 1]++;
+      for (int d = 0; d != max_depth + 1; ++d) first[d + 1] += first[d];
+      std::vector<int> result(n);
+      for (int i = 0; i != n; ++i) result[first[depth[i]]++] = i;
+      return result;
+    }
+
+    // The transform of every node to world space: parent world * local.
+    void worldTransforms(std::vector<glm::mat4> &result) const {
+      result.resize(transforms_.size());
+      for (int i : topologicalOrder()) {
+        int p = parent(i);
+        result[i] = p < 0 ? transforms_[i] : multiply(result[p], transforms_[i]);
+      }
+    }
+
+    // a * b for column major matrices.
+    static glm::mat4 multiply(const glm::mat4 &a, const glm::mat4 &b) {
+      glm::mat4 result;
+      #if defined(__SSE2__) || defined(_M_X64)
+        __m128 a0 = _mm_loadu_ps(&a[0][0]), a1 = _mm_loadu_ps(&a[1][0]);
+        __m128 a2 = _mm_loadu_ps(&a[2][0]), a3 = _mm_loadu_ps(&a[3][0]);
+        for (int j = 0; j != 4; ++j) {
+          __m128 col = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(b[j][0])), _mm_mul_ps(a1, _mm_set1_ps(b[j][1]))),
+            _mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(b[j][2])), _mm_mul_ps(a3, _mm_set1_ps(b[j][3])))
+          );
+          _mm_storeu_ps(&result[j][0], col);
+        }
+      #else
+        result = a * b;
+      #endif
+      return result;
+    }
+
+    // Merge every node that has a mesh into one mesh in world space.
+    // The result is allocated once and the nodes are transformed in parallel,
+    // in chunks so that a single large mesh also uses all the threads.
+    template <class MeshTraits>
+    void bake(basic_mesh<MeshTraits> &result, unsigned num_threads = 0) const {
+      typedef typename MeshTraits::vertex_t vertex_t;
+      typedef typename MeshTraits::index_t index_t;
+
+      std::vector<glm::mat4> world;
+      worldTransforms(world);
+
+      struct instance {
+        int node;
+        size_t first_vertex;
+        size_t first_index;
+      };
+      std::vector<instance> instances;
+      size_t num_vertices = 0, num_indices = 0;
+      for (int i = 0; i != (int)mesh_indices_.size(); ++i) {
+        int m = mesh_indices_[i];
+        if (m < 0) continue;
+        if (m >= (int)meshes_.size()) throw std::runtime_error("bad scene mesh index");
+        instances.push_back(instance{ i, num_vertices, num_indices });
+        num_vertices += meshes_[m]->posView().count;
+        num_indices += meshes_[m]->indexView().count;
+      }
+      if (num_vertices > (size_t)std::numeric_limits<index_t>::max()) {
+        throw std::runtime_error("too many vertices in baked scene");
+      }
+
+      // chunks of at most chunk_size vertices or indices of one instance.
+      const size_t chunk_size = 0x10000;
+      struct chunk {
+        size_t instance;
+        size_t begin;
+        size_t end;
+        bool indices;
+      };
+      std::vector<chunk> chunks;
+      for (size_t k = 0; k != instances.size(); ++k) {
+        const mesh &m = *meshes_[mesh_indices_[instances[k].node]];
+        size_t nv = m.posView().count, ni = m.indexView().count;
+        for (size_t b = 0; b < nv; b += chunk_size) chunks.push_back(chunk{ k, b, std::min(b + chunk_size, nv), false });
+        for (size_t b = 0; b < ni; b += chunk_size) chunks.push_back(chunk{ k, b, std::min(b + chunk_size, ni), true });
+      }
+
+      std::vector<vertex_t> vertices(num_vertices);
+      std::vector<index_t> indices(num_indices);
+      parallel_for(0, (int)chunks.size(), [&](int c) {
+        const chunk &ch = chunks[c];
+        const instance &inst = instances[ch.instance];
+        const mesh &m = *meshes_[mesh_indices_[inst.node]];
+        if (ch.indices) {
+          attribute_view iv = m.indexView();
+          for (size_t i = ch.begin; i != ch.end; ++i) {
+            indices[inst.first_index + i] = (index_t)(inst.first_vertex + iv.u32(i));
+          }
+          return;
+        }
+
+        const glm::mat4 &mat = world[inst.node];
+        glm::mat4 normal_mat = glm::transpose(glm::inverse(mat));
+        attribute_view pos = m.posView(), normal = m.normalView(), uv = m.uvView(0), color = m.colorView();
+        for (size_t i = ch.begin; i != ch.end; ++i) {
+          glm::vec3 p = pos.get<glm::vec3>(i), n = normal.get<glm::vec3>(i);
+          glm::vec4 wp = mat * glm::vec4(p.x, p.y, p.z, 1.0f);
+          glm::vec4 wn = normal_mat * glm::vec4(n.x, n.y, n.z, 0.0f);
+          glm::vec3 n3(wn.x, wn.y, wn.z);
+          float len2 = glm::dot(n3, n3);
+          if (len2 > 0) n3 = n3 * (1.0f / std::sqrt(len2));
+          vertices[inst.first_vertex + i] = vertex_t(glm::vec3(wp.x, wp.y, wp.z), n3, uv.get<glm::vec2>(i), color.get<glm::vec4>(i));
+        }
+      }, num_threads);
+
+      result = basic_mesh<MeshTraits>(std::move(vertices), std::move(indices));
+    }
+
   private:
     std::vector<mesh *> meshes_;
     std::vector<glm::mat4> transforms_;
@@ -0,0 +1,229 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: Structure of Arrays mesh
+//
+// soa_mesh keeps each attribute of MeshTraits::layout_t in its own array, so
+// position only passes (bounds, transforms, welding, spatial indexing) read
+// contiguous floats and each attribute can be uploaded as a separate vertex buffer.
+// basic_mesh keeps whole vertices together for interleaved vertex buffers.
+// The two convert to each other.
+
+#ifndef MESHUTILS_SOA_MESH_INCLUDED
+#define MESHUTILS_SOA_MESH_INCLUDED
+
+#include <meshutils/mesh.hpp>
+#include <limits>
+
+namespace meshutils {
+
+template <class MeshTraits>
+class soa_mesh : public mesh {
+public:
+  typedef MeshTraits traits_t;
+  typedef typename MeshTraits::vertex_t vertex_t;
+  typedef typename MeshTraits::index_t index_t;
+  typedef typename MeshTraits::layout_t layout_t;
+
+  // empty soa_mesh
+  soa_mesh() : streams_(layout_t::num_attributes()) {
+  }
+
+  // Split the vertices of a basic_mesh into one array per attribute.
+  explicit soa_mesh(const basic_mesh<MeshTraits> &aos) : streams_(layout_t::num_attributes()) {
+    auto &vertices = aos.vertices();
+    num_vertices_ = vertices.size();
+    indices_ = aos.indices();
+    const attribute *a = layout_t::attributes();
+    for (size_t s = 0; s != streams_.size(); ++s) {
+      size_t size = a[s].number_of_channels * attribute_type_size(a[s].type);
+      streams_[s].resize(num_vertices_ * size);
+      const uint8_t *src = (const uint8_t *)vertices.data() + a[s].offset;
+      uint8_t *dest = streams_[s].data();
+      for (size_t i = 0; i != num_vertices_; ++i) {
+        memcpy(dest + i * size, src + i * sizeof(vertex_t), size);
+      }
+    }
+  }
+
+  // Interleave the attributes into a basic_mesh.
+  void toBasicMesh(basic_mesh<MeshTraits> &result) const {
+    std::vector<vertex_t> vertices(num_vertices_);
+    const attribute *a = layout_t::attributes();
+    for (size_t s = 0; s != streams_.size(); ++s) {
+      size_t size = a[s].number_of_channels * attribute_type_size(a[s].type);
+      const uint8_t *src = streams_[s].data();
+      uint8_t *dest = (uint8_t *)vertices.data() + a[s].offset;
+      for (size_t i = 0; i != num_vertices_; ++i) {
+        memcpy(dest + i * sizeof(vertex_t), src + i * size, size);
+      }
+    }
+    std::vector<index_t> indices = indices_;
+    result = basic_mesh<MeshTraits>(std::move(vertices), std::move(indices));
+  }
+
+  size_t numVertices() const { return num_vertices_; }
+  const std::vector<index_t> &indices() const { return indices_; }
+
+  // The array of attribute i of layout_t::attributes().
+  const std::vector<uint8_t> &stream(size_t i) const { return streams_[i]; }
+
+  // The positions as 3 * numVertices() floats.
+  const float *positions() const { return (const float *)posView().data; }
+
+  // The smallest box containing the positions.
+  // Four vertices are twelve floats, which is three SSE registers with the
+  // components in a repeating xyzx yzxy zxyz pattern.
+  void bounds(glm::vec3 &min, glm::vec3 &max) const {
+    float big = std::numeric_limits<float>::max();
+    min = glm::vec3(big);
+    max = glm::vec3(-big);
+    const float *p = positions();
+    size_t i = 0;
+    #if defined(__SSE2__) || defined(_M_X64)
+      if (num_vertices_ >= 4) {
+        __m128 min0 = _mm_loadu_ps(p), min1 = _mm_loadu_ps(p + 4), min2 = _mm_loadu_ps(p + 8);
+        __m128 max0 = min0, max1 = min1, max2 = min2;
+        for (i = 4; i + 4 <= num_vertices_; i += 4) {
+          const float *q = p + i * 3;
+          __m128 v0 = _mm_loadu_ps(q), v1 = _mm_loadu_ps(q + 4), v2 = _mm_loadu_ps(q + 8);
+          min0 = _mm_min_ps(min0, v0); min1 = _mm_min_ps(min1, v1); min2 = _mm_min_ps(min2, v2);
+          max0 = _mm_max_ps(max0, v0); max1 = _mm_max_ps(max1, v1); max2 = _mm_max_ps(max2, v2);
+        }
+        float lo[12], hi[12];
+        _mm_storeu_ps(lo, min0); _mm_storeu_ps(lo + 4, min1); _mm_storeu_ps(lo + 8, min2);
+        _mm_storeu_ps(hi, max0); _mm_storeu_ps(hi + 4, max1); _mm_storeu_ps(hi + 8, max2);
+        for (int k = 0; k != 12; ++k) {
+          min[k % 3] = std::min(min[k % 3], lo[k]);
+          max[k % 3] = std::max(max[k % 3], hi[k]);
+        }
+      }
+    #endif
+    for (; i != num_vertices_; ++i) {
+      for (int k = 0; k != 3; ++k) {
+        min[k] = std::min(min[k], p[i * 3 + k]);
+        max[k] = std::max(max[k], p[i * 3 + k]);
+      }
+    }
+  }
+
+  // Transform the positions and normals in place.
+  void transform(const glm::mat4 &mat) {
+    glm::vec3 *pos = stream<pos_attribute, glm::vec3>();
+    for (size_t i = 0; pos && i != num_vertices_; ++i) {
+      glm::vec4 p = mat * glm::vec4(pos[i].x, pos[i].y, pos[i].z, 1.0f);
+      pos[i] = glm::vec3(p.x, p.y, p.z);
+    }
+
+    glm::vec3 *normal = stream<normal_attribute, glm::vec3>();
+    if (normal) {
+      glm::mat4 normal_mat = glm::transpose(glm::inverse(mat));
+      for (size_t i = 0; i != num_vertices_; ++i) {
+        glm::vec4 n = normal_mat * glm::vec4(normal[i].x, normal[i].y, normal[i].z, 0.0f);
+        normal[i] = glm::normalize(glm::vec3(n.x, n.y, n.z));
+      }
+    }
+  }
+
+  // mesh virtual methods
+  std::vector<glm::vec3> pos() const override { return copy<glm::vec3>(posView()); }
+  std::vector<glm::vec3> normal() const override { return copy<glm::vec3>(normalView()); }
+  std::vector<glm::vec2> uv(int index) const override { return index == 0 ? copy<glm::vec2>(uvView(0)) : std::vector<glm::vec2>(); }
+  std::vector<glm::vec4> color() const override { return copy<glm::vec4>(colorView()); }
+
+  std::vector<uint32_t> indices32() const override {
+    return std::vector<uint32_t>(indices_.begin(), indices_.end());
+  }
+
+  attribute_view posView() const override {
+    static const glm::vec3 value(0, 0, 0);
+    return view<pos_attribute>(&value, 3);
+  }
+
+  attribute_view normalView() const override {
+    static const glm::vec3 value(1, 0, 0);
+    return view<normal_attribute>(&value, 3);
+  }
+
+  attribute_view uvView(int index) const override {
+    static const glm::vec2 value(0, 0);
+    return index == 0 ? view<uv_attribute>(&value, 2) : view<void>(&value, 2);
+  }
+
+  attribute_view colorView() const override {
+    static const glm::vec4 value(1, 1, 1, 1);
+    return view<color_attribute>(&value, 4);
+  }
+
+  attribute_view indexView() const override {
+    attribute_view result;
+    result.data = (const uint8_t *)indices_.data();
+    result.stride = sizeof(index_t);
+    result.count = indices_.size();
+    result.components = 1;
+    result.type = sizeof(index_t) == 1 ? 'B' : sizeof(index_t) == 2 ? 'H' : 'I';
+    return result;
+  }
+
+  const char *getFormat() const {
+    return MeshTraits::getFormat();
+  }
+
+private:
+  // Index in streams_ of the attribute called Name, or -1.
+  template <class Name>
+  static int streamIndex() {
+    int offset = layout_t::template offset<Name>();
+    const attribute *a = layout_t::attributes();
+    for (int s = 0; a[s].name; ++s) {
+      if (offset >= 0 && a[s].offset == (size_t)offset) return s;
+    }
+    return -1;
+  }
+
+  template <class Name, class T>
+  T *stream() {
+    int s = streamIndex<Name>();
+    return s < 0 ? nullptr : (T *)streams_[s].data();
+  }
+
+  template <class Name>
+  attribute_view view(const void *default_value, int components) const {
+    int s = streamIndex<Name>();
+    attribute_view result;
+    result.count = num_vertices_;
+    result.type = 'f';
+    result.components = components;
+    if (s < 0) {
+      result.data = (const uint8_t *)default_value;
+    } else {
+      result.components = layout_t::template channels<Name>();
+      result.data = streams_[s].data();
+      result.stride = result.components * sizeof(float);
+    }
+    return result;
+  }
+
+  template <class T>
+  static std::vector<T> copy(const attribute_view &view) {
+    std::vector<T> result;
+    result.reserve(view.count);
+    for (size_t i = 0; i != view.count; ++i) {
+      result.push_back(view.get<T>(i));
+    }
+    return result;
+  }
+
+  std::vector<std::vector<uint8_t>> streams_;
+  std::vector<index_t> indices_;
+  size_t num_vertices_ = 0;
+};
+
+typedef soa_mesh<pos_mesh_traits> pos_soa_mesh;
+typedef soa_mesh<simple_mesh_traits> simple_soa_mesh;
+typedef soa_mesh<color_mesh_traits> color_soa_mesh;
+
+} // meshutils
+
+#endif
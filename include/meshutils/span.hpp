@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: non-owning view of a contiguous array
+//
+// A minimal stand in for std::span, which is not available in C++14.
+
+#ifndef MESHUTILS_SPAN_INCLUDED
+#define MESHUTILS_SPAN_INCLUDED
+
+#include <cstddef>
+#include <vector>
+
+namespace meshutils {
+
+template <class T>
+class span {
+public:
+  span() {
+  }
+
+  span(T *begin, T *end) : begin_(begin), end_(end) {
+  }
+
+  span(T *data, size_t size) : begin_(data), end_(data + size) {
+  }
+
+  template <class U>
+  span(const std::vector<U> &v) : begin_(v.data()), end_(v.data() + v.size()) {
+  }
+
+  template <class U>
+  span(std::vector<U> &v) : begin_(v.data()), end_(v.data() + v.size()) {
+  }
+
+  T *begin() const { return begin_; }
+  T *end() const { return end_; }
+  T *data() const { return begin_; }
+  size_t size() const { return (size_t)(end_ - begin_); }
+  bool empty() const { return begin_ == end_; }
+  T &operator[](size_t i) const { return begin_[i]; }
+
+  // Elements [offset, offset+count).
+  span subspan(size_t offset, size_t count) const { return span(begin_ + offset, count); }
+
+private:
+  T *begin_ = nullptr;
+  T *end_ = nullptr;
+};
+
+} // meshutils
+
+#endif
@@ -0,0 +1,154 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: uniform grid for radius-bounded point queries
+//
+// Points (eg. atoms or vertices) are bucketed into cubic cells with a counting sort
+// so a query only visits the cells that overlap the query sphere.
+// For spheres of varying radius, query with the search radius plus the largest radius.
+
+#ifndef MESHUTILS_SPATIAL_GRID_INCLUDED
+#define MESHUTILS_SPATIAL_GRID_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+namespace meshutils {
+
+class spatial_grid {
+public:
+  spatial_grid() {
+  }
+
+  // Build a grid of cells of size cell_size containing num_points points.
+  // The order of points within each cell is the order they were given.
+  spatial_grid(const glm::vec3 *pos, size_t num_points, float cell_size) {
+    if (num_points == 0 || !(cell_size > 0)) return;
+
+    min_ = max_ = pos[0];
+    for (size_t i = 0; i != num_points; ++i) {
+      min_ = glm::min(min_, pos[i]);
+      max_ = glm::max(max_, pos[i]);
+    }
+
+    // Limit the number of cells to a few per point so that sparse point sets do not use too much memory.
+    glm::vec3 extent = max_ - min_;
+    double max_cells = (double)num_points * 8 + 64;
+    for (;;) {
+      double cells = 1;
+      for (int c = 0; c != 3; ++c) {
+        cells *= std::floor(extent[c] / cell_size) + 1;
+      }
+      if (cells <= max_cells) break;
+      cell_size *= 1.25f;
+    }
+
+    recip_cell_size_ = 1.0f / cell_size;
+    for (int c = 0; c != 3; ++c) {
+      dim_[c] = (int)(extent[c] * recip_cell_size_) + 1;
+    }
+
+    // counting sort of the point indices by cell.
+    std::vector<uint32_t> point_cells(num_points);
+    cell_start_.assign((size_t)dim_[0] * dim_[1] * dim_[2] + 1, 0);
+    for (size_t i = 0; i != num_points; ++i) {
+      size_t cell = cellIndex(cellCoord(pos[i], 0), cellCoord(pos[i], 1), cellCoord(pos[i], 2));
+      point_cells[i] = (uint32_t)cell;
+      cell_start_[cell+1]++;
+    }
+    for (size_t c = 1; c != cell_start_.size(); ++c) {
+      cell_start_[c] += cell_start_[c-1];
+    }
+
+    std::vector<uint32_t> next(cell_start_.begin(), cell_start_.end() - 1);
+    points_.resize(num_points);
+    indices_.resize(num_points);
+    for (size_t i = 0; i != num_points; ++i) {
+      uint32_t dest = next[point_cells[i]]++;
+      points_[dest] = pos[i];
+      indices_[dest] = (uint32_t)i;
+    }
+  }
+
+  // Call fn(index) for every point in a cell that overlaps the box [min, max].
+  // This may include points outside the box.
+  template <class F>
+  void forEachInBox(const glm::vec3 &min, const glm::vec3 &max, F fn) const {
+    if (points_.empty()) return;
+    int lo[3], hi[3];
+    for (int c = 0; c != 3; ++c) {
+      if (max[c] < min_[c] || min[c] > max_[c]) return;
+      lo[c] = cellCoord(min, c);
+      hi[c] = cellCoord(max, c);
+    }
+    for (int z = lo[2]; z <= hi[2]; ++z) {
+      for (int y = lo[1]; y <= hi[1]; ++y) {
+        size_t b = cell_start_[cellIndex(lo[0], y, z)];
+        size_t e = cell_start_[cellIndex(hi[0], y, z) + 1];
+        for (size_t i = b; i != e; ++i) {
+          fn((size_t)indices_[i]);
+        }
+      }
+    }
+  }
+
+  // Call fn(index, d2) for every point within radius of pos where d2 is the squared distance.
+  template <class F>
+  void forEachWithin(const glm::vec3 &pos, float radius, F fn) const {
+    if (points_.empty()) return;
+    float r2 = radius * radius;
+    int lo[3], hi[3];
+    for (int c = 0; c != 3; ++c) {
+      if (pos[c] + radius < min_[c] || pos[c] - radius > max_[c]) return;
+      lo[c] = cellCoordClamped(pos[c] - radius, c);
+      hi[c] = cellCoordClamped(pos[c] + radius, c);
+    }
+    for (int z = lo[2]; z <= hi[2]; ++z) {
+      for (int y = lo[1]; y <= hi[1]; ++y) {
+        // cells in a row are contiguous.
+        size_t b = cell_start_[cellIndex(lo[0], y, z)];
+        size_t e = cell_start_[cellIndex(hi[0], y, z) + 1];
+        for (size_t i = b; i != e; ++i) {
+          glm::vec3 d = pos - points_[i];
+          float d2 = glm::dot(d, d);
+          if (d2 <= r2) {
+            fn((size_t)indices_[i], d2);
+          }
+        }
+      }
+    }
+  }
+
+  size_t size() const { return points_.size(); }
+  bool empty() const { return points_.empty(); }
+
+private:
+  int cellCoord(const glm::vec3 &pos, int c) const {
+    return cellCoordClamped(pos[c], c);
+  }
+
+  int cellCoordClamped(float value, int c) const {
+    int i = (int)std::floor((value - min_[c]) * recip_cell_size_);
+    return std::max(0, std::min(i, dim_[c] - 1));
+  }
+
+  size_t cellIndex(int x, int y, int z) const {
+    return ((size_t)z * dim_[1] + y) * dim_[0] + x;
+  }
+
+  glm::vec3 min_;
+  glm::vec3 max_;
+  float recip_cell_size_ = 1;
+  int dim_[3] = { 0, 0, 0 };
+  std::vector<uint32_t> cell_start_;
+  std::vector<glm::vec3> points_;
+  std::vector<uint32_t> indices_;
+};
+
+} // meshutils
+
+#endif
@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: phase timings and counters
+//
+// Decoders and encoders report to a stats_sink set with setStats(). With no sink
+// the cost is a null pointer test per phase; defining MESHUTILS_NO_STATS removes
+// even that. stats_recorder is a sink which adds everything up for a report.
+
+#ifndef MESHUTILS_STATS_INCLUDED
+#define MESHUTILS_STATS_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+namespace meshutils {
+
+class stats_sink {
+public:
+  virtual ~stats_sink() {
+  }
+
+  // A phase such as "fbx_decoder.inflate" took seconds.
+  virtual void phase(const char *name, double seconds) = 0;
+
+  // Add value to a counter such as "fbx_decoder.bytes".
+  virtual void count(const char *name, uint64_t value) = 0;
+};
+
+// Totals of every phase and counter. Safe to share between threads.
+class stats_recorder : public stats_sink {
+public:
+  struct entry {
+    std::string name;
+    uint64_t calls;
+    double seconds;  // phases only
+    uint64_t value;  // counters only
+  };
+
+  void phase(const char *name, double seconds) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry &e = find(phases_, phase_index_, name);
+    e.calls++;
+    e.seconds += seconds;
+  }
+
+  void count(const char *name, uint64_t value) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry &e = find(counters_, counter_index_, name);
+    e.calls++;
+    e.value += value;
+  }
+
+  // Phases and counters in order of first use.
+  std::vector<entry> phases() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return phases_;
+  }
+
+  std::vector<entry> counters() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return counters_;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    phases_.clear();
+    counters_.clear();
+    phase_index_.clear();
+    counter_index_.clear();
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const stats_recorder &stats) {
+    for (const entry &e : stats.phases()) {
+      os << e.name << ": " << e.seconds * 1e3 << "ms in " << e.calls << " calls\n";
+    }
+    for (const entry &e : stats.counters()) {
+      os << e.name << ": " << e.value << "\n";
+    }
+    return os;
+  }
+
+private:
+  static entry &find(std::vector<entry> &entries, std::map<std::string, size_t> &index, const char *name) {
+    auto p = index.find(name);
+    if (p != index.end()) return entries[p->second];
+    index[name] = entries.size();
+    entries.push_back(entry{ name, 0, 0, 0 });
+    return entries.back();
+  }
+
+  mutable std::mutex mutex_;
+  std::vector<entry> phases_;
+  std::vector<entry> counters_;
+  std::map<std::string, size_t> phase_index_;
+  std::map<std::string, size_t> counter_index_;
+};
+
+#ifndef MESHUTILS_NO_STATS
+  // Time a scope and report it to sink. Does nothing if sink is null.
+  class scoped_phase {
+  public:
+    scoped_phase(stats_sink *sink, const char *name) : sink_(sink), name_(name) {
+      if (sink_) start_ = std::chrono::steady_clock::now();
+    }
+
+    ~scoped_phase() {
+      if (sink_) sink_->phase(name_, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count());
+    }
+
+    scoped_phase(const scoped_phase &) = delete;
+    scoped_phase &operator=(const scoped_phase &) = delete;
+  private:
+    stats_sink *sink_;
+    const char *name_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  inline void stats_count(stats_sink *sink, const char *name, uint64_t value) {
+    if (sink) sink->count(name, value);
+  }
+#else
+  class scoped_phase {
+  public:
+    scoped_phase(stats_sink *, const char *) {
+    }
+  };
+
+  inline void stats_count(stats_sink *, const char *, uint64_t) {
+  }
+#endif
+
+} // meshutils
+
+#endif
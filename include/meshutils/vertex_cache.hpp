@@ -0,0 +1,200 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: triangle and vertex ordering for GPUs
+//
+// acmr() measures the average number of vertices shaded per triangle with a
+// FIFO post transform cache. optimize_vertex_cache() reorders triangles with
+// Tipsify (Sander, Nehab and Barczak 2007) in linear time.
+// optimize_overdraw() then sorts the clusters Tipsify makes so that outward
+// facing parts of the mesh draw first, and optimize_vertex_fetch() puts the
+// vertices in order of first use.
+
+#ifndef MESHUTILS_VERTEX_CACHE_INCLUDED
+#define MESHUTILS_VERTEX_CACHE_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <meshutils/arena.hpp>
+
+namespace meshutils {
+
+// Average cache misses (vertex shader runs) per triangle with a FIFO cache of cache_size entries.
+// 3 is the worst case, about 0.5 is the best possible for a large regular mesh.
+template <class Index>
+float acmr(const Index *indices, size_t num_indices, size_t num_vertices, unsigned cache_size = 16) {
+  if (num_indices < 3) return 0;
+  // a vertex is in the cache if it was loaded in the last cache_size misses.
+  std::vector<uint32_t> loaded(num_vertices, 0);
+  uint32_t misses = 0;
+  for (size_t i = 0; i != num_indices; ++i) {
+    Index v = indices[i];
+    if (loaded[v] == 0 || misses - loaded[v] >= cache_size) {
+      loaded[v] = ++misses;
+    }
+  }
+  return (float)misses / (float)(num_indices / 3);
+}
+
+// Reorder the triangles of an indexed mesh for a cache of cache_size vertices.
+// Triangles keep their winding. The first index of each cluster, a run of triangles
+// started from a cold cache, is added to clusters if it is not null.
+template <class Index>
+void optimize_vertex_cache(Index *indices, size_t num_indices, size_t num_vertices, unsigned cache_size = 16, std::vector<uint32_t> *clusters = nullptr) {
+  size_t num_triangles = num_indices / 3;
+  if (num_triangles == 0) return;
+
+  // triangles of each vertex, built with a counting sort.
+  std::vector<uint32_t> first(num_vertices + 1, 0);
+  for (size_t i = 0; i != num_triangles * 3; ++i) first[indices[i] + 1]++;
+  for (size_t v = 0; v != num_vertices; ++v) first[v + 1] += first[v];
+  std::vector<uint32_t> tris(num_triangles * 3);
+  std::vector<uint32_t> live(num_vertices);
+  {
+    std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+    for (size_t i = 0; i != num_triangles * 3; ++i) tris[fill[indices[i]]++] = (uint32_t)(i / 3);
+    for (size_t v = 0; v != num_vertices; ++v) live[v] = first[v + 1] - first[v];
+  }
+
+  std::vector<Index> result;
+  result.reserve(num_triangles * 3);
+  std::vector<uint8_t> emitted(num_triangles);
+  std::vector<uint32_t> time_stamp(num_vertices, 0);
+  std::vector<uint32_t> dead_end;
+  std::vector<uint32_t> candidates;
+  uint32_t now = cache_size + 1;
+  size_t cursor = 0;
+
+  // next vertex with live triangles from the dead end stack or in input order.
+  auto skip_dead_end = [&]() -> int64_t {
+    while (!dead_end.empty()) {
+      uint32_t d = dead_end.back();
+      dead_end.pop_back();
+      if (live[d]) return d;
+    }
+    for (; cursor != num_vertices; ++cursor) {
+      if (live[cursor]) return (int64_t)cursor;
+    }
+    return -1;
+  };
+
+  int64_t fan = skip_dead_end();
+  bool cold = true;
+  while (fan >= 0) {
+    if (cold && clusters) clusters->push_back((uint32_t)result.size());
+
+    // emit all the remaining triangles around the fanning vertex.
+    candidates.clear();
+    for (uint32_t k = first[fan]; k != first[fan + 1]; ++k) {
+      uint32_t t = tris[k];
+      if (emitted[t]) continue;
+      emitted[t] = 1;
+      for (int j = 0; j != 3; ++j) {
+        Index v = indices[t * 3 + j];
+        result.push_back(v);
+        dead_end.push_back((uint32_t)v);
+        candidates.push_back((uint32_t)v);
+        live[v]--;
+        if (now - time_stamp[v] > cache_size) time_stamp[v] = now++;
+      }
+    }
+
+    // the candidate that will still be in the cache after its triangles are
+    // emitted and has been there longest, otherwise a dead end. As in Tipsify,
+    // candidates that would fall out of the cache score 0 and are never chosen.
+    int64_t best = -1;
+    int64_t best_priority = 0;
+    for (uint32_t v : candidates) {
+      if (!live[v]) continue;
+      int64_t priority = 0;
+      if (now - time_stamp[v] + 2 * live[v] <= cache_size) priority = now - time_stamp[v];
+      if (priority > best_priority) {
+        best_priority = priority;
+        best = v;
+      }
+    }
+    cold = best < 0;
+    fan = best >= 0 ? best : skip_dead_end();
+  }
+
+  std::copy(result.begin(), result.end(), indices);
+}
+
+// Sort the clusters from optimize_vertex_cache() so that the ones facing away from the
+// middle of the mesh are drawn first, which hides more of the later ones.
+// pos(v) gives the position of vertex v.
+template <class Index, class Position>
+void optimize_overdraw(Index *indices, size_t num_indices, const std::vector<uint32_t> &clusters, Position pos) {
+  struct cluster {
+    uint32_t begin;
+    uint32_t end;
+    float key;
+  };
+
+  size_t num_triangles = num_indices / 3;
+  if (clusters.size() <= 1) return;
+
+  glm::vec3 middle(0.0f);
+  float total_area = 0;
+  std::vector<cluster> order;
+  std::vector<glm::vec3> centroid(clusters.size(), glm::vec3(0.0f)), normal(clusters.size(), glm::vec3(0.0f));
+  std::vector<float> area(clusters.size(), 0.0f);
+  for (size_t c = 0; c != clusters.size(); ++c) {
+    uint32_t end = c + 1 == clusters.size() ? (uint32_t)(num_triangles * 3) : clusters[c + 1];
+    order.push_back(cluster{ clusters[c], end, 0 });
+    for (uint32_t i = clusters[c]; i != end; i += 3) {
+      glm::vec3 p0 = pos(indices[i]), p1 = pos(indices[i+1]), p2 = pos(indices[i+2]);
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      float a = std::sqrt(glm::dot(n, n));
+      centroid[c] += (p0 + p1 + p2) * (a / 3.0f);
+      normal[c] += n;
+      area[c] += a;
+    }
+    middle += centroid[c];
+    total_area += area[c];
+  }
+  if (total_area <= 0) return;
+  middle = middle * (1.0f / total_area);
+
+  for (size_t c = 0; c != clusters.size(); ++c) {
+    if (area[c] <= 0) continue;
+    glm::vec3 d = centroid[c] * (1.0f / area[c]) - middle;
+    float len = std::sqrt(glm::dot(normal[c], normal[c]));
+    order[c].key = len > 0 ? glm::dot(d, normal[c]) / len : 0;
+  }
+  std::stable_sort(order.begin(), order.end(), [](const cluster &a, const cluster &b) { return a.key > b.key; });
+
+  std::vector<Index> result;
+  result.reserve(num_triangles * 3);
+  for (const cluster &c : order) result.insert(result.end(), indices + c.begin, indices + c.end);
+  std::copy(result.begin(), result.end(), indices);
+}
+
+// Put the vertices in order of first use by indices so that vertex fetches go forwards
+// through memory. Unused vertices go at the end.
+template <class Vertex, class VertexAlloc, class Index, class IndexAlloc>
+void optimize_vertex_fetch(std::vector<Vertex, VertexAlloc> &vertices, std::vector<Index, IndexAlloc> &indices) {
+  const uint32_t unused = ~0u;
+  std::vector<uint32_t> remap(vertices.size(), unused);
+  std::vector<Vertex> result;
+  result.reserve(vertices.size());
+  for (auto &i : indices) {
+    if (remap[i] == unused) {
+      remap[i] = (uint32_t)result.size();
+      result.push_back(vertices[i]);
+    }
+    i = (Index)remap[i];
+  }
+  for (size_t v = 0; v != vertices.size(); ++v) {
+    if (remap[v] == unused) result.push_back(vertices[v]);
+  }
+  replace_contents(vertices, result);
+}
+
+} // meshutils
+
+#endif
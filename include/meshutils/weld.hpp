@@ -0,0 +1,258 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// meshutils: vertex welding
+//
+// Removes duplicate values (positions, colours or whole vertices) and builds
+// an index for the original values.
+//
+// weld() uses an open addressing hash table and keeps the unique values in order
+// of first use. weld_quantized() also merges values whose positions round to the
+// same multiple of epsilon. weld_sorted() sorts the values with memcmp and gives
+// a canonical order at O(n log n) cost.
+
+#ifndef MESHUTILS_WELD_INCLUDED
+#define MESHUTILS_WELD_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+#include <meshutils/parallel.hpp>
+
+namespace meshutils {
+
+// How to read and write the position of a value for weld_quantized().
+template <class ValueType>
+struct weld_position {
+  static glm::vec3 get(const ValueType &value) { return value.pos(); }
+  static void set(ValueType &value, const glm::vec3 &pos) { value.pos(pos); }
+};
+
+template <>
+struct weld_position<glm::vec3> {
+  static glm::vec3 get(const glm::vec3 &value) { return value; }
+  static void set(glm::vec3 &value, const glm::vec3 &pos) { value = pos; }
+};
+
+// Hash set of the values[i] which have unique keys. values[i] is stride bytes after values[i-1].
+// Slots hold an index into firsts(), the first value with each key, so keys are
+// recalculated when compared and the values are never copied.
+template <class ValueType, class KeyFn>
+class weld_table {
+public:
+  weld_table(const ValueType *values, size_t stride, KeyFn key_fn, size_t expected) : values_((const uint8_t *)values), stride_(stride), key_fn_(key_fn) {
+    size_t capacity = 16;
+    while (capacity < expected * 2) capacity *= 2;
+    slots_.assign(capacity, slot{ empty, 0 });
+  }
+
+  // Return the unique index of values[i], adding it if its key has not been seen before.
+  uint32_t insert(size_t i) {
+    if ((firsts_.size() + 1) * 2 > slots_.size()) grow();
+
+    auto key = key_fn_(value(i));
+    uint32_t h = hash(key);
+    size_t mask = slots_.size() - 1;
+    for (size_t s = h & mask; ; s = (s + 1) & mask) {
+      slot &sl = slots_[s];
+      if (sl.id == empty) {
+        sl.id = (uint32_t)firsts_.size();
+        sl.hash = h;
+        firsts_.push_back(i);
+        return sl.id;
+      } else if (sl.hash == h) {
+        auto other = key_fn_(value(firsts_[sl.id]));
+        if (!memcmp(&key, &other, sizeof(key))) return sl.id;
+      }
+    }
+  }
+
+  // indices of the first value with each key, in order of insertion.
+  const std::vector<size_t> &firsts() const { return firsts_; }
+
+  const ValueType &value(size_t i) const { return *(const ValueType *)(values_ + i * stride_); }
+
+private:
+  enum : uint32_t { empty = 0xffffffff };
+
+  struct slot {
+    uint32_t id;
+    uint32_t hash;
+  };
+
+  void grow() {
+    std::vector<slot> old;
+    old.swap(slots_);
+    slots_.assign(old.size() * 2, slot{ empty, 0 });
+    size_t mask = slots_.size() - 1;
+    for (auto &sl : old) {
+      if (sl.id == empty) continue;
+      size_t s = sl.hash & mask;
+      while (slots_[s].id != empty) s = (s + 1) & mask;
+      slots_[s] = sl;
+    }
+  }
+
+  template <class Key>
+  static uint32_t hash(const Key &key) {
+    const uint8_t *p = (const uint8_t *)&key;
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+    size_t i = 0;
+    for (; i + 8 <= sizeof(key); i += 8) {
+      uint64_t w;
+      memcpy(&w, p + i, 8);
+      h = (h ^ w) * 0xff51afd7ed558ccdull;
+      h ^= h >> 32;
+    }
+    for (; i != sizeof(key); ++i) {
+      h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    h ^= h >> 29;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+  }
+
+  std::vector<slot> slots_;
+  std::vector<size_t> firsts_;
+  const uint8_t *values_;
+  size_t stride_;
+  KeyFn key_fn_;
+};
+
+// Weld values with equal keys. values_out receives the first value with each key
+// and idx_out[i] is the index in values_out of the value stride * i bytes after values_in.
+// A stride of zero welds n copies of one value.
+// With more than one thread the input is welded in chunks which are merged in order,
+// so the result does not depend on the number of threads.
+template <class ValueType, class IdxType, class KeyFn, class OutAlloc>
+void weld_by_key(std::vector<ValueType, OutAlloc> &values_out, std::vector<IdxType> &idx_out, const ValueType *values_in, size_t stride, size_t n, KeyFn key_fn, unsigned num_threads = 1) {
+  typedef weld_table<ValueType, KeyFn> table_t;
+  idx_out.resize(n);
+  values_out.resize(0);
+
+  if (num_threads == 0) num_threads = thread_pool::globalThreads();
+  const size_t min_chunk = 0x10000;
+  size_t num_chunks = std::min((size_t)std::max(num_threads, 1u) * 4, n / min_chunk + 1);
+  if (num_threads <= 1) num_chunks = 1;
+
+  if (num_chunks == 1) {
+    table_t table(values_in, stride, key_fn, n);
+    for (size_t i = 0; i != n; ++i) {
+      idx_out[i] = (IdxType)table.insert(i);
+    }
+    values_out.reserve(table.firsts().size());
+    for (size_t f : table.firsts()) values_out.push_back(table.value(f));
+    return;
+  }
+
+  // each chunk welds its own values, idx_out holds the index in the chunk's firsts.
+  std::vector<std::vector<size_t>> firsts(num_chunks);
+  parallel_for(0, (int)num_chunks, [&](int c) {
+    size_t b = n * c / num_chunks, e = n * (c + 1) / num_chunks;
+    table_t table(values_in, stride, key_fn, e - b);
+    for (size_t i = b; i != e; ++i) {
+      idx_out[i] = (IdxType)table.insert(i);
+    }
+    firsts[c] = table.firsts();
+  }, num_threads);
+
+  // merging the chunks' unique values in chunk order keeps values in order of first use.
+  table_t table(values_in, stride, key_fn, n);
+  std::vector<std::vector<IdxType>> remap(num_chunks);
+  for (size_t c = 0; c != num_chunks; ++c) {
+    remap[c].resize(firsts[c].size());
+    for (size_t j = 0; j != firsts[c].size(); ++j) {
+      remap[c][j] = (IdxType)table.insert(firsts[c][j]);
+    }
+  }
+
+  parallel_for(0, (int)num_chunks, [&](int c) {
+    size_t b = n * c / num_chunks, e = n * (c + 1) / num_chunks;
+    for (size_t i = b; i != e; ++i) {
+      idx_out[i] = remap[c][(size_t)idx_out[i]];
+    }
+  }, num_threads);
+
+  values_out.reserve(table.firsts().size());
+  for (size_t f : table.firsts()) values_out.push_back(table.value(f));
+}
+
+template <class ValueType, class IdxType, class KeyFn, class OutAlloc>
+void weld_by_key(std::vector<ValueType, OutAlloc> &values_out, std::vector<IdxType> &idx_out, const std::vector<ValueType> &values_in, KeyFn key_fn, unsigned num_threads = 1) {
+  weld_by_key(values_out, idx_out, values_in.data(), sizeof(ValueType), values_in.size(), key_fn, num_threads);
+}
+
+// Weld bitwise identical values, keeping the unique values in order of first use.
+template <class ValueType, class IdxType, class OutAlloc>
+void weld(std::vector<ValueType, OutAlloc> &values_out, std::vector<IdxType> &idx_out, const std::vector<ValueType> &values_in, unsigned num_threads = 1) {
+  weld_by_key(values_out, idx_out, values_in, [](const ValueType &v) { return v; }, num_threads);
+}
+
+// Weld n values which are stride bytes apart, eg. one attribute of a vertex array.
+template <class ValueType, class IdxType, class OutAlloc>
+void weld(std::vector<ValueType, OutAlloc> &values_out, std::vector<IdxType> &idx_out, const ValueType *values_in, size_t stride, size_t n, unsigned num_threads = 1) {
+  weld_by_key(values_out, idx_out, values_in, stride, n, [](const ValueType &v) { return v; }, num_threads);
+}
+
+// Weld values whose positions round to the same multiple of epsilon and whose other
+// attributes are bitwise identical. values_out keeps the first value of each group.
+// Note that two positions closer than epsilon may still round to different keys.
+template <class ValueType, class IdxType, class OutAlloc>
+void weld_quantized(std::vector<ValueType, OutAlloc> &values_out, std::vector<IdxType> &idx_out, const std::vector<ValueType> &values_in, float epsilon, unsigned num_threads = 1) {
+  if (!(epsilon > 0)) {
+    weld(values_out, idx_out, values_in, num_threads);
+    return;
+  }
+  float recip = 1.0f / epsilon;
+  weld_by_key(values_out, idx_out, values_in, [recip](const ValueType &v) {
+    ValueType key = v;
+    // adding zero turns -0 into +0.
+    weld_position<ValueType>::set(key, glm::floor(weld_position<ValueType>::get(v) * recip + 0.5f) + glm::vec3(0.0f));
+    return key;
+  }, num_threads);
+}
+
+// Weld bitwise identical values by sorting them. values_out is in memcmp order
+// which does not depend on the order of values_in.
+template <class ValueType, class IdxType, class OutAlloc>
+void weld_sorted(std::vector<ValueType, OutAlloc> &values_out, std::vector<IdxType> &idx_out, const std::vector<ValueType> &values_in) {
+  struct evec_t {
+    ValueType v;
+    size_t orginal_idx;
+  };
+
+  std::vector<evec_t> evec(values_in.size());
+  for (size_t i = 0; i != values_in.size(); ++i) {
+    evec[i] = evec_t{ values_in[i], i };
+  }
+
+  std::sort(
+    evec.begin(), evec.end(),
+    [](const evec_t &a, const evec_t &b) { return memcmp(&a.v, &b.v, sizeof(a.v)) < 0; }
+  );
+
+  values_out.resize(0);
+  idx_out.resize(evec.size());
+  for (size_t i = 0; i != evec.size();) {
+    evec_t &e = evec[i];
+    size_t new_idx = values_out.size();
+    values_out.push_back(e.v);
+    idx_out[e.orginal_idx] = (IdxType)new_idx;
+    ++i;
+    while (i != evec.size() && !memcmp(&evec[i].v, &e.v, sizeof(e.v))) {
+      idx_out[evec[i].orginal_idx] = (IdxType)new_idx;
+      ++i;
+    }
+  }
+}
+
+} // meshutils
+
+#endif
@@ -0,0 +1,172 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Tests for arena and meshes that use it.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <meshutils/arena.hpp>
+#include <meshutils/mesh.hpp>
+#include <meshutils/scene.hpp>
+#include <meshutils/mesh_cache.hpp>
+#include <meshutils/encoders/ply_encoder.hpp>
+#include <meshutils/encoders/fbx_encoder.hpp>
+#include <meshutils/decoders/ply_decoder.hpp>
+#include <meshutils/decoders/fbx_decoder.hpp>
+
+#include <sstream>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char *what) {
+    if (!ok) {
+      fprintf(stderr, "FAILED: %s\n", what);
+      ++failures;
+    }
+  }
+
+  typedef meshutils::arena_color_mesh::vertex_t vertex_t;
+  typedef meshutils::arena_allocator<vertex_t> allocator_t;
+
+  // A small blob, like a ligand.
+  struct blob {
+    float operator()(float x, float y, float z) const {
+      x -= 8; y -= 8; z -= 8;
+      return x * x + y * y * 1.5f + z * z - 30.0f;
+    }
+  };
+
+  vertex_t make_vertex(float x, float y, float z) {
+    return vertex_t(glm::vec3(x, y, z), glm::vec3(1, 0, 0), glm::vec2(x, y), glm::vec4(1));
+  }
+
+  template <class A, class B>
+  bool same(const A &a, const B &b) {
+    return a.size() == b.size() && !memcmp(a.data(), b.data(), a.size() * sizeof(a[0]));
+  }
+
+  template <class Mesh>
+  size_t payload(const Mesh &mesh) {
+    return mesh.vertices().size() * sizeof(vertex_t) + mesh.indices().size() * sizeof(uint32_t);
+  }
+
+  void test_reset_merges_blocks() {
+    meshutils::arena a(1024);
+    for (int i = 0; i != 10; ++i) a.allocate(300);
+    check(a.numBlocks() > 1, "small blocks fill up");
+    size_t capacity = a.capacity();
+    a.reset();
+    check(a.numBlocks() == 1 && a.capacity() == capacity, "reset merges the blocks into one");
+    check(a.bytesUsed() == 0, "reset frees everything");
+    for (int i = 0; i != 10; ++i) a.allocate(300);
+    check(a.numBlocks() == 1 && a.capacity() == capacity, "the same job fits in the merged block");
+  }
+
+  void test_reserve_and_large_allocations() {
+    meshutils::arena a(1024);
+    a.reserve(10000);
+    check(a.capacity() >= 10000, "reserve adds a block");
+    a.allocate(9000);
+    check(a.numBlocks() == 1, "a reserved block is used");
+
+    meshutils::arena b(1024);
+    void *p = b.allocate(5000, 64);
+    check(((uintptr_t)p & 63) == 0, "a large allocation is aligned");
+    check(b.capacity() >= 5000, "a large allocation gets a block of its own");
+  }
+
+  void test_deallocate() {
+    meshutils::arena a;
+    void *p = a.allocate(64);
+    void *q = a.allocate(64);
+    size_t used = a.bytesUsed();
+    a.deallocate(p, 64);
+    check(a.bytesUsed() == used, "deallocate of an older allocation does nothing");
+    std::thread other([&a, q] { a.deallocate(q, 64); });
+    other.join();
+    check(a.bytesUsed() < used, "deallocate of the last allocation reuses it, on any thread");
+  }
+
+  // A mesh built with the arena of a thread that then exits keeps its memory.
+  void test_mesh_outlives_thread() {
+    meshutils::color_mesh expected(16, 16, 16, blob(), make_vertex);
+    meshutils::arena_color_mesh mesh;
+    std::thread worker([&mesh] {
+      meshutils::arena_color_mesh m(16, 16, 16, blob(), make_vertex);
+      mesh = std::move(m);
+    });
+    worker.join();
+    check(same(mesh.vertices(), expected.vertices()), "an arena mesh can be used after its thread exits");
+    check(same(mesh.indices(), expected.indices()), "an arena mesh keeps its indices after its thread exits");
+  }
+
+  // Mesh, optimise, save and load many small meshes in one arena, resetting it between them.
+  void test_mesh_batch() {
+    meshutils::arena a;
+    allocator_t alloc(a);
+    size_t capacity = 0;
+    for (int run = 0; run != 4; ++run) {
+      {
+        meshutils::color_mesh expected(16, 16, 16, blob(), make_vertex, 1);
+        meshutils::arena_color_mesh mesh(16, 16, 16, blob(), make_vertex, run % 2 ? 1 : 3, alloc);
+        check(mesh.get_allocator() == alloc, "marching cubes uses the given arena");
+        check(same(mesh.vertices(), expected.vertices()) && same(mesh.indices(), expected.indices()), "an arena mesh is the same as a heap mesh");
+        check(a.bytesUsed() <= payload(mesh) + 64, "marching cubes only keeps the final arrays in the arena");
+
+        size_t used = a.bytesUsed();
+        mesh.reindex(true);
+        mesh.optimizeVertexCache();
+        check(a.bytesUsed() == used, "reindex and optimizeVertexCache reuse the arena buffers");
+
+        std::ostringstream os;
+        meshutils::ply_encoder().encode(mesh, os, false);
+        std::string ply = os.str();
+        meshutils::ply_decoder ply_dec((const uint8_t *)ply.data(), (const uint8_t *)ply.data() + ply.size());
+        meshutils::arena_color_mesh from_ply(alloc);
+        ply_dec.loadMesh(from_ply);
+        check(from_ply.get_allocator() == alloc, "ply_decoder loads into the allocator of the mesh");
+        check(same(from_ply.indices(), mesh.indices()), "a ply round trip keeps the indices");
+
+        std::vector<uint8_t> cache = meshutils::mesh_cache_encoder().save(mesh);
+        meshutils::arena_color_mesh from_cache(alloc);
+        meshutils::mesh_cache_decoder(cache.data(), cache.data() + cache.size()).load(from_cache);
+        check(from_cache.get_allocator() == alloc, "mesh_cache_decoder loads into the allocator of the mesh");
+        check(same(from_cache.vertices(), mesh.vertices()), "a cache round trip keeps the vertices");
+
+        meshutils::scene scene;
+        scene.addMesh(&mesh);
+        scene.addNode(glm::mat4(1.0f), -1, 0);
+        std::vector<uint8_t> fbx = meshutils::fbx_encoder().saveScene(scene);
+        meshutils::fbx_decoder fbx_dec((const char *)fbx.data(), (const char *)fbx.data() + fbx.size());
+        meshutils::scene loaded;
+        fbx_dec.loadScene<meshutils::arena_color_mesh>(loaded, 0, alloc);
+        check(loaded.meshes().size() == 1, "loadScene makes a mesh");
+        for (auto m : loaded.meshes()) {
+          auto *am = static_cast<meshutils::arena_color_mesh *>(m);
+          check(am->get_allocator() == alloc, "loadScene uses the given arena");
+          delete am;
+        }
+      }
+      a.reset();
+      check(a.numBlocks() == 1, "the arena is one block after reset");
+      if (run > 0) check(a.capacity() == capacity, "the next job reuses the arena");
+      capacity = a.capacity();
+    }
+  }
+}
+
+int main() {
+  test_reset_merges_blocks();
+  test_reserve_and_large_allocations();
+  test_deallocate();
+  test_mesh_outlives_thread();
+  test_mesh_batch();
+  if (failures) return 1;
+  printf("arena_test passed\n");
+  return 0;
+}
@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Tests for fbx_decoder.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <meshutils/decoders/fbx_decoder.hpp>
+
+#include <string>
+#include <stdexcept>
+#include <cstdio>
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char *what) {
+    if (!ok) {
+      fprintf(stderr, "FAILED: %s\n", what);
+      ++failures;
+    }
+  }
+
+  void put_u4(std::string &s, size_t offset, uint32_t value) {
+    for (int i = 0; i != 4; ++i) s[offset + i] = (char)(value >> (i * 8));
+  }
+
+  // A file with depth nodes called "A", each the only child of the one before.
+  std::string nested_fbx(int depth) {
+    std::string s("Kaydara FBX Binary  \0\x1a\0", 23);
+    s.append("\xe8\x1c\0\0", 4);
+    std::vector<size_t> starts;
+    for (int i = 0; i != depth; ++i) {
+      starts.push_back(s.size());
+      s.append(13, '\0');
+      s[s.size() - 1] = 1;
+      s += 'A';
+    }
+    for (int i = depth; i-- != 0; ) {
+      s.append(13, '\0');
+      put_u4(s, starts[i], (uint32_t)s.size());
+    }
+    s.append(13, '\0');
+    return s;
+  }
+
+  bool indexes(const std::string &fbx) {
+    try {
+      meshutils::fbx_decoder dec(fbx.data(), fbx.data() + fbx.size(), true);
+      return dec.indexed();
+    } catch (std::runtime_error &) {
+      return false;
+    }
+  }
+
+  // Deep nesting must be an error, not a stack overflow.
+  void test_deep_nesting() {
+    check(indexes(nested_fbx(10)), "a file ten nodes deep is indexed");
+    check(!indexes(nested_fbx(1000000)), "a file a million nodes deep is rejected");
+  }
+}
+
+int main() {
+  test_deep_nesting();
+  if (failures) return 1;
+  printf("fbx_decoder_test passed\n");
+  return 0;
+}
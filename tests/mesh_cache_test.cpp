@@ -0,0 +1,96 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Tests for the mesh cache.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <meshutils/mesh.hpp>
+#include <meshutils/mesh_cache.hpp>
+
+#include <stdexcept>
+#include <cstdio>
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char *what) {
+    if (!ok) {
+      fprintf(stderr, "FAILED: %s\n", what);
+      ++failures;
+    }
+  }
+
+  bool decodes(const std::vector<uint8_t> &bytes) {
+    try {
+      meshutils::mesh_cache_decoder dec(bytes.data(), bytes.data() + bytes.size());
+      return true;
+    } catch (std::runtime_error &) {
+      return false;
+    }
+  }
+
+  void set_u4(std::vector<uint8_t> &bytes, size_t offset, uint32_t value) {
+    for (int i = 0; i != 4; ++i) bytes[offset + i] = (uint8_t)(value >> (i * 8));
+  }
+
+  void set_u8(std::vector<uint8_t> &bytes, size_t offset, uint64_t value) {
+    for (int i = 0; i != 8; ++i) bytes[offset + i] = (uint8_t)(value >> (i * 8));
+  }
+
+  std::vector<uint8_t> make_cache(int compression_level = 0) {
+    typedef meshutils::simple_mesh::vertex_t vertex_t;
+    glm::vec3 normal(0, 0, 1);
+    std::vector<vertex_t> vertices = {
+      vertex_t(glm::vec3(0, 0, 0), normal, glm::vec2(0, 0)),
+      vertex_t(glm::vec3(1, 0, 0), normal, glm::vec2(1, 0)),
+      vertex_t(glm::vec3(0, 1, 0), normal, glm::vec2(0, 1)),
+    };
+    std::vector<uint32_t> indices = { 0, 1, 2 };
+    meshutils::simple_mesh mesh(std::move(vertices), std::move(indices));
+    meshutils::mesh_cache_encoder encoder;
+    encoder.setCompression(compression_level, 0);
+    return encoder.save(mesh);
+  }
+
+  // The header size at byte 12 must leave room for the fixed header and the format string at byte 108.
+  void test_corrupt_header_size() {
+    std::vector<uint8_t> good = make_cache();
+    check(decodes(good), "a good cache decodes");
+
+    for (uint32_t header_size : { 0u, 12u, 107u }) {
+      std::vector<uint8_t> bad = good;
+      set_u4(bad, 12, header_size);
+      check(!decodes(bad), "a header smaller than 108 bytes is rejected");
+    }
+
+    std::vector<uint8_t> bad = good;
+    set_u4(bad, 104, 0xffffffff);
+    check(!decodes(bad), "a format longer than the header is rejected");
+  }
+
+  // A deflated block can not hold more than about a thousand times its size.
+  void test_corrupt_deflated_count() {
+    std::vector<uint8_t> good = make_cache(6);
+    check(decodes(good), "a deflated cache decodes");
+    meshutils::simple_mesh mesh;
+    meshutils::mesh_cache_decoder(good.data(), good.data() + good.size()).load(mesh);
+    check(mesh.vertices().size() == 3 && mesh.indices().size() == 3, "a deflated cache loads");
+
+    std::vector<uint8_t> bad = good;
+    set_u8(bad, 24, (uint64_t)1 << 40);
+    check(!decodes(bad), "a vertex count larger than the deflated block allows is rejected");
+    bad = good;
+    set_u8(bad, 32, (uint64_t)1 << 40);
+    check(!decodes(bad), "an index count larger than the deflated block allows is rejected");
+  }
+}
+
+int main() {
+  test_corrupt_header_size();
+  test_corrupt_deflated_count();
+  if (failures) return 1;
+  printf("mesh_cache_test passed\n");
+  return 0;
+}
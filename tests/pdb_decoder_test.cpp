@@ -0,0 +1,52 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Tests for pdb_decoder.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <meshutils/decoders/pdb_decoder.hpp>
+
+#include <string>
+#include <cstdio>
+#include <cmath>
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char *what) {
+    if (!ok) {
+      fprintf(stderr, "FAILED: %s\n", what);
+      ++failures;
+    }
+  }
+
+  std::vector<float> radii(const std::string &pdb, bool eager) {
+    const uint8_t *begin = (const uint8_t *)pdb.data();
+    meshutils::pdb_decoder dec(begin, begin + pdb.size(), eager);
+    return dec.radii();
+  }
+
+  // The element is in columns 77-78, the last columns of a line without a charge.
+  void test_element_at_end_of_line() {
+    std::string line = "ATOM      2  CA  ALA A   1      11.104   6.134  -6.504  1.00  0.00           C";
+    check(line.size() == 78, "the line is 78 columns");
+    const char *endings[] = { "", "\n", "\r\n" };
+    for (const char *ending : endings) {
+      std::string pdb = line + ending;
+      for (bool eager : { false, true }) {
+        std::vector<float> r = radii(pdb, eager);
+        check(r.size() == 1, "one atom");
+        check(!r.empty() && std::fabs(r[0] - 1.7f) < 1e-6f, "carbon radius at the end of a line");
+      }
+    }
+  }
+}
+
+int main() {
+  test_element_at_end_of_line();
+  if (failures) return 1;
+  printf("pdb_decoder_test passed\n");
+  return 0;
+}
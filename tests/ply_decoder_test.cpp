@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Tests for ply_decoder.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <meshutils/mesh.hpp>
+#include <meshutils/decoders/ply_decoder.hpp>
+
+#include <string>
+#include <stdexcept>
+#include <limits>
+#include <cstdio>
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char *what) {
+    if (!ok) {
+      fprintf(stderr, "FAILED: %s\n", what);
+      ++failures;
+    }
+  }
+
+  bool loads(const std::string &ply) {
+    try {
+      const uint8_t *begin = (const uint8_t *)ply.data();
+      meshutils::ply_decoder dec(begin, begin + ply.size());
+      meshutils::simple_mesh mesh;
+      dec.loadMesh(mesh);
+      return true;
+    } catch (std::runtime_error &) {
+      return false;
+    }
+  }
+
+  const char *ascii_header =
+    "ply\n"
+    "format ascii 1.0\n"
+    "element vertex 3\n"
+    "property float x\n"
+    "property float y\n"
+    "property float z\n"
+    "element other 1\n"
+    "property list uchar float values\n"
+    "element face 1\n"
+    "property list uchar int vertex_indices\n"
+    "end_header\n"
+    "0 0 0\n"
+    "1 0 0\n"
+    "0 1 0\n";
+
+  // Lists of an element that is skipped must have a count that fits in the file.
+  void test_bad_list_counts() {
+    check(loads(std::string(ascii_header) + "2 5 6\n3 0 1 2\n"), "a good file loads");
+    for (const char *count : { "-1", "1e30", "100" }) {
+      check(!loads(std::string(ascii_header) + count + " 5 6\n3 0 1 2\n"), "a bad ascii list count is rejected");
+    }
+
+    // A NaN count in a binary file.
+    std::string binary =
+      "ply\n"
+      "format binary_little_endian 1.0\n"
+      "element other 1\n"
+      "property list float uchar values\n"
+      "end_header\n";
+    float nan = std::numeric_limits<float>::quiet_NaN();
+    binary.append((const char *)&nan, sizeof(nan));
+    binary += "abcd";
+    check(!loads(binary), "a NaN list count is rejected");
+  }
+}
+
+int main() {
+  test_bad_list_counts();
+  if (failures) return 1;
+  printf("ply_decoder_test passed\n");
+  return 0;
+}